@@ -0,0 +1,374 @@
+#pragma once
+#include "CrossThread.h"
+
+//
+// Waiting Pop for the safe queues and the SPSC queues.
+// BlockingQueue< SafeUnboundedQueue<int> > keeps the whole queue interface and adds Pop with a time out:
+// an empty pop spins a little with a pause instruction, then sleeps until a push or the time out.
+// Pushers take the lock and make the wake call only while a consumer sleeps that no wake is on the way to yet.
+// A consumer thread passes its CancelToken to Pop: it then sleeps on its own thread signal, which pushers signal too,
+// so Stop and Terminate wake it at once.
+// With THREAD_TRACE a pop is traced with 0 for a hit, 1 for a catch while spinning, 2 after sleeping
+//
+
+#define BLOCKING_QUEUE_INFINITE ( ~0UL )
+#define BLOCKING_QUEUE_SPIN_MIN 16
+#define BLOCKING_QUEUE_SPIN_MAX 4096
+
+//!
+//!	@brief	Queue with waiting consumers
+//!	@remark	_Queue needs Push and Pop returning bool; PushBatch is forwarded when _Queue has it
+//!
+template<typename _Queue>
+class BlockingQueue : public _Queue
+{
+public:
+	BlockingQueue():m_nWaiters(0),m_nWakePending(0),m_nSpin(BLOCKING_QUEUE_SPIN_MAX),m_pCancelWaiters(NULL),m_nCancelWaiters(0),m_nCancelWakePending(0) {}
+
+	//!
+	//!	@brief	Constructor
+	//!	@param	Arg Constructor argument of _Queue, e.g. capacity
+	//!
+	template<typename _Arg>
+	explicit BlockingQueue( const _Arg & Arg ):_Queue(Arg),m_nWaiters(0),m_nWakePending(0),m_nSpin(BLOCKING_QUEUE_SPIN_MAX),
+		m_pCancelWaiters(NULL),m_nCancelWaiters(0),m_nCancelWakePending(0) {}
+
+	using _Queue::Pop;
+
+	//!
+	//!	@brief	Pushes item and wakes a sleeping consumer
+	//!	@param	Item Item
+	//!	@return	False if the queue is full
+	//!
+	template<typename _Item>
+	inline bool Push( const _Item & Item )
+	{
+		if( !_Queue::Push( Item ) )
+			return false;
+
+		THREAD_TRACE_INSTANT( "queue push", 1 );
+		Notify( 1 );
+		return true;
+	}
+
+	//!
+	//!	@brief	Pushes items and wakes as many sleeping consumers
+	//!	@param	pItems Items
+	//!	@param	nCount Number of items
+	//!	@return	Number of items pushed
+	//!
+	template<typename _Item>
+	size_t PushBatch( const _Item * pItems, size_t nCount )
+	{
+		const size_t nPushed = _Queue::PushBatch( pItems, nCount );
+		THREAD_TRACE_INSTANT( "queue push", nPushed );
+		if( nPushed != 0 )
+			Notify( nPushed );
+		return nPushed;
+	}
+
+	//!
+	//!	@brief	Pops item, waits for one
+	//!	@param	Item Item
+	//!	@param	nMilliseconds Time out, BLOCKING_QUEUE_INFINITE waits without limit
+	//!	@return	False on time out
+	//!
+	template<typename _Item>
+	bool Pop( _Item & Item, unsigned long nMilliseconds )
+	{
+		if( _Queue::Pop( Item ) )
+		{
+			THREAD_TRACE_INSTANT( "queue pop", 0 );
+			return true;
+		}
+		if( nMilliseconds == 0 )
+			return false;
+		if( Spin( Item ) )
+		{
+			THREAD_TRACE_INSTANT( "queue pop", 1 );
+			return true;
+		}
+
+		THREAD_TRACE_BEGIN( "queue wait", nMilliseconds );
+
+		const unsigned long long nStart = ThreadStateSignal::NowMs();
+		ThreadStateLocker alock( m_Signal );
+
+		//
+		// Announce the waiter before the last look, a pusher then has to take the lock before waking
+		//
+		ThreadStateAtomic::Store( m_nWaiters, m_nWaiters + 1 );
+		ThreadStateAtomic::Fence();
+
+		bool bResult;
+		while( !( bResult = _Queue::Pop( Item ) ) )
+		{
+			if( nMilliseconds == BLOCKING_QUEUE_INFINITE )
+			{
+				m_Signal.Wait();
+				TakeWake();
+				continue;
+			}
+
+			const unsigned long long nElapsed = ThreadStateSignal::NowMs() - nStart;
+			if( nElapsed >= nMilliseconds )
+				break;
+			m_Signal.WaitFor( (unsigned long) ( nMilliseconds - nElapsed ) );
+			TakeWake();
+		}
+
+		ThreadStateAtomic::Store( m_nWaiters, m_nWaiters - 1 );
+		THREAD_TRACE_END( "queue wait" );
+		if( bResult )
+			THREAD_TRACE_INSTANT( "queue pop", 2 );
+		return bResult;
+	}
+
+	//!
+	//!	@brief	Pops item, waits for one until cancellation
+	//!	@param	Item Item
+	//!	@param	nMilliseconds Time out, BLOCKING_QUEUE_INFINITE waits until an item comes or the token is cancelled
+	//!	@param	Token Cancel token of the calling thread
+	//!	@return	False on time out or cancellation
+	//!
+	template<typename _Item>
+	bool Pop( _Item & Item, unsigned long nMilliseconds, const CancelToken & Token )
+	{
+		if( _Queue::Pop( Item ) )
+		{
+			THREAD_TRACE_INSTANT( "queue pop", 0 );
+			return true;
+		}
+		if( nMilliseconds == 0 || Token.IsCancelled() )
+			return false;
+		if( Spin( Item ) )
+		{
+			THREAD_TRACE_INSTANT( "queue pop", 1 );
+			return true;
+		}
+
+		THREAD_TRACE_BEGIN( "queue wait", nMilliseconds );
+
+		const unsigned long long nStart = ThreadStateSignal::NowMs();
+		const ThreadStateSignal & Signal = Token.GetSignal();
+		CancelWaiter Waiter;
+
+		//
+		// Announce the waiter before the last look, a pusher then has to take the lock before waking
+		//
+		Waiter.m_pSignal = &Signal;
+		Waiter.m_bWoken = false;
+		{
+			ThreadStateLocker alock( m_Signal );
+			Waiter.m_pNext = m_pCancelWaiters;
+			m_pCancelWaiters = &Waiter;
+			m_nCancelWaiters++;
+			ThreadStateAtomic::Store( m_nWaiters, m_nWaiters + 1 );
+		}
+		ThreadStateAtomic::Fence();
+
+		bool bResult;
+		for( ;; )
+		{
+			{
+				//
+				// Stop, Terminate and pushers all signal under this lock
+				//
+				ThreadStateLocker asignal( Signal );
+				if( ( bResult = _Queue::Pop( Item ) ) || Token.IsCancelled() )
+					break;
+
+				if( nMilliseconds == BLOCKING_QUEUE_INFINITE )
+					Signal.Wait();
+				else
+				{
+					const unsigned long long nElapsed = ThreadStateSignal::NowMs() - nStart;
+					if( nElapsed >= nMilliseconds )
+						break;
+					Signal.WaitFor( (unsigned long) ( nMilliseconds - nElapsed ) );
+				}
+			}
+
+			ThreadStateLocker alock( m_Signal );
+			TakeWake( Waiter );
+		}
+
+		{
+			ThreadStateLocker alock( m_Signal );
+			TakeWake( Waiter );
+
+			CancelWaiter ** ppWaiter = &m_pCancelWaiters;
+			while( *ppWaiter != &Waiter )
+				ppWaiter = &(*ppWaiter)->m_pNext;
+			*ppWaiter = Waiter.m_pNext;
+			m_nCancelWaiters--;
+			ThreadStateAtomic::Store( m_nWaiters, m_nWaiters - 1 );
+		}
+
+		THREAD_TRACE_END( "queue wait" );
+		if( bResult )
+			THREAD_TRACE_INSTANT( "queue pop", 2 );
+		return bResult;
+	}
+
+	//!
+	//!	@brief	Wakes all sleeping consumers, they look at the queue again
+	//!
+	void NotifyAll()
+	{
+		ThreadStateLocker alock( m_Signal );
+		for( CancelWaiter * pWaiter = m_pCancelWaiters; pWaiter != NULL; pWaiter = pWaiter->m_pNext )
+		{
+			if( !pWaiter->m_bWoken )
+				Wake( *pWaiter );
+		}
+		ThreadStateAtomic::Store( m_nWakePending, m_nWaiters );
+		m_Signal.NotifyAll();
+	}
+
+private:
+	BlockingQueue( const BlockingQueue & );
+	BlockingQueue & operator=( const BlockingQueue & );
+
+	//!
+	//!	@brief	Consumer sleeping on the signal of its own thread
+	//!
+	struct CancelWaiter
+	{
+		const ThreadStateSignal *			m_pSignal;						//!< Thread signal the consumer sleeps on
+		CancelWaiter *						m_pNext;						//!< Next waiter
+		bool								m_bWoken;						//!< Signalled and not awake yet
+	};
+
+	//!
+	//!	@brief	Wakes up to nCount sleeping consumers
+	//!	@param	nCount Number of pushed items
+	//!
+	void Notify( size_t nCount )
+	{
+		//
+		// Pairs with the fence after the waiter increment. Consumers already signalled are not signalled again,
+		// so a burst of single pushes takes the lock as many times as there are sleeping consumers
+		//
+		ThreadStateAtomic::Fence();
+		if( ThreadStateAtomic::Load( m_nWaiters ) - ThreadStateAtomic::Load( m_nWakePending ) <= 0 )
+			return;
+
+		ThreadStateLocker alock( m_Signal );
+		const long nSleeping = m_nWaiters - m_nWakePending;
+		if( nSleeping <= 0 )
+			return;
+
+		const long nPlainSleeping = nSleeping - ( m_nCancelWaiters - m_nCancelWakePending );
+		if( nCount > (size_t) nSleeping )
+			nCount = (size_t) nSleeping;
+		ThreadStateAtomic::Store( m_nWakePending, m_nWakePending + (long) nCount );
+
+		//
+		// Consumers with a cancel token first, each sleeps on its own signal
+		//
+		for( CancelWaiter * pWaiter = m_pCancelWaiters; pWaiter != NULL && nCount != 0; pWaiter = pWaiter->m_pNext )
+		{
+			if( !pWaiter->m_bWoken )
+			{
+				Wake( *pWaiter );
+				nCount--;
+			}
+		}
+
+		if( nCount == 0 )
+			return;
+		if( nCount >= (size_t) nPlainSleeping )
+			m_Signal.NotifyAll();
+		else
+		{
+			while( nCount-- != 0 )
+				m_Signal.NotifyOne();
+		}
+	}
+
+	//!
+	//!	@brief	Signals a consumer sleeping with a cancel token, lock must be held
+	//!
+	inline void Wake( CancelWaiter & Waiter )
+	{
+		Waiter.m_bWoken = true;
+		m_nCancelWakePending++;
+
+		ThreadStateLocker asignal( *Waiter.m_pSignal );
+		Waiter.m_pSignal->NotifyAll();
+	}
+
+	//!
+	//!	@brief	Takes one pending wake after a wait returned, lock must be held
+	//!	@remark	A timed out or spurious return may take another consumer's, that costs one extra wake later.
+	//!		The fence orders the decrement before the next look at the queue, a pusher seeing the old count skips the wake
+	//!
+	inline void TakeWake()
+	{
+		if( m_nWakePending > m_nCancelWakePending )
+			ThreadStateAtomic::Store( m_nWakePending, m_nWakePending - 1 );
+		ThreadStateAtomic::Fence();
+	}
+
+	//!
+	//!	@brief	Takes the wake of a consumer with a cancel token after its wait returned, lock must be held
+	//!
+	inline void TakeWake( CancelWaiter & Waiter )
+	{
+		if( Waiter.m_bWoken )
+		{
+			Waiter.m_bWoken = false;
+			m_nCancelWakePending--;
+			ThreadStateAtomic::Store( m_nWakePending, m_nWakePending - 1 );
+		}
+		ThreadStateAtomic::Fence();
+	}
+
+	//!
+	//!	@brief	Polls the queue for up to m_nSpin pauses
+	//!	@param	Item Item
+	//!	@return	True if an item came meanwhile
+	//!	@remark	A catch doubles the next spin, a miss halves it, so an idle queue costs a few pauses per pop
+	//!
+	template<typename _Item>
+	bool Spin( _Item & Item )
+	{
+		const long nSpin = ThreadStateAtomic::LoadRelaxed( m_nSpin );
+
+		for( long i = 0; i < nSpin; ++i )
+		{
+			Pause();
+			if( _Queue::Pop( Item ) )
+			{
+				if( nSpin < BLOCKING_QUEUE_SPIN_MAX )
+					ThreadStateAtomic::Store( m_nSpin, nSpin * 2 );
+				return true;
+			}
+		}
+
+		if( nSpin > BLOCKING_QUEUE_SPIN_MIN )
+			ThreadStateAtomic::Store( m_nSpin, nSpin / 2 );
+		return false;
+	}
+
+	static inline void Pause()
+	{
+#ifndef USE_PTHREAD_THREAD_FORCE
+		YieldProcessor();
+#elif defined( __i386__ ) || defined( __x86_64__ )
+		__builtin_ia32_pause();
+#elif defined( __aarch64__ ) || defined( __arm__ )
+		__asm__ __volatile__( "yield" );
+#endif
+	}
+
+private:
+	volatile long							m_nWaiters;						//!< Sleeping consumers, changed under m_Signal
+	volatile long							m_nWakePending;					//!< Sleeping consumers signalled and not awake yet, changed under m_Signal
+	volatile long							m_nSpin;						//!< Pauses before sleeping
+	CancelWaiter *							m_pCancelWaiters;				//!< Consumers sleeping with a cancel token, under m_Signal
+	long									m_nCancelWaiters;				//!< Their number, under m_Signal
+	long									m_nCancelWakePending;			//!< Those of them signalled and not awake yet, under m_Signal
+	ThreadStateSignal						m_Signal;						//!< Lock and signal of sleeping consumers
+};
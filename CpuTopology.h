@@ -0,0 +1,138 @@
+#ifndef __CPU_TOPOLOGY_H__
+#define __CPU_TOPOLOGY_H__
+
+/*
+ * CPU sets of the process, of its physical cores and of a NUMA node, shared by the thread pool workers and CrossThread.
+ * Header only, so CrossThread does not need ThreadPool.c. CPU indexes are those of sched_setaffinity or of the
+ * Windows affinity mask
+ */
+
+#ifndef WIN32
+#ifndef USE_PTHREAD_THREAD_FORCE
+#define USE_PTHREAD_THREAD_FORCE
+#endif
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifndef USE_PTHREAD_THREAD_FORCE
+#include <Windows.h>
+#define CPU_TOPOLOGY_MAX ( sizeof( DWORD_PTR ) * 8 )
+#else
+#include <sched.h>
+#define CPU_TOPOLOGY_MAX CPU_SETSIZE
+#endif
+
+#define CT_PROCESS 0      /* All CPUs the process may run on */
+#define CT_CORES 1        /* Lowest allowed CPU of every physical core, hyper-threading siblings share its caches */
+#define CT_NUMA_NODE 2    /* Allowed CPUs of a NUMA node */
+
+#ifndef USE_PTHREAD_THREAD_FORCE
+/* Writes the CPUs of a CT_* set in ascending order, pulCpus has room for CPU_TOPOLOGY_MAX. Returns their count */
+static __inline unsigned long GetTopologyCpus( unsigned long ulKind, unsigned long ulNode, unsigned long* pulCpus )
+{
+    DWORD_PTR dwAllowed, dwSystemMask, dwCores = 0;
+    SYSTEM_LOGICAL_PROCESSOR_INFORMATION* pInfo;
+    ULONGLONG ullNode;
+    DWORD dwLength = 0, i;
+    unsigned long ulCpu, ulCount = 0;
+
+    if( !GetProcessAffinityMask( GetCurrentProcess(), &dwAllowed, &dwSystemMask ) )
+        return 0;
+
+    if( CT_NUMA_NODE == ulKind )
+    {
+        if( ulNode > 0xFF || !GetNumaNodeProcessorMask( ( UCHAR )ulNode, &ullNode ) )
+            return 0;
+        dwAllowed &= ( DWORD_PTR )ullNode;
+    }
+    else if( CT_CORES == ulKind )
+    {
+        GetLogicalProcessorInformation( NULL, &dwLength );
+        if( NULL == ( pInfo = ( SYSTEM_LOGICAL_PROCESSOR_INFORMATION* )malloc( dwLength ) ) )
+            return 0;
+        if( GetLogicalProcessorInformation( pInfo, &dwLength ) )
+        {
+            for( i = 0; i < dwLength / sizeof( pInfo[ 0 ] ); ++i )
+            {
+                DWORD_PTR dwMask = pInfo[ i ].ProcessorMask & dwAllowed;
+                if( RelationProcessorCore == pInfo[ i ].Relationship && 0 != dwMask )
+                    dwCores |= dwMask & ( ~dwMask + 1 );
+            }
+        }
+        free( pInfo );
+        dwAllowed = dwCores;
+    }
+
+    for( ulCpu = 0; ulCpu < CPU_TOPOLOGY_MAX; ++ulCpu )
+    {
+        if( dwAllowed & ( ( DWORD_PTR )1 << ulCpu ) )
+            pulCpus[ ulCount++ ] = ulCpu;
+    }
+    return ulCount;
+}
+#else
+/* Reads a sysfs CPU list like "0-3,8,10-11", CPUs past CPU_SETSIZE are dropped */
+static __inline void ReadCpuList( const char* szPath, cpu_set_t* pset )
+{
+    FILE* pFile;
+    unsigned int uiFirst, uiLast;
+    int iCount;
+
+    CPU_ZERO( pset );
+    if( NULL == ( pFile = fopen( szPath, "r" ) ) )
+        return;
+    while( ( iCount = fscanf( pFile, "%u-%u", &uiFirst, &uiLast ) ) >= 1 )
+    {
+        if( 1 == iCount )
+            uiLast = uiFirst;
+        for( ; uiFirst <= uiLast && uiFirst < CPU_SETSIZE; ++uiFirst )
+            CPU_SET( uiFirst, pset );
+        if( ',' != fgetc( pFile ) )
+            break;
+    }
+    fclose( pFile );
+}
+
+/* Writes the CPUs of a CT_* set in ascending order, pulCpus has room for CPU_TOPOLOGY_MAX. Returns their count */
+static __inline unsigned long GetTopologyCpus( unsigned long ulKind, unsigned long ulNode, unsigned long* pulCpus )
+{
+    cpu_set_t cAllowed, cSet;
+    char szPath[ 96 ];
+    unsigned long ulCount = 0;
+    int iCpu, iSibling;
+
+    if( 0 != sched_getaffinity( 0, sizeof( cAllowed ), &cAllowed ) )
+        return 0;
+
+    if( CT_NUMA_NODE == ulKind )
+    {
+        snprintf( szPath, sizeof( szPath ), "/sys/devices/system/node/node%lu/cpulist", ulNode );
+        ReadCpuList( szPath, &cSet );
+        CPU_AND( &cAllowed, &cAllowed, &cSet );
+    }
+
+    for( iCpu = 0; iCpu < CPU_SETSIZE; ++iCpu )
+    {
+        if( !CPU_ISSET( iCpu, &cAllowed ) )
+            continue;
+        if( CT_CORES == ulKind )
+        {
+            snprintf( szPath, sizeof( szPath ), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", iCpu );
+            ReadCpuList( szPath, &cSet );
+            for( iSibling = 0; iSibling < iCpu; ++iSibling )
+            {
+                if( CPU_ISSET( iSibling, &cSet ) && CPU_ISSET( iSibling, &cAllowed ) )
+                    break;
+            }
+            if( iSibling < iCpu )
+                continue;
+        }
+        pulCpus[ ulCount++ ] = ( unsigned long )iCpu;
+    }
+    return ulCount;
+}
+#endif
+
+#endif
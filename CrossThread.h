@@ -1,8 +1,13 @@
 #pragma once
 #include <stdexcept>
 #include <string>
+#include <vector>
+#include <stdio.h>
+#include <string.h>
 #include <cpl/CriticalSection.h>
 #include <cpl/CrossUtils.h>
+#include "ThreadTrace.h"
+#include "CpuTopology.h"
 
 #ifndef WIN32
 #define USE_PTHREAD_THREAD_FORCE
@@ -10,11 +15,18 @@
 #endif
 
 #ifndef USE_PTHREAD_THREAD_FORCE
+#include <intrin.h>
 #include <process.h>
 #include <Windows.h>
 #else
+#include <errno.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #endif
 
 #ifdef WIN32
@@ -80,12 +92,302 @@ typedef enum ThreadPriority
 	TP_High								= 2								//!< High priority
 } ThreadPriority;
 
+//!
+//!	@brief	Thread placement: any CPU, a CPU set, one CPU of a physical core or CPUs of a NUMA node
+//!
+class ThreadAffinity
+{
+public:
+	//!
+	//!	@brief	Placement kind
+	//!
+	typedef enum AffinityMode
+	{
+		TA_Any								= 0,							//!< Any CPU of the process
+		TA_Cpus								= 1,							//!< Listed CPUs
+		TA_Core								= 2,							//!< First CPU of the n-th physical core, wraps around
+		TA_NumaNode							= 3								//!< CPUs of a NUMA node
+	} AffinityMode;
+
+public:
+	ThreadAffinity():m_Mode(TA_Any),m_nIndex(0) {}
+
+	static ThreadAffinity Any() { return ThreadAffinity(); }
+
+	static ThreadAffinity Cpus( const std::vector<unsigned int> & Cpus )
+	{
+		ThreadAffinity Affinity( TA_Cpus, 0 );
+		Affinity.m_Cpus = Cpus;
+		return Affinity;
+	}
+
+	//!
+	//!	@brief	One thread per core: give the n-th thread of a group Core( n )
+	//!
+	static ThreadAffinity Core( unsigned int nCore ) { return ThreadAffinity( TA_Core, nCore ); }
+
+	static ThreadAffinity NumaNode( unsigned int nNode ) { return ThreadAffinity( TA_NumaNode, nNode ); }
+
+	inline AffinityMode GetMode() const { return m_Mode; }
+
+	//!
+	//!	@brief	Resolves the CPUs the thread may run on
+	//!	@param	Cpus CPU indexes
+	//!	@return	False if no CPU of the process matches
+	//!
+	bool GetCpus( std::vector<unsigned int> & Cpus ) const
+	{
+		Cpus.clear();
+		switch( m_Mode )
+		{
+		case TA_Cpus:
+			Cpus = m_Cpus;
+			break;
+
+		case TA_Core:
+			GetTopology( CT_CORES, 0, Cpus );
+			if( !Cpus.empty() )
+				Cpus.assign( 1, Cpus[ m_nIndex % Cpus.size() ] );
+			break;
+
+		case TA_NumaNode:
+			GetTopology( CT_NUMA_NODE, m_nIndex, Cpus );
+			break;
+
+		case TA_Any:
+		default:
+			GetTopology( CT_PROCESS, 0, Cpus );
+			break;
+		}
+		return !Cpus.empty();
+	}
+
+private:
+	ThreadAffinity( AffinityMode Mode, unsigned int nIndex ):m_Mode(Mode),m_nIndex(nIndex) {}
+
+	//!
+	//!	@brief	Gets a CT_* CPU set of CpuTopology.h, the one the thread pool resolves its workers with
+	//!
+	static void GetTopology( unsigned long nKind, unsigned long nNode, std::vector<unsigned int> & Cpus )
+	{
+		std::vector<unsigned long> Found( CPU_TOPOLOGY_MAX );
+		const unsigned long nCount = GetTopologyCpus( nKind, nNode, &Found[ 0 ] );
+		Cpus.assign( Found.begin(), Found.begin() + nCount );
+	}
+
+private:
+	AffinityMode							m_Mode;							//!< Placement kind
+	unsigned int							m_nIndex;						//!< Core or NUMA node index
+	std::vector<unsigned int>				m_Cpus;							//!< CPU set for TA_Cpus
+};
+
+//!
+//!	@brief	Acquire/release access to a thread state word
+//!
+struct ThreadStateAtomic
+{
+#ifdef USE_PTHREAD_THREAD_FORCE
+	static inline long Load( const volatile long & nValue ) { return __atomic_load_n( &nValue, __ATOMIC_ACQUIRE ); }
+	static inline long LoadRelaxed( const volatile long & nValue ) { return __atomic_load_n( &nValue, __ATOMIC_RELAXED ); }
+	static inline void Store( volatile long & nValue, long nNewValue ) { __atomic_store_n( &nValue, nNewValue, __ATOMIC_RELEASE ); }
+	static inline bool CompareExchange( volatile long & nValue, long nExpected, long nNewValue )
+	{
+		return __atomic_compare_exchange_n( &nValue, &nExpected, nNewValue, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE );
+	}
+	static inline void Fence() { __atomic_thread_fence( __ATOMIC_SEQ_CST ); }
+#else
+	static inline long Load( const volatile long & nValue ) { long nResult = nValue; _ReadWriteBarrier(); return nResult; }
+	static inline long LoadRelaxed( const volatile long & nValue ) { return nValue; }
+	static inline void Store( volatile long & nValue, long nNewValue ) { _ReadWriteBarrier(); nValue = nNewValue; }
+	static inline bool CompareExchange( volatile long & nValue, long nExpected, long nNewValue )
+	{
+		return InterlockedCompareExchange( &nValue, nNewValue, nExpected ) == nExpected;
+	}
+	static inline void Fence() { MemoryBarrier(); }
+#endif
+};
+
+//!
+//!	@brief	Lock with condition variable, signals thread state changes
+//!
+class ThreadStateSignal
+{
+public:
+#ifdef USE_PTHREAD_THREAD_FORCE
+	ThreadStateSignal()
+	{
+		pthread_condattr_t attr;
+		pthread_condattr_init( &attr );
+		pthread_condattr_setclock( &attr, CLOCK_MONOTONIC );
+		pthread_cond_init( &m_Cond, &attr );
+		pthread_condattr_destroy( &attr );
+		pthread_mutex_init( &m_Mutex, NULL );
+	}
+
+	~ThreadStateSignal()
+	{
+		pthread_cond_destroy( &m_Cond );
+		pthread_mutex_destroy( &m_Mutex );
+	}
+
+	inline void Lock() const { pthread_mutex_lock( &m_Mutex ); }
+	inline void Unlock() const { pthread_mutex_unlock( &m_Mutex ); }
+	inline void Wait() const { pthread_cond_wait( &m_Cond, &m_Mutex ); }
+	inline void NotifyOne() const { pthread_cond_signal( &m_Cond ); }
+	inline void NotifyAll() const { pthread_cond_broadcast( &m_Cond ); }
+
+	//!
+	//!	@brief	Monotonic clock of WaitFor
+	//!	@return	Milliseconds
+	//!
+	static unsigned long long NowMs()
+	{
+		struct timespec ts;
+		clock_gettime( CLOCK_MONOTONIC, &ts );
+		return (unsigned long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+	}
+
+	//!
+	//!	@brief	Waits for a signal, lock must be held
+	//!	@param	nMilliseconds Time out
+	//!	@return	False on time out
+	//!
+	bool WaitFor( unsigned long nMilliseconds ) const
+	{
+		struct timespec ts;
+		clock_gettime( CLOCK_MONOTONIC, &ts );
+		ts.tv_sec += nMilliseconds / 1000;
+		ts.tv_nsec += (long) ( nMilliseconds % 1000 ) * 1000000L;
+		if( ts.tv_nsec >= 1000000000L )
+		{
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		return pthread_cond_timedwait( &m_Cond, &m_Mutex, &ts ) != ETIMEDOUT;
+	}
+
+private:
+	mutable pthread_mutex_t					m_Mutex;						//!< State lock
+	mutable pthread_cond_t					m_Cond;							//!< State changed signal
+#else
+	ThreadStateSignal()
+	{
+		InitializeCriticalSection( &m_Lock );
+		InitializeConditionVariable( &m_Cond );
+	}
+
+	~ThreadStateSignal()
+	{
+		DeleteCriticalSection( &m_Lock );
+	}
+
+	inline void Lock() const { EnterCriticalSection( &m_Lock ); }
+	inline void Unlock() const { LeaveCriticalSection( &m_Lock ); }
+	inline void Wait() const { SleepConditionVariableCS( &m_Cond, &m_Lock, INFINITE ); }
+	inline void NotifyOne() const { WakeConditionVariable( &m_Cond ); }
+	inline void NotifyAll() const { WakeAllConditionVariable( &m_Cond ); }
+
+	//!
+	//!	@brief	Monotonic clock of WaitFor
+	//!	@return	Milliseconds
+	//!
+	static unsigned long long NowMs() { return GetTickCount64(); }
+
+	//!
+	//!	@brief	Waits for a signal, lock must be held
+	//!	@param	nMilliseconds Time out
+	//!	@return	False on time out
+	//!
+	bool WaitFor( unsigned long nMilliseconds ) const
+	{
+		return SleepConditionVariableCS( &m_Cond, &m_Lock, nMilliseconds ) || GetLastError() != ERROR_TIMEOUT;
+	}
+
+private:
+	mutable CRITICAL_SECTION				m_Lock;							//!< State lock
+	mutable CONDITION_VARIABLE				m_Cond;							//!< State changed signal
+#endif
+
+private:
+	ThreadStateSignal( const ThreadStateSignal & );
+	ThreadStateSignal & operator=( const ThreadStateSignal & );
+};
+
+//!
+//!	@brief	Scoped lock of ThreadStateSignal
+//!
+class ThreadStateLocker
+{
+public:
+	explicit ThreadStateLocker( const ThreadStateSignal & Signal ):m_Signal(Signal) { m_Signal.Lock(); }
+	~ThreadStateLocker() { m_Signal.Unlock(); }
+
+private:
+	ThreadStateLocker( const ThreadStateLocker & );
+	ThreadStateLocker & operator=( const ThreadStateLocker & );
+
+private:
+	const ThreadStateSignal &				m_Signal;						//!< Locked signal
+};
+
+//!
+//!	@brief	Cooperative cancellation of OnRun
+//!	@remark	The token is cancelled while Stop or Terminate is requested and the thread has not left OnRun yet.
+//!		Polling is a single relaxed load of the requested thread state
+//!
+class CancelToken
+{
+public:
+	CancelToken( const volatile long & NewState, long nRunState, const ThreadStateSignal & Signal ):m_NewState(NewState),m_nRunState(nRunState),m_Signal(Signal) {}
+
+	//!
+	//!	@brief	Checks if OnRun should return
+	//!	@return	True/false
+	//!
+	inline bool IsCancelled() const
+	{
+		return ThreadStateAtomic::LoadRelaxed( m_NewState ) != m_nRunState;
+	}
+
+	//!
+	//!	@brief	Sleeps, wakes up on cancellation
+	//!	@param	nMilliseconds Time out
+	//!	@return	False if cancelled
+	//!
+	bool SleepFor( unsigned long nMilliseconds ) const
+	{
+		const unsigned long long nStart = ThreadStateSignal::NowMs();
+		ThreadStateLocker alock( m_Signal );
+
+		while( !IsCancelled() )
+		{
+			const unsigned long long nElapsed = ThreadStateSignal::NowMs() - nStart;
+			if( nElapsed >= nMilliseconds )
+				return true;
+			m_Signal.WaitFor( (unsigned long) ( nMilliseconds - nElapsed ) );
+		}
+		return false;
+	}
+
+	//!
+	//!	@brief	Gets signal of the thread state
+	//!	@return	Signal, a wait on it under its lock wakes up on cancellation
+	//!
+	inline const ThreadStateSignal & GetSignal() const { return m_Signal; }
+
+private:
+	CancelToken & operator=( const CancelToken & );
+
+private:
+	const volatile long &					m_NewState;						//!< Requested thread state
+	const long								m_nRunState;					//!< Requested state while not cancelled
+	const ThreadStateSignal &				m_Signal;						//!< Signal of state changes
+};
+
 //!
 //!	@brief	Thread template class
-//!	@remark	main disadvantages:
-//!		- critical section using - replace by atomics
-//!		- sleep using on stop
-//!		- after terminate, thread class useless
+//!	@remark	State words are atomics, the lock is taken only to park and to signal a change.
+//!		Main disadvantage: after terminate, thread class useless
 //!
 template<typename _ThreadImp, typename _ThreadType>
 class ThreadMainImplement : public ThreadMainCall
@@ -116,6 +418,25 @@ public:
 			throw std::runtime_error( "Create thread failed" );
 	}
 
+	//!
+	//!	@brief	Constructor
+	//!	@param	Priority Thread base priority
+	//!	@param	Affinity Thread placement
+	//!	@throw	std::exception with error description
+	//!
+	ThreadMainImplement( ThreadPriority Priority, const ThreadAffinity & Affinity ):m_nThreadID(0),m_ThreadState(TS_Stop),m_ThreadNewState(TS_Stop)
+	{
+		if( !ThreadImplementation::createThread( m_hThread, this, m_nThreadID, Priority ) )
+			throw std::runtime_error( "Create thread failed" );
+
+		if( !SetAffinity( Affinity ) )
+		{
+			Terminate( true );
+			ThreadImplementation::FinalThread( m_hThread );
+			throw std::runtime_error( "Set thread affinity failed" );
+		}
+	}
+
 	virtual ~ThreadMainImplement()
 	{
 		//
@@ -132,8 +453,7 @@ public:
 	//!
 	ThreadState GetThreadState() const
 	{
-		CSLocker alock( m_Lock );
-		return m_ThreadState;
+		return (ThreadState) ThreadStateAtomic::Load( m_ThreadState );
 	}
 
 	//!
@@ -142,8 +462,7 @@ public:
 	//!
 	ThreadState GetThreadNewState() const
 	{
-		CSLocker alock( m_Lock );
-		return m_ThreadNewState;
+		return (ThreadState) ThreadStateAtomic::Load( m_ThreadNewState );
 	}
 
 	//!
@@ -173,8 +492,58 @@ public:
 		ThreadImplementation::SetThreadName( m_nThreadID, sName );
 	}
 
+	//!
+	//!	@brief	Pins thread to CPUs
+	//!	@param	Affinity Thread placement, ThreadAffinity::Any() releases pinning
+	//!	@return	True/false
+	//!
+	bool SetAffinity( const ThreadAffinity & Affinity )
+	{
+		std::vector<unsigned int> Cpus;
+		if( !Affinity.GetCpus( Cpus ) )
+			return false;
+		return ThreadImplementation::setAffinity( m_hThread, Cpus );
+	}
+
+	//!
+	//!	@brief	Gets token cancelled by Stop and Terminate
+	//!	@return	Token of this thread
+	//!
+	inline CancelToken GetCancelToken() const
+	{
+		return CancelToken( m_ThreadNewState, TS_Running, m_Signal );
+	}
+
+	//!
+	//!	@brief	Cancels thread cooperatively: requests termination and waits until the thread leaves OnRun
+	//!	@param	nMilliseconds Time out
+	//!	@return	False if the thread still runs after time out
+	//!
+	bool Cancel( unsigned long nMilliseconds )
+	{
+		ChangeThreadState( TS_Terminating );
+
+		const unsigned long long nStart = ThreadStateSignal::NowMs();
+		ThreadStateLocker alock( m_Signal );
+
+		while( ThreadStateAtomic::Load( m_ThreadState ) != TS_Terminating )
+		{
+			const unsigned long long nElapsed = ThreadStateSignal::NowMs() - nStart;
+			if( nElapsed >= nMilliseconds )
+				return false;
+
+			//
+			// A thread killed from outside never signals
+			//
+			if( !m_Signal.WaitFor( (unsigned long) ( nMilliseconds - nElapsed < 100 ? nMilliseconds - nElapsed : 100 ) ) && !IsThreadAlive() )
+				return true;
+		}
+		return true;
+	}
+
 	//!
 	//!	@brief	Terminate thread
+	//!	@remark	Kills the thread wherever it is, locks it holds stay locked. Last resort after Cancel has timed out
 	//!
 	inline void TerminateThread()
 	{
@@ -267,6 +636,16 @@ private:
 		return -4;
 	}
 
+	//!
+	//!	@brief	Main thread function with cancellation
+	//!	@param	Token Cancelled by Stop and Terminate, long loops poll it and return 0
+	//!	@return	Continue error code, 0 - if continue work, else terminate thread
+	//!
+	virtual int OnRun( const CancelToken & /* Token */ )
+	{
+		return OnRun();
+	}
+
 private:
 	ThreadMainImplement( const ThreadMainImplement & );
 	ThreadMainImplement & operator=( const ThreadMainImplement & );
@@ -279,11 +658,38 @@ protected:
 	//!
 	inline void SetThreadState( ThreadState NewState, bool bNewState = true )
 	{
-		CSLocker alock( m_Lock );
 		if( bNewState )
-			m_ThreadNewState = NewState;
+		{
+			//
+			// Once requested, termination is never overridden by Run/Stop
+			//
+			long nCurState;
+			do
+			{
+				nCurState = ThreadStateAtomic::Load( m_ThreadNewState );
+				if( nCurState == TS_Terminating )
+					break;
+			} while( !ThreadStateAtomic::CompareExchange( m_ThreadNewState, nCurState, NewState ) );
+		}
 		else
-			m_ThreadState = NewState;
+			ThreadStateAtomic::Store( m_ThreadState, NewState );
+
+		//
+		// Waiters check the state under the lock, taking it here closes the gap before they park
+		//
+		ThreadStateLocker alock( m_Signal );
+		m_Signal.NotifyAll();
+	}
+
+	//!
+	//!	@brief	Parks the thread while no new state is requested
+	//!	@param	State Current new state
+	//!
+	inline void WaitForNewState( ThreadState State ) const
+	{
+		ThreadStateLocker alock( m_Signal );
+		while( ThreadStateAtomic::Load( m_ThreadNewState ) == State )
+			m_Signal.Wait();
 	}
 
 	//!
@@ -320,11 +726,13 @@ protected:
 		if( !IsThreadAlive() )
 			return false;
 
-		ThreadState nCurState;
+		ThreadStateLocker alock( m_Signal );
+
+		long nCurState;
 
-		while( (nCurState = GetThreadState()) != WaitState )
+		while( (nCurState = ThreadStateAtomic::Load( m_ThreadState )) != WaitState )
 		{
-			if( nCurState == TS_Terminating || !IsThreadAlive() )
+			if( nCurState == TS_Terminating )
 			{
 				//
 				// Terminating
@@ -332,7 +740,11 @@ protected:
 				return false;
 			}
 
-			sys::SleepMillisec( 100 );
+			//
+			// A thread killed from outside never signals, check it on time out
+			//
+			if( !m_Signal.WaitFor( 100 ) && !IsThreadAlive() )
+				return false;
 		}
 
 		return true;
@@ -342,12 +754,14 @@ public:
 	virtual int mainThread()
 	{
 		//
-		// Initialize thread
+		// Initialize thread, OnStart may give the thread its own trace name
 		//
+		THREAD_TRACE_NAME( "CrossThread" );
 		if( !OnStart() )
 			return -1;
 
 		int32_t nResult = 0;
+		const CancelToken Token = GetCancelToken();
 
 		ThreadState nState = TS_Stop, nPrevState = TS_Stop;
 		while( nResult == 0 )
@@ -363,6 +777,7 @@ public:
 				// State changed, update thread state
 				//
 				nPrevState = nState;
+				THREAD_TRACE_INSTANT( "state", nState );
 				SetThreadState( nState, false );
 				continue;
 			}
@@ -370,9 +785,11 @@ public:
 			if( nState == TS_Stop )
 			{
 				//
-				// Thread stopped, delay
+				// Thread stopped, park until Run or Terminate
 				//
-				sys::SleepMillisec( 1000 );
+				THREAD_TRACE_BEGIN( "stopped", 0 );
+				WaitForNewState( TS_Stop );
+				THREAD_TRACE_END( "stopped" );
 				continue;
 			}
 			else if( nState == TS_Terminating )
@@ -387,7 +804,9 @@ public:
 			//
 			// Call original thread main implementation
 			//
-			nResult = OnRun();
+			THREAD_TRACE_BEGIN( "OnRun", 0 );
+			nResult = OnRun( Token );
+			THREAD_TRACE_END( "OnRun" );
 		}
 
 		OnExit( nResult );
@@ -399,9 +818,9 @@ public:
 private:
 	Handle									m_hThread;						//!< Thread handle
 	size_t									m_nThreadID;					//!< Thread ID
-	ThreadState								m_ThreadState;					//!< Thread current state
-	ThreadState								m_ThreadNewState;				//!< Thread new state
-	CriticalSection							m_Lock;							//!< Lock for thread state synchronization
+	volatile long							m_ThreadState;					//!< Thread current state
+	volatile long							m_ThreadNewState;				//!< Thread new state
+	ThreadStateSignal						m_Signal;						//!< Lock and signal for thread state synchronization
 };
 
 #ifdef USE_PTHREAD_THREAD_FORCE
@@ -410,6 +829,15 @@ private:
 //!
 class ThreadImplementPthread
 {
+	//!
+	//!	@brief	Thread start parameters
+	//!
+	struct StartParam
+	{
+		ThreadMainCall *					m_pThreadWrap;					//!< Thread main
+		ThreadPriority						m_Priority;						//!< Thread priority
+	};
+
 public:
 	static void * MainThread( void * pParam )
 	{
@@ -421,47 +849,96 @@ public:
 		sigfillset( &signal_mask );
 		pthread_sigmask( SIG_BLOCK, &signal_mask, NULL );
 
+		StartParam * pStart = (StartParam *) pParam;
+		ThreadMainCall * pThreadWrap = pStart->m_pThreadWrap;
+		setCurrentPriority( pStart->m_Priority );
+		delete pStart;
+
 		//
 		// Regular thread main
 		//
-		ThreadMainCall * pThreadWrap = (ThreadMainCall *) pParam;
 		size_t nResult = pThreadWrap->mainThread();
 		pthread_exit( NULL );
 		return (void *) nResult;
 	}
 
-	static void FinalThread( pthread_t thrID )
+	//!
+	//!	@brief	Maps priority to the scheduler of the calling thread
+	//!	@param	Priority Thread priority
+	//!	@remark	TP_High asks for SCHED_FIFO, without CAP_SYS_NICE it falls back to SCHED_OTHER with nice -5.
+	//!		TP_Low is SCHED_OTHER with nice 10, TP_Normal keeps SCHED_OTHER with the inherited nice value
+	//!
+	static void setCurrentPriority( ThreadPriority Priority )
 	{
+		struct sched_param sp;
+		memset( &sp, 0, sizeof(sp) );
+
+		switch( Priority )
+		{
+		case TP_High:
+			sp.sched_priority = sched_get_priority_min( SCHED_FIFO );
+			if( pthread_setschedparam( pthread_self(), SCHED_FIFO, &sp ) == 0 )
+				break;
+			setCurrentNice( -5 );
+			break;
+
+		case TP_Low:
+			setCurrentNice( 10 );
+			break;
+
+		case TP_Normal:
+		default:
+			break;
+		}
 	}
 
-	static bool createThread( pthread_t & thrID, ThreadMainCall * thrImpl, size_t & nID, ThreadPriority Priority )
+	//!
+	//!	@brief	Sets nice value of the calling thread
+	//!	@param	nNice Nice value
+	//!	@remark	Linux keeps nice per thread, elsewhere it is per process and left untouched
+	//!
+	static void setCurrentNice( int nNice )
 	{
-		if( thrImpl == NULL )
-			return false;
-
-		pthread_attr_t tattr;
-		int ret = pthread_attr_init( &tattr );
+#if defined(__linux__) && defined(SYS_gettid)
+		setpriority( PRIO_PROCESS, (id_t) syscall( SYS_gettid ), nNice );
+#endif
+	}
 
+	static bool setAffinity( pthread_t thrID, const std::vector<unsigned int> & Cpus )
+	{
+		cpu_set_t Set;
+		CPU_ZERO( &Set );
+		for( size_t i = 0; i < Cpus.size(); ++i )
 		{
-			//
-			// Set priority
-			//
-
-			struct sched_param sp;
-			int policy;
+			if( Cpus[ i ] < CPU_SETSIZE )
+				CPU_SET( Cpus[ i ], &Set );
+		}
+		return pthread_setaffinity_np( thrID, sizeof(Set), &Set ) == 0;
+	}
 
-			memset( &sp, 0, sizeof(sp) );
-			sp.sched_priority = Priority;
+	static void FinalThread( pthread_t thrID )
+	{
+	}
 
-			pthread_attr_setschedparam( &tattr, &sp );
-		}
+	static bool createThread( pthread_t & thrID, ThreadMainCall * thrImpl, size_t & nID, ThreadPriority Priority )
+	{
+		if( thrImpl == NULL )
+			return false;
 
-		ret = pthread_create( &thrID, &tattr, MainThread, thrImpl );
+		//
+		// Priority is applied by the thread itself: nice values are per thread and known only from inside
+		//
+		StartParam * pStart = new StartParam;
+		pStart->m_pThreadWrap = thrImpl;
+		pStart->m_Priority = Priority;
 
-		pthread_attr_destroy( &tattr );
+		int ret = pthread_create( &thrID, NULL, MainThread, pStart );
 
 		if( ret != 0 )
+		{
+			delete pStart;
 			return false;
+		}
 		nID = thrID;
 		return true;
 	}
@@ -543,6 +1020,17 @@ public:
 		CloseHandle( thrID );
 	}
 
+	static bool setAffinity( HANDLE thrID, const std::vector<unsigned int> & Cpus )
+	{
+		DWORD_PTR nMask = 0;
+		for( size_t i = 0; i < Cpus.size(); ++i )
+		{
+			if( Cpus[ i ] < sizeof(nMask) * 8 )
+				nMask |= (DWORD_PTR) 1 << Cpus[ i ];
+		}
+		return nMask != 0 && SetThreadAffinityMask( thrID, nMask ) != 0;
+	}
+
 	static bool endThread( HANDLE thrID )
 	{
 		return !!::TerminateThread( thrID, 0 );
@@ -589,6 +1077,17 @@ public:
 		CloseHandle( thrID );
 	}
 
+	static bool setAffinity( HANDLE thrID, const std::vector<unsigned int> & Cpus )
+	{
+		DWORD_PTR nMask = 0;
+		for( size_t i = 0; i < Cpus.size(); ++i )
+		{
+			if( Cpus[ i ] < sizeof(nMask) * 8 )
+				nMask |= (DWORD_PTR) 1 << Cpus[ i ];
+		}
+		return nMask != 0 && SetThreadAffinityMask( thrID, nMask ) != 0;
+	}
+
 	static bool createThread( HANDLE & thrID, ThreadMainCall * thrImpl, size_t & nID, ThreadPriority Priority )
 	{
 		if( thrImpl == NULL )
@@ -666,12 +1165,25 @@ public:
 	//!
 	typedef int (_NeighborClass::* NeighborCallBack)();
 
+	//!
+	//!	@brief	Type definition of class function polling cancellation
+	//!
+	typedef int (_NeighborClass::* NeighborCancelCallBack)( const CancelToken & );
+
 	//!
 	//!	@brief	Default constructor
 	//!	@param	Priority Base priority
 	//!	@throw	std::exception with error description
 	//!
-	CrossThreadNeighbor( ThreadPriority Priority = TP_Normal ):CrossThread(Priority), m_Neighbor(NULL), m_Function(NULL) {}
+	CrossThreadNeighbor( ThreadPriority Priority = TP_Normal ):CrossThread(Priority), m_Neighbor(NULL), m_Function(NULL), m_CancelFunction(NULL) {}
+
+	//!
+	//!	@brief	Constructor
+	//!	@param	Priority Base priority
+	//!	@param	Affinity Thread placement
+	//!	@throw	std::exception with error description
+	//!
+	CrossThreadNeighbor( ThreadPriority Priority, const ThreadAffinity & Affinity ):CrossThread(Priority, Affinity), m_Neighbor(NULL), m_Function(NULL), m_CancelFunction(NULL) {}
 
 	//!
 	//!	@brief	Sets new function
@@ -689,12 +1201,34 @@ public:
 
 		m_Neighbor = Neighbor;
 		m_Function = Function;
+		m_CancelFunction = NULL;
+		return true;
+	}
+
+	//!
+	//!	@brief	Sets new function polling cancellation
+	//!	@param	Neighbor Class object
+	//!	@param	Function Method of class taking the cancel token
+	//!	@return	True/false
+	//!	@remark	Not a SetData overload: SetData( NULL, NULL ) clears the function and must stay unambiguous
+	//!
+	inline bool SetCancelData( _NeighborClass * Neighbor, NeighborCancelCallBack Function )
+	{
+		if( GetThreadState() != CrossThread::TS_Stop )
+			return false;
+
+		if( Neighbor && Function == NULL )
+			return false;
+
+		m_Neighbor = Neighbor;
+		m_Function = NULL;
+		m_CancelFunction = Function;
 		return true;
 	}
 
 	virtual int OnRun()
 	{
-		if( m_Neighbor == NULL )
+		if( m_Neighbor == NULL || m_Function == NULL )
 			return -1;
 
 		//
@@ -703,7 +1237,22 @@ public:
 		return (m_Neighbor->*m_Function)();
 	}
 
+	virtual int OnRun( const CancelToken & Token )
+	{
+		if( m_CancelFunction == NULL )
+			return OnRun();
+
+		if( m_Neighbor == NULL )
+			return -1;
+
+		//
+		// Call owner's function polling cancellation
+		//
+		return (m_Neighbor->*m_CancelFunction)( Token );
+	}
+
 private:
 	_NeighborClass *						m_Neighbor;						//!< Neighbor class object
 	NeighborCallBack						m_Function;						//!< Neighbor method
+	NeighborCancelCallBack					m_CancelFunction;				//!< Neighbor method polling cancellation
 };
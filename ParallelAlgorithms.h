@@ -0,0 +1,599 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <iterator>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "ThreadPool.h"
+
+//
+// Data parallel loops on top of ThreadPool (C++11): ParallelFor, ParallelReduce, ParallelScan, ParallelSort and ParallelInvoke.
+// Ranges are split lazily: a thread runs its range in growing chunks and hands the upper half to the pool only while
+// no task waits there, so the grain adapts to the load and an idle worker gets work at once.
+// The calling thread takes a share of the work and then runs waiting pool tasks until its own ones are done,
+// it does not wait for unrelated tasks the way ThreadPoolJoinAll does.
+// An exception thrown by a body stops the chunks not started yet and is rethrown to the caller
+//
+
+#define PARALLEL_SORT_CUTOFF 2048
+#define PARALLEL_MERGE_CUTOFF 4096
+
+namespace ParallelDetail
+{
+	//!
+	//!	@brief	Runs waiting pool tasks until the group is done
+	//!	@param	Pool Thread pool
+	//!	@param	Group Tasks to wait for
+	//!	@remark	With nothing to run it sleeps in short slices, a running piece may still split
+	//!
+	inline void HelpWait( SThreadPool * Pool, STaskGroup * Group )
+	{
+		while( !TryWaitTaskGroup( Group ) )
+		{
+			if( !RunThreadPoolTask( Pool ) )
+				WaitTaskGroupTimeout( Group, 1 );
+		}
+	}
+
+	//!
+	//!	@brief	First exception of a parallel call
+	//!
+	class ErrorSlot
+	{
+	public:
+		ErrorSlot():m_Failed(false) {}
+
+		inline bool Failed() const { return m_Failed.load( std::memory_order_relaxed ); }
+
+		inline void Set( std::exception_ptr Exception )
+		{
+			if( !m_Failed.exchange( true ) )
+				m_Exception = Exception;
+		}
+
+		//!
+		//!	@brief	Forgets the exception before the next run
+		//!
+		inline void Reset()
+		{
+			m_Exception = std::exception_ptr();
+			m_Failed.store( false );
+		}
+
+		//!
+		//!	@brief	Rethrows the kept exception, call after all tasks are done
+		//!
+		inline void Rethrow() const
+		{
+			if( m_Exception )
+				std::rethrow_exception( m_Exception );
+		}
+
+	private:
+		std::atomic<bool>								m_Failed;						//!< An exception was thrown
+		std::exception_ptr								m_Exception;					//!< First exception
+	};
+
+	//!
+	//!	@brief	Frees the argument of a task the pool did not accept
+	//!
+	inline void FreeRejected( SThreadPoolTask & Task )
+	{
+		if( Task.m_pPars != TP_INLINE_PARS )
+			FreeTaskArg( Task.m_pPars );
+	}
+
+	//!
+	//!	@brief	Lazy binary splitting of an index range
+	//!	@remark	_Body provides State, Open( Begin ), Chunk( State, Begin, End ) and Close( State, Begin, End ).
+	//!		A piece of the range opens a state, runs its chunks and closes it with the part it has run
+	//!
+	template<typename _Index, typename _Body>
+	class RangeSplitter
+	{
+	public:
+		RangeSplitter( SThreadPool * Pool, _Index Grain, _Body & Body ):m_Pool(Pool),m_Grain(Grain < 1 ? 1 : Grain),m_Body(Body)
+		{
+			InitTaskGroup( &m_Group, 0 );
+		}
+
+		//!
+		//!	@brief	Runs the range on the calling thread and the pool
+		//!	@param	Begin First index
+		//!	@param	End Index after the last one
+		//!	@throw	Exception thrown by the body
+		//!
+		void Run( _Index Begin, _Index End )
+		{
+			RunPiece( Begin, End );
+			HelpWait( m_Pool, &m_Group );
+			m_Error.Rethrow();
+		}
+
+	private:
+		RangeSplitter( const RangeSplitter & );
+		RangeSplitter & operator=( const RangeSplitter & );
+
+		//!
+		//!	@brief	Task argument, trivially copyable so it can travel inside the task
+		//!
+		struct Piece
+		{
+			RangeSplitter *								m_Splitter;						//!< Owner
+			_Index										m_Begin;						//!< First index
+			_Index										m_End;							//!< Index after the last one
+		};
+
+		static void RunQueued( void * Pars )
+		{
+			const Piece Part = *static_cast<Piece*>( Pars );
+
+			Part.m_Splitter->RunPiece( Part.m_Begin, Part.m_End );
+			DoneTaskGroup( &Part.m_Splitter->m_Group, 1 );
+		}
+
+		//!
+		//!	@brief	Runs a piece, splits off its upper half whenever the pool has nothing to do
+		//!	@remark	Chunks double while nobody is hungry, so the check is rare for cheap bodies
+		//!
+		void RunPiece( _Index Begin, _Index End )
+		{
+			try
+			{
+				typename _Body::State State( m_Body.Open( Begin ) );
+				_Index Current = Begin, Chunk = m_Grain;
+
+				while( Current < End && !m_Error.Failed() )
+				{
+					const _Index Middle = Current + ( End - Current ) / 2;
+					if( End - Current >= 2 * m_Grain && IsThreadPoolHungry( m_Pool ) && Fork( Middle, End ) )
+					{
+						End = Middle;
+						Chunk = m_Grain;
+						continue;
+					}
+
+					const _Index Last = End - Current > Chunk ? Current + Chunk : End;
+					m_Body.Chunk( State, Current, Last );
+					Current = Last;
+					if( Chunk < ( End - Current ) / 4 )
+						Chunk *= 2;
+				}
+				m_Body.Close( State, Begin, Current );
+			}
+			catch( ... )
+			{
+				m_Error.Set( std::current_exception() );
+			}
+		}
+
+		//!
+		//!	@brief	Queues a piece
+		//!	@return	False if the pool is stopping, the caller keeps the range
+		//!
+		bool Fork( _Index Begin, _Index End )
+		{
+			SThreadPoolTask Task;
+			Piece * const Part = static_cast<Piece*>( AllocateTaskInline( m_Pool, &Task, sizeof(Piece) ) );
+
+			Part->m_Splitter = this;
+			Part->m_Begin = Begin;
+			Part->m_End = End;
+			Task.m_pFunc = &RunQueued;
+
+			AddTaskGroup( &m_Group, 1 );
+			if( 0 != PutTasksInQueue( m_Pool, &Task, 1 ) )
+				return true;
+
+			FreeRejected( Task );
+			DoneTaskGroup( &m_Group, 1 );
+			return false;
+		}
+
+	private:
+		SThreadPool *									m_Pool;							//!< Thread pool
+		const _Index									m_Grain;						//!< Smallest chunk
+		_Body &											m_Body;							//!< Chunk runner
+		STaskGroup										m_Group;						//!< Queued pieces
+		ErrorSlot										m_Error;						//!< First exception
+	};
+
+	//!
+	//!	@brief	Pieces of ParallelFor, Function( Begin, End ) runs a chunk
+	//!
+	template<typename _Index, typename _Func>
+	class ForBody
+	{
+	public:
+		struct State {};
+
+		explicit ForBody( const _Func & Function ):m_Function(Function) {}
+
+		inline State Open( _Index ) { return State(); }
+		inline void Chunk( State &, _Index Begin, _Index End ) { m_Function( Begin, End ); }
+		inline void Close( State &, _Index, _Index ) {}
+
+	private:
+		ForBody & operator=( const ForBody & );
+
+	private:
+		const _Func &									m_Function;						//!< User function
+	};
+
+	//!
+	//!	@brief	Pieces of ParallelReduce, each closed piece leaves its partial value
+	//!
+	template<typename _Index, typename _Value, typename _Func>
+	class ReduceBody
+	{
+	public:
+		typedef _Value State;
+
+		//!
+		//!	@brief	Partial value of a piece
+		//!
+		struct Partial
+		{
+			Partial( _Index Begin, _Index End, _Value && Value ):m_Begin(Begin),m_End(End),m_Value(std::move(Value)),m_Next(NULL) {}
+
+			_Index										m_Begin;						//!< First index
+			_Index										m_End;							//!< Index after the last one
+			_Value										m_Value;						//!< Value of the piece
+			Partial *									m_Next;							//!< Next closed piece
+		};
+
+		ReduceBody( const _Value & Identity, const _Func & Function ):m_Identity(Identity),m_Function(Function),m_Partials(NULL) {}
+
+		~ReduceBody()
+		{
+			for( Partial * Part = m_Partials.load(); Part != NULL; )
+			{
+				Partial * const Next = Part->m_Next;
+				delete Part;
+				Part = Next;
+			}
+		}
+
+		inline _Value Open( _Index ) { return m_Identity; }
+		inline void Chunk( _Value & Value, _Index Begin, _Index End ) { Value = m_Function( Begin, End, Value ); }
+
+		void Close( _Value & Value, _Index Begin, _Index End )
+		{
+			Partial * const Part = new Partial( Begin, End, std::move( Value ) );
+
+			Part->m_Next = m_Partials.load( std::memory_order_relaxed );
+			while( !m_Partials.compare_exchange_weak( Part->m_Next, Part, std::memory_order_release, std::memory_order_relaxed ) )
+				;
+		}
+
+		//!
+		//!	@brief	Gets partial values in index order, call after the run
+		//!	@param	Parts Partial values, owned by the body
+		//!
+		void GetPartials( std::vector<Partial*> & Parts ) const
+		{
+			Parts.clear();
+			for( Partial * Part = m_Partials.load( std::memory_order_acquire ); Part != NULL; Part = Part->m_Next )
+				Parts.push_back( Part );
+			std::sort( Parts.begin(), Parts.end(), &Before );
+		}
+
+	private:
+		ReduceBody & operator=( const ReduceBody & );
+
+		static bool Before( const Partial * Left, const Partial * Right ) { return Left->m_Begin < Right->m_Begin; }
+
+	private:
+		const _Value &									m_Identity;						//!< Start value of a piece
+		const _Func &									m_Function;						//!< User function
+		std::atomic<Partial*>							m_Partials;						//!< Closed pieces
+	};
+
+	//!
+	//!	@brief	ParallelInvoke state: the queued function and its completion
+	//!
+	template<typename _Func>
+	struct InvokeBox
+	{
+		static void RunQueued( void * Pars )
+		{
+			const InvokeBox Box = *static_cast<InvokeBox*>( Pars );
+			try
+			{
+				( *Box.m_Function )();
+			}
+			catch( ... )
+			{
+				Box.m_Error->Set( std::current_exception() );
+			}
+			DoneTaskGroup( Box.m_Group, 1 );
+		}
+
+		const _Func *									m_Function;						//!< Queued function
+		STaskGroup *									m_Group;						//!< Completion
+		ErrorSlot *										m_Error;						//!< Exception of the queued function
+	};
+
+	template<typename _Iter, typename _Out, typename _Compare>
+	void ParallelMerge( SThreadPool * Pool, _Iter First1, _Iter Last1, _Iter First2, _Iter Last2, _Out Result, const _Compare & Compare );
+
+	template<typename _Iter, typename _Buffer, typename _Compare>
+	void SortInto( SThreadPool * Pool, _Iter First, _Iter Last, _Buffer Result, const _Compare & Compare );
+
+	template<typename _Iter, typename _Buffer, typename _Compare>
+	void SortInPlace( SThreadPool * Pool, _Iter First, _Iter Last, _Buffer Scratch, const _Compare & Compare );
+}
+
+//!
+//!	@brief	Runs two functions, the second one on the pool if a worker is idle
+//!	@param	Pool Thread pool
+//!	@param	Function1 Runs on the calling thread
+//!	@param	Function2 Runs on the pool or after Function1
+//!	@throw	Exception thrown by one of the functions
+//!
+template<typename _Func1, typename _Func2>
+void ParallelInvoke( SThreadPool * Pool, const _Func1 & Function1, const _Func2 & Function2 )
+{
+	typedef ParallelDetail::InvokeBox<_Func2> Box;
+
+	if( !IsThreadPoolHungry( Pool ) )
+	{
+		Function1();
+		Function2();
+		return;
+	}
+
+	STaskGroup Group;
+	ParallelDetail::ErrorSlot Error;
+	SThreadPoolTask Task;
+	Box * const Queued = static_cast<Box*>( AllocateTaskInline( Pool, &Task, sizeof(Box) ) );
+
+	Queued->m_Function = &Function2;
+	Queued->m_Group = &Group;
+	Queued->m_Error = &Error;
+	Task.m_pFunc = &Box::RunQueued;
+
+	InitTaskGroup( &Group, 1 );
+	if( 0 == PutTasksInQueue( Pool, &Task, 1 ) )
+	{
+		ParallelDetail::FreeRejected( Task );
+		Function1();
+		Function2();
+		return;
+	}
+
+	try
+	{
+		Function1();
+	}
+	catch( ... )
+	{
+		Error.Set( std::current_exception() );
+	}
+	ParallelDetail::HelpWait( Pool, &Group );
+	Error.Rethrow();
+}
+
+//!
+//!	@brief	Runs Function( Begin, End ) over chunks of [Begin, End)
+//!	@param	Pool Thread pool
+//!	@param	Begin First index
+//!	@param	End Index after the last one
+//!	@param	Function Runs a chunk, called concurrently
+//!	@param	Grain Smallest chunk
+//!	@throw	Exception thrown by Function
+//!
+template<typename _Index, typename _Func>
+void ParallelFor( SThreadPool * Pool, _Index Begin, _Index End, const _Func & Function, _Index Grain = 1 )
+{
+	static_assert( std::is_integral<_Index>::value, "Index must be integral" );
+	typedef ParallelDetail::ForBody<_Index, _Func> Body;
+
+	if( !( Begin < End ) )
+		return;
+
+	Body Chunks( Function );
+	ParallelDetail::RangeSplitter<_Index, Body> Splitter( Pool, Grain, Chunks );
+	Splitter.Run( Begin, End );
+}
+
+//!
+//!	@brief	Reduces [Begin, End): chunk values Function( Begin, End, Value ) are joined in index order
+//!	@param	Pool Thread pool
+//!	@param	Begin First index
+//!	@param	End Index after the last one
+//!	@param	Identity Start value of a chunk, must not change the result when joined
+//!	@param	Function Returns Value combined with the chunk, called concurrently
+//!	@param	Join Combines two values, associative
+//!	@param	Grain Smallest chunk
+//!	@return	Reduced value, Identity for an empty range
+//!	@throw	Exception thrown by Function
+//!
+template<typename _Index, typename _Value, typename _Func, typename _Join>
+_Value ParallelReduce( SThreadPool * Pool, _Index Begin, _Index End, const _Value & Identity, const _Func & Function, const _Join & Join, _Index Grain = 1 )
+{
+	static_assert( std::is_integral<_Index>::value, "Index must be integral" );
+	typedef ParallelDetail::ReduceBody<_Index, _Value, _Func> Body;
+
+	if( !( Begin < End ) )
+		return Identity;
+
+	Body Chunks( Identity, Function );
+	ParallelDetail::RangeSplitter<_Index, Body> Splitter( Pool, Grain, Chunks );
+	Splitter.Run( Begin, End );
+
+	std::vector<typename Body::Partial*> Parts;
+	Chunks.GetPartials( Parts );
+
+	_Value Result = std::move( Parts[ 0 ]->m_Value );
+	for( size_t i = 1; i < Parts.size(); ++i )
+		Result = Join( Result, Parts[ i ]->m_Value );
+	return Result;
+}
+
+//!
+//!	@brief	Inclusive prefix scan: Result[ i ] = Op( ... Op( Op( Identity, First[ 0 ] ), First[ 1 ] ) ..., First[ i ] )
+//!	@param	Pool Thread pool
+//!	@param	First First input
+//!	@param	Last Input end
+//!	@param	Result First output, may be First
+//!	@param	Identity Neutral value of Op
+//!	@param	Op Associative operation
+//!	@param	Grain Smallest chunk
+//!	@remark	Two passes: chunk sums in parallel, then every chunk scans again from the sum of the chunks before it
+//!
+template<typename _InIter, typename _OutIter, typename _Value, typename _Op>
+void ParallelScan( SThreadPool * Pool, _InIter First, _InIter Last, _OutIter Result, const _Value & Identity, const _Op & Op, size_t Grain = 1 )
+{
+	if( !( First < Last ) )
+		return;
+
+	auto Sum = [&]( size_t Begin, size_t End, _Value Value ) -> _Value
+	{
+		for( size_t i = Begin; i < End; ++i )
+			Value = Op( Value, First[ i ] );
+		return Value;
+	};
+
+	typedef ParallelDetail::ReduceBody<size_t, _Value, decltype( Sum )> Body;
+	Body Sums( Identity, Sum );
+	{
+		ParallelDetail::RangeSplitter<size_t, Body> Splitter( Pool, Grain, Sums );
+		Splitter.Run( 0, (size_t) ( Last - First ) );
+	}
+
+	std::vector<typename Body::Partial*> Parts;
+	Sums.GetPartials( Parts );
+
+	//
+	// Partial sums become the start values of the second pass
+	//
+	_Value Carry = Identity;
+	for( size_t i = 0; i < Parts.size(); ++i )
+	{
+		_Value Next = Op( Carry, Parts[ i ]->m_Value );
+		Parts[ i ]->m_Value = std::move( Carry );
+		Carry = std::move( Next );
+	}
+
+	ParallelFor( Pool, (size_t) 0, Parts.size(), [&]( size_t Begin, size_t End )
+	{
+		for( size_t k = Begin; k < End; ++k )
+		{
+			_Value Value = Parts[ k ]->m_Value;
+			for( size_t i = Parts[ k ]->m_Begin; i < Parts[ k ]->m_End; ++i )
+			{
+				Value = Op( Value, First[ i ] );
+				Result[ i ] = Value;
+			}
+		}
+	} );
+}
+
+//!
+//!	@brief	Stable parallel merge sort
+//!	@param	Pool Thread pool
+//!	@param	First First element
+//!	@param	Last Element end
+//!	@param	Compare Strict weak order
+//!	@remark	Needs a buffer of Last - First default constructed elements. Halves are sorted and merged in parallel,
+//!		a merge splits at the median of its longer input
+//!
+template<typename _Iter, typename _Compare>
+void ParallelSort( SThreadPool * Pool, _Iter First, _Iter Last, const _Compare & Compare )
+{
+	typedef typename std::iterator_traits<_Iter>::value_type Value;
+
+	if( Last - First <= PARALLEL_SORT_CUTOFF )
+	{
+		std::stable_sort( First, Last, Compare );
+		return;
+	}
+
+	std::vector<Value> Scratch( Last - First );
+	ParallelDetail::SortInPlace( Pool, First, Last, Scratch.begin(), Compare );
+}
+
+template<typename _Iter>
+void ParallelSort( SThreadPool * Pool, _Iter First, _Iter Last )
+{
+	ParallelSort( Pool, First, Last, std::less<typename std::iterator_traits<_Iter>::value_type>() );
+}
+
+namespace ParallelDetail
+{
+	//!
+	//!	@brief	Moves the merge of two sorted runs to Result, elements of the first run go first among equal ones
+	//!
+	template<typename _Iter, typename _Out, typename _Compare>
+	void ParallelMerge( SThreadPool * Pool, _Iter First1, _Iter Last1, _Iter First2, _Iter Last2, _Out Result, const _Compare & Compare )
+	{
+		if( ( Last1 - First1 ) + ( Last2 - First2 ) <= PARALLEL_MERGE_CUTOFF )
+		{
+			std::merge( std::make_move_iterator( First1 ), std::make_move_iterator( Last1 ), std::make_move_iterator( First2 ), std::make_move_iterator( Last2 ), Result, Compare );
+			return;
+		}
+
+		_Iter Middle1, Middle2;
+		if( Last1 - First1 >= Last2 - First2 )
+		{
+			Middle1 = First1 + ( Last1 - First1 ) / 2;
+			Middle2 = std::lower_bound( First2, Last2, *Middle1, Compare );
+		}
+		else
+		{
+			Middle2 = First2 + ( Last2 - First2 ) / 2;
+			Middle1 = std::upper_bound( First1, Last1, *Middle2, Compare );
+		}
+
+		const _Out Upper = Result + ( Middle1 - First1 ) + ( Middle2 - First2 );
+		ParallelInvoke( Pool,
+			[&]() { ParallelMerge( Pool, First1, Middle1, First2, Middle2, Result, Compare ); },
+			[&]() { ParallelMerge( Pool, Middle1, Last1, Middle2, Last2, Upper, Compare ); } );
+	}
+
+	//!
+	//!	@brief	Sorts [First, Last) and moves it to Result, the source is left moved-from
+	//!
+	template<typename _Iter, typename _Buffer, typename _Compare>
+	void SortInto( SThreadPool * Pool, _Iter First, _Iter Last, _Buffer Result, const _Compare & Compare )
+	{
+		if( Last - First <= PARALLEL_SORT_CUTOFF )
+		{
+			std::stable_sort( First, Last, Compare );
+			std::move( First, Last, Result );
+			return;
+		}
+
+		const _Iter Middle = First + ( Last - First ) / 2;
+		const _Buffer ResultMiddle = Result + ( Middle - First );
+		ParallelInvoke( Pool,
+			[&]() { SortInPlace( Pool, First, Middle, Result, Compare ); },
+			[&]() { SortInPlace( Pool, Middle, Last, ResultMiddle, Compare ); } );
+		ParallelMerge( Pool, First, Middle, Middle, Last, Result, Compare );
+	}
+
+	//!
+	//!	@brief	Sorts [First, Last) with a scratch range of the same length
+	//!
+	template<typename _Iter, typename _Buffer, typename _Compare>
+	void SortInPlace( SThreadPool * Pool, _Iter First, _Iter Last, _Buffer Scratch, const _Compare & Compare )
+	{
+		if( Last - First <= PARALLEL_SORT_CUTOFF )
+		{
+			std::stable_sort( First, Last, Compare );
+			return;
+		}
+
+		const _Iter Middle = First + ( Last - First ) / 2;
+		const _Buffer ScratchMiddle = Scratch + ( Middle - First );
+		const _Buffer ScratchLast = Scratch + ( Last - First );
+		ParallelInvoke( Pool,
+			[&]() { SortInto( Pool, First, Middle, Scratch, Compare ); },
+			[&]() { SortInto( Pool, Middle, Last, ScratchMiddle, Compare ); } );
+		ParallelMerge( Pool, Scratch, ScratchMiddle, ScratchMiddle, ScratchLast, First, Compare );
+	}
+}
@@ -0,0 +1,294 @@
+#pragma once
+#include "CrossThread.h"
+#include "ThreadPool.h"
+
+//
+// CrossThreadNeighbor semantics on a shared ThreadPool.
+// Every callback call is one pool task that queues the next call itself, so dozens of mostly idle neighbors
+// share the pool workers instead of owning a thread and a stack each. Between two calls a neighbor goes to the
+// back of its pool lane, other neighbors and pool tasks get their turn. This holds in a TPF_WORK_STEALING pool too:
+// the next call skips the worker's own deque, which would be served before any lane.
+// A callback must return after a slice of work: one that blocks holds a pool worker
+//
+
+//!
+//!	@brief	Neighbor callback driven by a thread pool
+//!	@remark	The pool must outlive the neighbor. The callback never runs on two workers at once
+//!
+template<typename _NeighborClass>
+class PooledThreadNeighbor
+{
+public:
+	typedef typename CrossThreadNeighbor<_NeighborClass>::NeighborCallBack NeighborCallBack;
+	typedef typename CrossThreadNeighbor<_NeighborClass>::NeighborCancelCallBack NeighborCancelCallBack;
+	typedef CrossThread::ThreadState ThreadState;
+
+public:
+	//!
+	//!	@brief	Constructor
+	//!	@param	pPool Pool running the callback
+	//!	@param	nPriority Pool lane of the callback, TP_PRIORITY_*
+	//!
+	explicit PooledThreadNeighbor( SThreadPool * pPool, unsigned long nPriority = TP_PRIORITY_NORMAL ):
+		m_pPool(pPool), m_nPriority(nPriority), m_ThreadState(CrossThread::TS_Stop), m_ThreadNewState(CrossThread::TS_Stop),
+		m_bScheduled(false), m_Neighbor(NULL), m_Function(NULL), m_CancelFunction(NULL) {}
+
+	~PooledThreadNeighbor()
+	{
+		Terminate( true );
+	}
+
+	//!
+	//!	@brief	Sets new function
+	//!	@param	Neighbor Class object
+	//!	@param	Function Method of class
+	//!	@return	True/false
+	//!
+	inline bool SetData( _NeighborClass * Neighbor, NeighborCallBack Function )
+	{
+		if( GetThreadState() != CrossThread::TS_Stop )
+			return false;
+
+		if( Neighbor && Function == NULL )
+			return false;
+
+		m_Neighbor = Neighbor;
+		m_Function = Function;
+		m_CancelFunction = NULL;
+		return true;
+	}
+
+	//!
+	//!	@brief	Sets new function polling cancellation
+	//!	@param	Neighbor Class object
+	//!	@param	Function Method of class taking the cancel token
+	//!	@return	True/false
+	//!	@remark	Not a SetData overload: SetData( NULL, NULL ) clears the function and must stay unambiguous
+	//!
+	inline bool SetCancelData( _NeighborClass * Neighbor, NeighborCancelCallBack Function )
+	{
+		if( GetThreadState() != CrossThread::TS_Stop )
+			return false;
+
+		if( Neighbor && Function == NULL )
+			return false;
+
+		m_Neighbor = Neighbor;
+		m_Function = NULL;
+		m_CancelFunction = Function;
+		return true;
+	}
+
+	//!
+	//!	@brief	Gets current state
+	//!	@return	State
+	//!
+	ThreadState GetThreadState() const
+	{
+		return (ThreadState) ThreadStateAtomic::Load( m_ThreadState );
+	}
+
+	//!
+	//!	@brief	Gets new state
+	//!	@return	State
+	//!
+	ThreadState GetThreadNewState() const
+	{
+		return (ThreadState) ThreadStateAtomic::Load( m_ThreadNewState );
+	}
+
+	//!
+	//!	@brief	Gets token cancelled by Stop and Terminate
+	//!	@return	Token of this neighbor
+	//!
+	inline CancelToken GetCancelToken() const
+	{
+		return CancelToken( m_ThreadNewState, CrossThread::TS_Running, m_Signal );
+	}
+
+	//!
+	//!	@brief	Runs callback
+	//!	@param	bWait Wait until callback runs or neighbor terminated
+	//!	@return	True;False if neighbor terminated
+	//!
+	inline bool Run( bool bWait = false ) { ChangeThreadState( CrossThread::TS_Running ); if( bWait ) return WaitForStatus( CrossThread::TS_Running ); return true; }
+
+	//!
+	//!	@brief	Stops callback
+	//!	@param	bWait Wait until the current callback call returns or neighbor terminated
+	//!	@return	True;False if neighbor terminated
+	//!
+	inline bool Stop( bool bWait = false ) { ChangeThreadState( CrossThread::TS_Stop ); if( bWait ) return WaitForStatus( CrossThread::TS_Stop ); return true; }
+
+	//!
+	//!	@brief	Terminates neighbor
+	//!	@param	bWait Wait until no callback call is queued or running
+	//!
+	inline void Terminate( bool bWait = true ) { ChangeThreadState( CrossThread::TS_Terminating ); if( bWait ) WaitForIdle(); }
+
+private:
+	PooledThreadNeighbor( const PooledThreadNeighbor & );
+	PooledThreadNeighbor & operator=( const PooledThreadNeighbor & );
+
+	//!
+	//!	@brief	Requests new state and queues a step to apply it
+	//!	@param	NewState New state
+	//!
+	void ChangeThreadState( ThreadState NewState )
+	{
+		bool bSchedule;
+		{
+			ThreadStateLocker alock( m_Signal );
+
+			//
+			// Once requested, termination is never overridden by Run/Stop
+			//
+			if( ThreadStateAtomic::Load( m_ThreadNewState ) == CrossThread::TS_Terminating )
+				return;
+			ThreadStateAtomic::Store( m_ThreadNewState, NewState );
+			m_Signal.NotifyAll();
+
+			bSchedule = !m_bScheduled;
+			m_bScheduled = true;
+		}
+
+		if( bSchedule )
+			PutStep();
+	}
+
+	//!
+	//!	@brief	Queues next step
+	//!
+	void PutStep()
+	{
+		SThreadPoolTask task;
+		void * pPars = AllocateTaskInline( m_pPool, &task, sizeof(PooledThreadNeighbor *) );
+
+		*(PooledThreadNeighbor **) pPars = this;
+		task.m_pFunc = &Step;
+		if( 0 != PutTasksInQueueEx( m_pPool, &task, 1, m_nPriority | TP_PRIORITY_GLOBAL ) )
+			return;
+
+		//
+		// Pool is stopping, the neighbor ends as a thread of an exiting process
+		//
+		if( task.m_pPars != TP_INLINE_PARS )
+			FreeTaskArg( task.m_pPars );
+
+		ThreadStateLocker alock( m_Signal );
+		ThreadStateAtomic::Store( m_ThreadNewState, CrossThread::TS_Terminating );
+		ThreadStateAtomic::Store( m_ThreadState, CrossThread::TS_Terminating );
+		m_bScheduled = false;
+		m_Signal.NotifyAll();
+	}
+
+	static void Step( void * pPars )
+	{
+		( *(PooledThreadNeighbor **) pPars )->RunStep();
+	}
+
+	//!
+	//!	@brief	Applies requested state and makes one callback call
+	//!
+	void RunStep()
+	{
+		const CancelToken Token = GetCancelToken();
+
+		for( ;; )
+		{
+			const ThreadState nState = GetThreadNewState();
+
+			if( nState != GetThreadState() )
+			{
+				ThreadStateLocker alock( m_Signal );
+				ThreadStateAtomic::Store( m_ThreadState, nState );
+				m_Signal.NotifyAll();
+			}
+
+			if( nState == CrossThread::TS_Running )
+			{
+				if( OnRun( Token ) == 0 )
+				{
+					//
+					// Recurring: next call goes to the back of the lane, not to this worker's deque
+					//
+					PutStep();
+					return;
+				}
+
+				//
+				// Callback asked to exit, same as a returning thread
+				//
+				ThreadStateLocker alock( m_Signal );
+				ThreadStateAtomic::Store( m_ThreadNewState, CrossThread::TS_Terminating );
+				continue;
+			}
+
+			//
+			// Stopped or terminated, the step chain ends unless a new state came meanwhile
+			//
+			ThreadStateLocker alock( m_Signal );
+			if( ThreadStateAtomic::Load( m_ThreadNewState ) == nState )
+			{
+				m_bScheduled = false;
+				m_Signal.NotifyAll();
+				return;
+			}
+		}
+	}
+
+	int OnRun( const CancelToken & Token )
+	{
+		if( m_Neighbor == NULL )
+			return -1;
+
+		//
+		// Call owner's function
+		//
+		if( m_CancelFunction != NULL )
+			return (m_Neighbor->*m_CancelFunction)( Token );
+		return (m_Neighbor->*m_Function)();
+	}
+
+	//!
+	//!	@brief	Wait while neighbor changes its state
+	//!	@param	WaitState Wait state
+	//!	@return	True/false
+	//!
+	bool WaitForStatus( ThreadState WaitState )
+	{
+		ThreadStateLocker alock( m_Signal );
+
+		long nCurState;
+
+		while( (nCurState = ThreadStateAtomic::Load( m_ThreadState )) != WaitState )
+		{
+			if( nCurState == CrossThread::TS_Terminating )
+				return false;
+			m_Signal.Wait();
+		}
+
+		return true;
+	}
+
+	//!
+	//!	@brief	Waits until no step is queued or running
+	//!
+	void WaitForIdle()
+	{
+		ThreadStateLocker alock( m_Signal );
+		while( m_bScheduled )
+			m_Signal.Wait();
+	}
+
+private:
+	SThreadPool *							m_pPool;						//!< Pool running the callback
+	unsigned long							m_nPriority;					//!< Pool lane
+	volatile long							m_ThreadState;					//!< Current state
+	volatile long							m_ThreadNewState;				//!< New state
+	bool									m_bScheduled;					//!< A step is queued or running, guarded by m_Signal
+	ThreadStateSignal						m_Signal;						//!< Lock and signal for state synchronization
+	_NeighborClass *						m_Neighbor;						//!< Neighbor class object
+	NeighborCallBack						m_Function;						//!< Neighbor method
+	NeighborCancelCallBack					m_CancelFunction;				//!< Neighbor method polling cancellation
+};
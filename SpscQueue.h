@@ -0,0 +1,411 @@
+#pragma once
+#include <stddef.h>
+#include <new>
+
+#ifndef WIN32
+#define USE_PTHREAD_THREAD_FORCE
+#endif
+
+#ifndef USE_PTHREAD_THREAD_FORCE
+#include <windows.h>
+#include <intrin.h>
+#endif
+
+//
+// Single producer / single consumer queues for CrossThreadNeighbor producer-consumer pairs.
+// The producer and the consumer each own one index and keep a cached copy of the other one, so the shared
+// cache line is read only when the cached value says full or empty. Batch calls publish an index once per batch.
+// Exactly one thread may push and exactly one thread may pop; GetCount is a snapshot from any thread
+//
+
+#define SPSC_CACHE_LINE_SIZE 64
+
+//!
+//!	@brief	Index publication between the producer and the consumer
+//!
+struct SpscAtomic
+{
+#ifdef USE_PTHREAD_THREAD_FORCE
+	static inline size_t Load( const volatile size_t & nValue ) { return __atomic_load_n( &nValue, __ATOMIC_ACQUIRE ); }
+	static inline void Store( volatile size_t & nValue, size_t nNewValue ) { __atomic_store_n( &nValue, nNewValue, __ATOMIC_RELEASE ); }
+
+	template<typename _Type>
+	static inline _Type * LoadPtr( _Type * const volatile & pValue ) { return __atomic_load_n( &pValue, __ATOMIC_ACQUIRE ); }
+
+	template<typename _Type>
+	static inline void StorePtr( _Type * volatile & pValue, _Type * pNewValue ) { __atomic_store_n( &pValue, pNewValue, __ATOMIC_RELEASE ); }
+#else
+	static inline size_t Load( const volatile size_t & nValue ) { size_t nResult = nValue; _ReadWriteBarrier(); return nResult; }
+	static inline void Store( volatile size_t & nValue, size_t nNewValue ) { _ReadWriteBarrier(); nValue = nNewValue; }
+
+	template<typename _Type>
+	static inline _Type * LoadPtr( _Type * const volatile & pValue ) { _Type * pResult = pValue; _ReadWriteBarrier(); return pResult; }
+
+	template<typename _Type>
+	static inline void StorePtr( _Type * volatile & pValue, _Type * pNewValue ) { _ReadWriteBarrier(); pValue = pNewValue; }
+#endif
+};
+
+//!
+//!	@brief	Bounded SPSC ring
+//!	@remark	Capacity is rounded up to a power of two
+//!
+template<typename _Type>
+class SpscBoundedQueue
+{
+public:
+	//!
+	//!	@brief	Constructor
+	//!	@param	nCapacity Maximum number of items
+	//!
+	explicit SpscBoundedQueue( size_t nCapacity = 1024 ):m_nTail(0),m_nHeadCache(0),m_nHead(0),m_nTailCache(0)
+	{
+		size_t nSize = 2;
+		while( nSize < nCapacity )
+			nSize <<= 1;
+
+		m_pItems = new _Type[ nSize ];
+		m_nMask = nSize - 1;
+	}
+
+	~SpscBoundedQueue()
+	{
+		delete[] m_pItems;
+	}
+
+	//!
+	//!	@brief	Pushes item, producer only
+	//!	@param	Item Item
+	//!	@return	False if the queue is full
+	//!
+	inline bool Push( const _Type & Item )
+	{
+		const size_t nTail = m_nTail;
+		if( nTail - m_nHeadCache > m_nMask )
+		{
+			m_nHeadCache = SpscAtomic::Load( m_nHead );
+			if( nTail - m_nHeadCache > m_nMask )
+				return false;
+		}
+
+		m_pItems[ nTail & m_nMask ] = Item;
+		SpscAtomic::Store( m_nTail, nTail + 1 );
+		return true;
+	}
+
+	//!
+	//!	@brief	Pushes items as far as there is room, producer only
+	//!	@param	pItems Items
+	//!	@param	nCount Number of items
+	//!	@return	Number of items pushed
+	//!
+	size_t PushBatch( const _Type * pItems, size_t nCount )
+	{
+		const size_t nTail = m_nTail;
+		size_t nFree = m_nMask + 1 - ( nTail - m_nHeadCache );
+		if( nFree < nCount )
+		{
+			m_nHeadCache = SpscAtomic::Load( m_nHead );
+			nFree = m_nMask + 1 - ( nTail - m_nHeadCache );
+			if( nCount > nFree )
+				nCount = nFree;
+		}
+
+		for( size_t i = 0; i < nCount; ++i )
+			m_pItems[ ( nTail + i ) & m_nMask ] = pItems[ i ];
+		if( nCount != 0 )
+			SpscAtomic::Store( m_nTail, nTail + nCount );
+		return nCount;
+	}
+
+	//!
+	//!	@brief	Pops item, consumer only
+	//!	@param	Item Item
+	//!	@return	False if the queue is empty
+	//!
+	inline bool Pop( _Type & Item )
+	{
+		const size_t nHead = m_nHead;
+		if( nHead == m_nTailCache )
+		{
+			m_nTailCache = SpscAtomic::Load( m_nTail );
+			if( nHead == m_nTailCache )
+				return false;
+		}
+
+		Item = m_pItems[ nHead & m_nMask ];
+		SpscAtomic::Store( m_nHead, nHead + 1 );
+		return true;
+	}
+
+	//!
+	//!	@brief	Pops up to nCount items, consumer only
+	//!	@param	pItems Items
+	//!	@param	nCount Room in pItems
+	//!	@return	Number of items popped
+	//!
+	size_t PopBatch( _Type * pItems, size_t nCount )
+	{
+		const size_t nHead = m_nHead;
+		if( m_nTailCache - nHead < nCount )
+		{
+			m_nTailCache = SpscAtomic::Load( m_nTail );
+			if( m_nTailCache - nHead < nCount )
+				nCount = m_nTailCache - nHead;
+		}
+
+		for( size_t i = 0; i < nCount; ++i )
+			pItems[ i ] = m_pItems[ ( nHead + i ) & m_nMask ];
+		if( nCount != 0 )
+			SpscAtomic::Store( m_nHead, nHead + nCount );
+		return nCount;
+	}
+
+	//!
+	//!	@brief	Drops all items, consumer only
+	//!
+	void Clear()
+	{
+		SpscAtomic::Store( m_nHead, m_nTailCache = SpscAtomic::Load( m_nTail ) );
+	}
+
+	//!
+	//!	@brief	Gets number of items
+	//!	@return	Snapshot of item count
+	//!
+	inline size_t GetCount() const
+	{
+		const size_t nHead = SpscAtomic::Load( m_nHead );
+		return SpscAtomic::Load( m_nTail ) - nHead;
+	}
+
+	inline size_t GetMaxSize() const { return m_nMask + 1; }
+
+private:
+	SpscBoundedQueue( const SpscBoundedQueue & );
+	SpscBoundedQueue & operator=( const SpscBoundedQueue & );
+
+private:
+	_Type *									m_pItems;						//!< Ring
+	size_t									m_nMask;						//!< Ring size - 1
+	char									m_Pad0[ SPSC_CACHE_LINE_SIZE ];
+	volatile size_t							m_nTail;						//!< Next write, producer
+	size_t									m_nHeadCache;					//!< Producer's copy of m_nHead
+	char									m_Pad1[ SPSC_CACHE_LINE_SIZE ];
+	volatile size_t							m_nHead;						//!< Next read, consumer
+	size_t									m_nTailCache;					//!< Consumer's copy of m_nTail
+	char									m_Pad2[ SPSC_CACHE_LINE_SIZE ];
+};
+
+//!
+//!	@brief	Unbounded SPSC queue of linked segments
+//!	@remark	The consumer hands one drained segment back to the producer, steady state allocates nothing
+//!
+template<typename _Type, size_t _SegmentSize = 1024>
+class SpscUnboundedQueue
+{
+	//!
+	//!	@brief	Block of items
+	//!
+	struct Segment
+	{
+		Segment():m_nCommitted(0),m_pNext(NULL) {}
+
+		_Type								m_Items[ _SegmentSize ];		//!< Items
+		volatile size_t						m_nCommitted;					//!< Items written by the producer
+		Segment * volatile					m_pNext;						//!< Next segment, set once this one is full
+	};
+
+public:
+	SpscUnboundedQueue():m_nTailPos(0),m_nPushed(0),m_nHeadPos(0),m_nCommittedCache(0),m_nPopped(0),m_pSpare(NULL)
+	{
+		m_pTailSegment = m_pHeadSegment = new Segment();
+	}
+
+	~SpscUnboundedQueue()
+	{
+		while( m_pHeadSegment != NULL )
+		{
+			Segment * pNext = m_pHeadSegment->m_pNext;
+			delete m_pHeadSegment;
+			m_pHeadSegment = pNext;
+		}
+		delete m_pSpare;
+	}
+
+	//!
+	//!	@brief	Pushes item, producer only
+	//!	@param	Item Item
+	//!	@return	True
+	//!	@throw	std::bad_alloc if a new segment is needed and memory is out
+	//!
+	inline bool Push( const _Type & Item )
+	{
+		if( m_nTailPos == _SegmentSize )
+			NextTailSegment();
+
+		m_pTailSegment->m_Items[ m_nTailPos++ ] = Item;
+		SpscAtomic::Store( m_pTailSegment->m_nCommitted, m_nTailPos );
+		SpscAtomic::Store( m_nPushed, m_nPushed + 1 );
+		return true;
+	}
+
+	//!
+	//!	@brief	Pushes items, producer only
+	//!	@param	pItems Items
+	//!	@param	nCount Number of items
+	//!	@return	nCount
+	//!
+	size_t PushBatch( const _Type * pItems, size_t nCount )
+	{
+		size_t nDone = 0;
+		while( nDone < nCount )
+		{
+			if( m_nTailPos == _SegmentSize )
+				NextTailSegment();
+
+			size_t nChunk = _SegmentSize - m_nTailPos;
+			if( nChunk > nCount - nDone )
+				nChunk = nCount - nDone;
+
+			for( size_t i = 0; i < nChunk; ++i )
+				m_pTailSegment->m_Items[ m_nTailPos + i ] = pItems[ nDone + i ];
+			m_nTailPos += nChunk;
+			nDone += nChunk;
+			SpscAtomic::Store( m_pTailSegment->m_nCommitted, m_nTailPos );
+		}
+
+		SpscAtomic::Store( m_nPushed, m_nPushed + nCount );
+		return nCount;
+	}
+
+	//!
+	//!	@brief	Pops item, consumer only
+	//!	@param	Item Item
+	//!	@return	False if the queue is empty
+	//!
+	inline bool Pop( _Type & Item )
+	{
+		if( m_nHeadPos == m_nCommittedCache && !Refill() )
+			return false;
+
+		Item = m_pHeadSegment->m_Items[ m_nHeadPos++ ];
+		SpscAtomic::Store( m_nPopped, m_nPopped + 1 );
+		return true;
+	}
+
+	//!
+	//!	@brief	Pops up to nCount items, consumer only
+	//!	@param	pItems Items
+	//!	@param	nCount Room in pItems
+	//!	@return	Number of items popped
+	//!
+	size_t PopBatch( _Type * pItems, size_t nCount )
+	{
+		size_t nDone = 0;
+		while( nDone < nCount && ( m_nHeadPos != m_nCommittedCache || Refill() ) )
+		{
+			size_t nChunk = m_nCommittedCache - m_nHeadPos;
+			if( nChunk > nCount - nDone )
+				nChunk = nCount - nDone;
+
+			for( size_t i = 0; i < nChunk; ++i )
+				pItems[ nDone + i ] = m_pHeadSegment->m_Items[ m_nHeadPos + i ];
+			m_nHeadPos += nChunk;
+			nDone += nChunk;
+		}
+
+		if( nDone != 0 )
+			SpscAtomic::Store( m_nPopped, m_nPopped + nDone );
+		return nDone;
+	}
+
+	//!
+	//!	@brief	Drops all items, consumer only
+	//!
+	void Clear()
+	{
+		_Type Item;
+		while( Pop( Item ) )
+			;
+	}
+
+	//!
+	//!	@brief	Gets number of items
+	//!	@return	Snapshot of item count
+	//!
+	inline size_t GetCount() const
+	{
+		const size_t nPopped = SpscAtomic::Load( m_nPopped );
+		return SpscAtomic::Load( m_nPushed ) - nPopped;
+	}
+
+private:
+	SpscUnboundedQueue( const SpscUnboundedQueue & );
+	SpscUnboundedQueue & operator=( const SpscUnboundedQueue & );
+
+	void NextTailSegment()
+	{
+		//
+		// Consumer stores a spare only while there is none, producer clears it only while there is one
+		//
+		Segment * pSegment = SpscAtomic::LoadPtr( m_pSpare );
+		if( pSegment != NULL )
+		{
+			SpscAtomic::StorePtr( m_pSpare, (Segment *) NULL );
+			pSegment->m_nCommitted = 0;
+			pSegment->m_pNext = NULL;
+		}
+		else
+			pSegment = new Segment();
+
+		SpscAtomic::StorePtr( m_pTailSegment->m_pNext, pSegment );
+		m_pTailSegment = pSegment;
+		m_nTailPos = 0;
+	}
+
+	//!
+	//!	@brief	Reloads committed count, moves to the next segment when the current one is drained
+	//!	@return	False if the queue is empty
+	//!
+	bool Refill()
+	{
+		m_nCommittedCache = SpscAtomic::Load( m_pHeadSegment->m_nCommitted );
+		if( m_nHeadPos != m_nCommittedCache )
+			return true;
+
+		if( m_nHeadPos != _SegmentSize )
+			return false;
+
+		//
+		// m_pNext is set after the last item of this segment is committed
+		//
+		Segment * pNext = SpscAtomic::LoadPtr( m_pHeadSegment->m_pNext );
+		if( pNext == NULL )
+			return false;
+
+		if( SpscAtomic::LoadPtr( m_pSpare ) == NULL )
+			SpscAtomic::StorePtr( m_pSpare, m_pHeadSegment );
+		else
+			delete m_pHeadSegment;
+
+		m_pHeadSegment = pNext;
+		m_nHeadPos = 0;
+		m_nCommittedCache = SpscAtomic::Load( pNext->m_nCommitted );
+		return m_nHeadPos != m_nCommittedCache;
+	}
+
+private:
+	char									m_Pad0[ SPSC_CACHE_LINE_SIZE ];
+	Segment *								m_pTailSegment;					//!< Segment written, producer
+	size_t									m_nTailPos;						//!< Next write in m_pTailSegment, producer
+	volatile size_t							m_nPushed;						//!< Items pushed, for GetCount
+	char									m_Pad1[ SPSC_CACHE_LINE_SIZE ];
+	Segment *								m_pHeadSegment;					//!< Segment read, consumer
+	size_t									m_nHeadPos;						//!< Next read in m_pHeadSegment, consumer
+	size_t									m_nCommittedCache;				//!< Consumer's copy of m_pHeadSegment->m_nCommitted
+	volatile size_t							m_nPopped;						//!< Items popped, for GetCount
+	char									m_Pad2[ SPSC_CACHE_LINE_SIZE ];
+	Segment * volatile						m_pSpare;						//!< Drained segment for reuse
+	char									m_Pad3[ SPSC_CACHE_LINE_SIZE ];
+};
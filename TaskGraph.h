@@ -0,0 +1,385 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include "ParallelAlgorithms.h"
+
+//
+// Task dependency graph on top of ThreadPool (C++11).
+// Nodes are callables, an edge makes a node wait for another one. Build checks the graph for cycles and lays out
+// the successor lists, Run then releases every node to the pool as soon as its last predecessor is done: each node has
+// an atomic count of predecessors still running, there is no barrier between stages.
+// A finished node runs one released successor itself and queues the others. The calling thread helps with queued tasks.
+// A graph is built once and run any number of times without allocating, the start and end of every node
+// of the last run are kept for critical path analysis
+//
+
+//!
+//!	@brief	Reusable DAG of tasks
+//!	@remark	Not reentrant: one Run at a time. A node throwing an exception skips the nodes not started yet
+//!
+class TaskGraph
+{
+public:
+	typedef size_t NodeId;
+
+	//!
+	//!	@brief	Node times of the last run, nanoseconds since Run was called
+	//!
+	struct Timing
+	{
+		unsigned long long								m_nStartNs;						//!< Node started
+		unsigned long long								m_nEndNs;						//!< Node finished, 0 if skipped
+	};
+
+public:
+	//!
+	//!	@brief	Constructor
+	//!	@param	Pool Thread pool running the nodes
+	//!
+	explicit TaskGraph( SThreadPool * Pool ):m_Pool(Pool),m_bBuilt(false),m_nRunStartNs(0)
+	{
+		InitTaskGroup( &m_Group, 0 );
+	}
+
+	TaskGraph( const TaskGraph & ) = delete;
+	TaskGraph & operator=( const TaskGraph & ) = delete;
+
+	//!
+	//!	@brief	Adds a node
+	//!	@param	Function Callable without arguments, moved into the graph
+	//!	@param	szName Node name for reports, must outlive the graph
+	//!	@return	Node identifier
+	//!
+	template<typename _Func>
+	NodeId AddNode( _Func && Function, const char * szName = NULL )
+	{
+		Node NewNode;
+		NewNode.m_Call.reset( new NodeCall<typename std::decay<_Func>::type>( std::forward<_Func>( Function ) ) );
+		NewNode.m_szName = szName;
+		NewNode.m_nFirstSuccessor = 0;
+		NewNode.m_nSuccessors = 0;
+		NewNode.m_nPredecessors = 0;
+		m_Nodes.push_back( std::move( NewNode ) );
+		m_bBuilt = false;
+		return m_Nodes.size() - 1;
+	}
+
+	//!
+	//!	@brief	Makes a node wait for another one
+	//!	@param	From Predecessor
+	//!	@param	To Successor, runs after From has finished
+	//!	@throw	std::out_of_range for an unknown node
+	//!
+	void AddEdge( NodeId From, NodeId To )
+	{
+		if( From >= m_Nodes.size() || To >= m_Nodes.size() )
+			throw std::out_of_range( "Unknown task graph node" );
+		m_Edges.push_back( std::make_pair( From, To ) );
+		m_bBuilt = false;
+	}
+
+	//!
+	//!	@brief	Checks the graph and lays out successor lists and counters
+	//!	@return	False if the edges form a cycle
+	//!
+	bool Build()
+	{
+		const size_t nCount = m_Nodes.size();
+		size_t i;
+
+		for( i = 0; i < nCount; ++i )
+		{
+			m_Nodes[ i ].m_nSuccessors = 0;
+			m_Nodes[ i ].m_nPredecessors = 0;
+		}
+		for( i = 0; i < m_Edges.size(); ++i )
+		{
+			m_Nodes[ m_Edges[ i ].first ].m_nSuccessors++;
+			m_Nodes[ m_Edges[ i ].second ].m_nPredecessors++;
+		}
+
+		//
+		// Successors of a node are contiguous, m_nSuccessors is reused as the fill position
+		//
+		size_t nOffset = 0;
+		for( i = 0; i < nCount; ++i )
+		{
+			m_Nodes[ i ].m_nFirstSuccessor = nOffset;
+			nOffset += m_Nodes[ i ].m_nSuccessors;
+			m_Nodes[ i ].m_nSuccessors = 0;
+		}
+		m_Successors.resize( m_Edges.size() );
+		for( i = 0; i < m_Edges.size(); ++i )
+		{
+			Node & From = m_Nodes[ m_Edges[ i ].first ];
+			m_Successors[ From.m_nFirstSuccessor + From.m_nSuccessors++ ] = m_Edges[ i ].second;
+		}
+
+		//
+		// Kahn's order, nodes left out of it are on a cycle or behind one
+		//
+		std::vector<size_t> Remaining( nCount );
+		m_Order.clear();
+		m_Roots.clear();
+		for( i = 0; i < nCount; ++i )
+		{
+			Remaining[ i ] = m_Nodes[ i ].m_nPredecessors;
+			if( Remaining[ i ] == 0 )
+			{
+				m_Order.push_back( i );
+				m_Roots.push_back( i );
+			}
+		}
+		for( i = 0; i < m_Order.size(); ++i )
+		{
+			const Node & Current = m_Nodes[ m_Order[ i ] ];
+			for( size_t k = 0; k < Current.m_nSuccessors; ++k )
+			{
+				const NodeId Successor = m_Successors[ Current.m_nFirstSuccessor + k ];
+				if( --Remaining[ Successor ] == 0 )
+					m_Order.push_back( Successor );
+			}
+		}
+		if( m_Order.size() != nCount )
+			return false;
+
+		m_Pending.reset( new std::atomic<size_t>[ nCount ] );
+		m_Timings.assign( nCount, Timing() );
+		m_bBuilt = true;
+		return true;
+	}
+
+	//!
+	//!	@brief	Runs all nodes and waits for them, builds the graph first if it has changed
+	//!	@throw	std::logic_error if the graph has a cycle, exception thrown by a node
+	//!
+	void Run()
+	{
+		if( !m_bBuilt && !Build() )
+			throw std::logic_error( "Task graph has a cycle" );
+
+		const size_t nCount = m_Nodes.size();
+		if( nCount == 0 )
+			return;
+
+		for( size_t i = 0; i < nCount; ++i )
+		{
+			m_Pending[ i ].store( m_Nodes[ i ].m_nPredecessors, std::memory_order_relaxed );
+			m_Timings[ i ].m_nStartNs = 0;
+			m_Timings[ i ].m_nEndNs = 0;
+		}
+		m_Error.Reset();
+		m_nRunStartNs = NowNs();
+		InitTaskGroup( &m_Group, (unsigned long) nCount );
+
+		//
+		// The calling thread takes the first root
+		//
+		for( size_t i = 1; i < m_Roots.size(); ++i )
+			Release( m_Roots[ i ] );
+		RunFrom( m_Roots[ 0 ] );
+
+		ParallelDetail::HelpWait( m_Pool, &m_Group );
+		m_Error.Rethrow();
+	}
+
+	inline size_t GetNodeCount() const { return m_Nodes.size(); }
+
+	//!
+	//!	@brief	Gets node name
+	//!	@param	Id Node
+	//!	@return	Name given to AddNode, NULL if none
+	//!
+	inline const char * GetNodeName( NodeId Id ) const { return m_Nodes[ Id ].m_szName; }
+
+	//!
+	//!	@brief	Gets node times of the last run
+	//!	@param	Id Node
+	//!	@return	Start and end
+	//!
+	inline const Timing & GetNodeTiming( NodeId Id ) const { return m_Timings[ Id ]; }
+
+	//!
+	//!	@brief	Finds the chain of dependent nodes with the longest total run time in the last run
+	//!	@param	Path Nodes of the chain, first to last
+	//!	@return	Sum of their run times, nanoseconds
+	//!	@remark	Time nodes spent queued is not counted, compare the result with the run time to see it
+	//!
+	unsigned long long GetCriticalPath( std::vector<NodeId> & Path ) const
+	{
+		const size_t nCount = m_Order.size();
+		std::vector<unsigned long long> Longest( nCount, 0 );
+		std::vector<NodeId> Previous( nCount, nCount );
+		NodeId Last = nCount;
+
+		Path.clear();
+		if( !m_bBuilt || nCount == 0 )
+			return 0;
+
+		for( size_t i = 0; i < nCount; ++i )
+		{
+			const NodeId Id = m_Order[ i ];
+			const Node & Current = m_Nodes[ Id ];
+			Longest[ Id ] += m_Timings[ Id ].m_nEndNs - m_Timings[ Id ].m_nStartNs;
+			if( Last == nCount || Longest[ Id ] > Longest[ Last ] )
+				Last = Id;
+
+			for( size_t k = 0; k < Current.m_nSuccessors; ++k )
+			{
+				const NodeId Successor = m_Successors[ Current.m_nFirstSuccessor + k ];
+				if( Previous[ Successor ] == nCount || Longest[ Id ] > Longest[ Successor ] )
+				{
+					Longest[ Successor ] = Longest[ Id ];
+					Previous[ Successor ] = Id;
+				}
+			}
+		}
+
+		for( NodeId Id = Last; Id != nCount; Id = Previous[ Id ] )
+			Path.push_back( Id );
+		std::reverse( Path.begin(), Path.end() );
+		return Longest[ Last ];
+	}
+
+private:
+	//!
+	//!	@brief	Type erased node callable
+	//!
+	class NodeCallBase
+	{
+	public:
+		virtual ~NodeCallBase() {}
+		virtual void Call() = 0;
+	};
+
+	template<typename _Callable>
+	class NodeCall : public NodeCallBase
+	{
+	public:
+		template<typename _Func>
+		explicit NodeCall( _Func && Function ):m_Function(std::forward<_Func>(Function)) {}
+
+		virtual void Call() { m_Function(); }
+
+	private:
+		_Callable										m_Function;						//!< User callable
+	};
+
+	//!
+	//!	@brief	Node and its place in the successor table
+	//!
+	struct Node
+	{
+		std::unique_ptr<NodeCallBase>					m_Call;							//!< Callable
+		const char *									m_szName;						//!< Name for reports
+		size_t											m_nFirstSuccessor;				//!< First successor in m_Successors
+		size_t											m_nSuccessors;					//!< Number of successors
+		size_t											m_nPredecessors;				//!< Number of predecessors
+	};
+
+	//!
+	//!	@brief	Task argument of a released node
+	//!
+	struct Launch
+	{
+		TaskGraph *										m_Graph;						//!< Graph
+		NodeId											m_Node;							//!< Node to run
+	};
+
+	static unsigned long long NowNs()
+	{
+		return (unsigned long long) std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now().time_since_epoch() ).count();
+	}
+
+	static void RunQueued( void * Pars )
+	{
+		const Launch Start = *static_cast<Launch*>( Pars );
+		Start.m_Graph->RunFrom( Start.m_Node );
+	}
+
+	//!
+	//!	@brief	Queues a node whose predecessors are done, runs it here if the pool is stopping
+	//!
+	void Release( NodeId Id )
+	{
+		SThreadPoolTask Task;
+		Launch * const Start = static_cast<Launch*>( AllocateTaskInline( m_Pool, &Task, sizeof(Launch) ) );
+
+		Start->m_Graph = this;
+		Start->m_Node = Id;
+		Task.m_pFunc = &RunQueued;
+		if( 0 != PutTasksInQueue( m_Pool, &Task, 1 ) )
+			return;
+
+		ParallelDetail::FreeRejected( Task );
+		RunFrom( Id );
+	}
+
+	//!
+	//!	@brief	Runs a node, then one of the successors it released while there is one
+	//!	@remark	The graph is not touched after the last node is counted down, the waiter may leave Run then
+	//!
+	void RunFrom( NodeId Id )
+	{
+		for( ;; )
+		{
+			RunNode( Id );
+
+			const Node & Current = m_Nodes[ Id ];
+			NodeId Next = m_Nodes.size();
+			for( size_t k = 0; k < Current.m_nSuccessors; ++k )
+			{
+				const NodeId Successor = m_Successors[ Current.m_nFirstSuccessor + k ];
+				if( m_Pending[ Successor ].fetch_sub( 1, std::memory_order_acq_rel ) != 1 )
+					continue;
+				if( Next == m_Nodes.size() )
+					Next = Successor;
+				else
+					Release( Successor );
+			}
+
+			const bool bContinue = Next != m_Nodes.size();
+			DoneTaskGroup( &m_Group, 1 );
+			if( !bContinue )
+				return;
+			Id = Next;
+		}
+	}
+
+	void RunNode( NodeId Id )
+	{
+		if( m_Error.Failed() )
+			return;
+
+		Timing & Times = m_Timings[ Id ];
+		Times.m_nStartNs = NowNs() - m_nRunStartNs;
+		try
+		{
+			m_Nodes[ Id ].m_Call->Call();
+		}
+		catch( ... )
+		{
+			m_Error.Set( std::current_exception() );
+		}
+		Times.m_nEndNs = NowNs() - m_nRunStartNs;
+	}
+
+private:
+	SThreadPool *										m_Pool;							//!< Thread pool
+	std::vector<Node>									m_Nodes;						//!< Nodes
+	std::vector< std::pair<NodeId, NodeId> >			m_Edges;						//!< Edges as added
+	std::vector<NodeId>									m_Successors;					//!< Successor lists of all nodes
+	std::vector<NodeId>									m_Order;						//!< Topological order
+	std::vector<NodeId>									m_Roots;						//!< Nodes without predecessors
+	std::unique_ptr<std::atomic<size_t>[]>				m_Pending;						//!< Predecessors still running, per node
+	std::vector<Timing>									m_Timings;						//!< Node times of the last run
+	ParallelDetail::ErrorSlot							m_Error;						//!< First exception of the run
+	bool												m_bBuilt;						//!< Layout matches nodes and edges
+	unsigned long long									m_nRunStartNs;					//!< Start of the last run
+	STaskGroup											m_Group;						//!< Nodes not done yet
+};
@@ -1,4 +1,244 @@
+#if !defined( WIN32 ) && !defined( _GNU_SOURCE )
+#define _GNU_SOURCE
+#endif
+
 #include "ThreadPool.h"
+#include "ThreadTrace.h"
+#include "CpuTopology.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef USE_PTHREAD_THREAD_FORCE
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#define TP_THREAD_LOCAL __thread
+#else
+#define TP_THREAD_LOCAL __declspec( thread )
+#endif
+
+#define TP_MAX_CPUS CPU_TOPOLOGY_MAX
+
+#ifndef USE_PTHREAD_THREAD_FORCE
+static void AllocLock( TP_LOCK* pcs )
+{
+#if defined ( _WIN32_WINNT ) && ( _WIN32_WINNT >= 0x0403 )
+    InitializeCriticalSectionAndSpinCount( pcs, 0x00000064 );
+#else
+    InitializeCriticalSection( pcs );
+#endif
+}
+
+static void FreeLock( TP_LOCK* pcs ) { DeleteCriticalSection( pcs ); }
+static void EnterLock( TP_LOCK* pcs ) { EnterCriticalSection( pcs ); }
+static void LeaveLock( TP_LOCK* pcs ) { LeaveCriticalSection( pcs ); }
+
+static void AllocCond( TP_COND* pcv ) { InitializeConditionVariable( pcv ); }
+static void FreeCond( TP_COND* pcv ) { pcv; }
+static void WaitCond( TP_COND* pcv, TP_LOCK* pcs ) { SleepConditionVariableCS( pcv, pcs, INFINITE ); }
+static int WaitCondTimeout( TP_COND* pcv, TP_LOCK* pcs, unsigned long ulMs ) { return SleepConditionVariableCS( pcv, pcs, ulMs ) || ERROR_TIMEOUT != GetLastError(); }
+static void WakeCond( TP_COND* pcv ) { WakeConditionVariable( pcv ); }
+static void WakeAllCond( TP_COND* pcv ) { WakeAllConditionVariable( pcv ); }
+
+static int CreateWorker( TP_THREAD* pthrd, SThreadPoolWorker* pWorker )
+{
+    *pthrd = CreateThread( NULL, 0, ThreadPoolWorkProc, pWorker, 0, NULL );
+    return NULL != *pthrd;
+}
+
+static void JoinWorker( TP_THREAD thrd )
+{
+    WaitForSingleObject( thrd, INFINITE );
+    CloseHandle( thrd );
+}
+
+static __inline long AtomicLoad( volatile long* pl ) { long l = *pl; _ReadWriteBarrier(); return l; }
+static __inline void AtomicStore( volatile long* pl, long l ) { _ReadWriteBarrier(); *pl = l; }
+static __inline long AtomicIncrement( volatile long* pl ) { return InterlockedIncrement( pl ); }
+static __inline long AtomicDecrement( volatile long* pl ) { return InterlockedDecrement( pl ); }
+static __inline long AtomicAdd( volatile long* pl, long l ) { return InterlockedExchangeAdd( pl, l ) + l; }
+static __inline int AtomicCas( volatile long* pl, long lExpected, long lDesired ) { return lExpected == InterlockedCompareExchange( pl, lDesired, lExpected ); }
+static __inline void FullFence( void ) { MemoryBarrier(); }
+static __inline void AtomicOr( volatile long* pl, long l ) { InterlockedOr( pl, l ); }
+static __inline void AtomicAnd( volatile long* pl, long l ) { InterlockedAnd( pl, l ); }
+static __inline void CpuPause( void ) { YieldProcessor(); }
+static __inline unsigned long HighBit( unsigned long ul ) { unsigned long ulIndex; _BitScanReverse( &ulIndex, ul ); return ulIndex; }
+
+typedef LARGE_INTEGER TP_STAMP;
+static void GetStamp( TP_STAMP* pStamp ) { QueryPerformanceCounter( pStamp ); }
+
+/* Same clock and unit as GetTickUs */
+static unsigned long GetStampUs( const TP_STAMP* pStamp )
+{
+    static LARGE_INTEGER s_cFrequency;
+
+    if( 0 == s_cFrequency.QuadPart )
+        QueryPerformanceFrequency( &s_cFrequency );
+
+    /* Split as in GetTickUs, the stamp * 1000000 would overflow */
+    return ( unsigned long )( pStamp->QuadPart / s_cFrequency.QuadPart * 1000000 + pStamp->QuadPart % s_cFrequency.QuadPart * 1000000 / s_cFrequency.QuadPart );
+}
+
+/* Nanoseconds since *pStart, saturated at 2^32 - 1 */
+static unsigned long GetElapsedNs( const TP_STAMP* pStart )
+{
+    static LARGE_INTEGER s_cFrequency;
+    LARGE_INTEGER cNow;
+    LONGLONG llTicks;
+
+    if( 0 == s_cFrequency.QuadPart )
+        QueryPerformanceFrequency( &s_cFrequency );
+    QueryPerformanceCounter( &cNow );
+    llTicks = cNow.QuadPart - pStart->QuadPart;
+    if( llTicks / s_cFrequency.QuadPart >= 4 )
+        return 0xFFFFFFFFUL;
+    return ( unsigned long )( llTicks * 1000000000 / s_cFrequency.QuadPart );
+}
+static unsigned long GetTickMs( void ) { return ( unsigned long )GetTickCount64(); }
+
+static unsigned long GetTickUs( void )
+{
+    static LARGE_INTEGER s_cFrequency;
+    LARGE_INTEGER cCounter;
+
+    if( 0 == s_cFrequency.QuadPart )
+        QueryPerformanceFrequency( &s_cFrequency );
+    QueryPerformanceCounter( &cCounter );
+
+    /* Counter * 1000000 would overflow after about 10 days at 10 MHz */
+    return ( unsigned long )( cCounter.QuadPart / s_cFrequency.QuadPart * 1000000 + cCounter.QuadPart % s_cFrequency.QuadPart * 1000000 / s_cFrequency.QuadPart );
+}
+static __inline void* AtomicLoadPtr( void* volatile* pp ) { void* p = *pp; _ReadWriteBarrier(); return p; }
+static __inline void* AtomicExchangePtr( void* volatile* pp, void* p ) { return InterlockedExchangePointer( pp, p ); }
+static __inline int AtomicCasPtr( void* volatile* pp, void* pExpected, void* pDesired ) { return pExpected == InterlockedCompareExchangePointer( pp, pDesired, pExpected ); }
+#else
+static void AllocLock( TP_LOCK* pcs )
+{
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init( &attr );
+#if defined ( PTHREAD_MUTEX_ADAPTIVE_NP )
+    pthread_mutexattr_settype( &attr, PTHREAD_MUTEX_ADAPTIVE_NP );
+#endif
+    pthread_mutex_init( pcs, &attr );
+    pthread_mutexattr_destroy( &attr );
+}
+
+static void FreeLock( TP_LOCK* pcs ) { pthread_mutex_destroy( pcs ); }
+static void EnterLock( TP_LOCK* pcs ) { pthread_mutex_lock( pcs ); }
+static void LeaveLock( TP_LOCK* pcs ) { pthread_mutex_unlock( pcs ); }
+
+static void AllocCond( TP_COND* pcv )
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init( &attr );
+    pthread_condattr_setclock( &attr, CLOCK_MONOTONIC );
+    pthread_cond_init( pcv, &attr );
+    pthread_condattr_destroy( &attr );
+}
+
+static void FreeCond( TP_COND* pcv ) { pthread_cond_destroy( pcv ); }
+static void WaitCond( TP_COND* pcv, TP_LOCK* pcs ) { pthread_cond_wait( pcv, pcs ); }
+
+/* Returns 0 on timeout */
+static int WaitCondTimeout( TP_COND* pcv, TP_LOCK* pcs, unsigned long ulMs )
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    ts.tv_sec += ( time_t )( ulMs / 1000 );
+    ts.tv_nsec += ( long )( ulMs % 1000 ) * 1000000L;
+    if( ts.tv_nsec >= 1000000000L )
+    {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+    return ETIMEDOUT != pthread_cond_timedwait( pcv, pcs, &ts );
+}
+static void WakeCond( TP_COND* pcv ) { pthread_cond_signal( pcv ); }
+static void WakeAllCond( TP_COND* pcv ) { pthread_cond_broadcast( pcv ); }
+
+static int CreateWorker( TP_THREAD* pthrd, SThreadPoolWorker* pWorker )
+{
+    return 0 == pthread_create( pthrd, NULL, ThreadPoolWorkProc, pWorker );
+}
+
+static void JoinWorker( TP_THREAD thrd )
+{
+    pthread_join( thrd, NULL );
+}
+
+static __inline long AtomicLoad( volatile long* pl ) { return __atomic_load_n( pl, __ATOMIC_ACQUIRE ); }
+static __inline void AtomicStore( volatile long* pl, long l ) { __atomic_store_n( pl, l, __ATOMIC_RELEASE ); }
+static __inline long AtomicIncrement( volatile long* pl ) { return __atomic_add_fetch( pl, 1, __ATOMIC_SEQ_CST ); }
+static __inline long AtomicDecrement( volatile long* pl ) { return __atomic_sub_fetch( pl, 1, __ATOMIC_SEQ_CST ); }
+static __inline long AtomicAdd( volatile long* pl, long l ) { return __atomic_add_fetch( pl, l, __ATOMIC_SEQ_CST ); }
+static __inline int AtomicCas( volatile long* pl, long lExpected, long lDesired ) { return __atomic_compare_exchange_n( pl, &lExpected, lDesired, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED ); }
+static __inline void FullFence( void ) { __atomic_thread_fence( __ATOMIC_SEQ_CST ); }
+static __inline void AtomicOr( volatile long* pl, long l ) { __atomic_fetch_or( pl, l, __ATOMIC_SEQ_CST ); }
+static __inline void AtomicAnd( volatile long* pl, long l ) { __atomic_fetch_and( pl, l, __ATOMIC_SEQ_CST ); }
+
+static __inline void CpuPause( void )
+{
+#if defined( __i386__ ) || defined( __x86_64__ )
+    __builtin_ia32_pause();
+#elif defined( __aarch64__ ) || defined( __arm__ )
+    __asm__ __volatile__( "yield" );
+#endif
+}
+
+static __inline unsigned long HighBit( unsigned long ul ) { return ( unsigned long )( 8 * sizeof( ul ) - 1 - __builtin_clzl( ul ) ); }
+
+typedef struct timespec TP_STAMP;
+static void GetStamp( TP_STAMP* pStamp ) { clock_gettime( CLOCK_MONOTONIC, pStamp ); }
+
+/* Same clock and unit as GetTickUs */
+static unsigned long GetStampUs( const TP_STAMP* pStamp )
+{
+    return ( unsigned long )pStamp->tv_sec * 1000000UL + ( unsigned long )( pStamp->tv_nsec / 1000L );
+}
+
+/* Nanoseconds since *pStart, saturated at 2^32 - 1 */
+static unsigned long GetElapsedNs( const TP_STAMP* pStart )
+{
+    struct timespec ts;
+    long lSec, lNs;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    lSec = ( long )( ts.tv_sec - pStart->tv_sec );
+    lNs = ts.tv_nsec - pStart->tv_nsec;
+    if( lNs < 0 )
+    {
+        lSec--;
+        lNs += 1000000000L;
+    }
+    if( lSec >= 4 )
+        return 0xFFFFFFFFUL;
+    return ( unsigned long )lSec * 1000000000UL + ( unsigned long )lNs;
+}
+
+static unsigned long GetTickMs( void )
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ( unsigned long )ts.tv_sec * 1000UL + ( unsigned long )( ts.tv_nsec / 1000000L );
+}
+
+static unsigned long GetTickUs( void )
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ( unsigned long )ts.tv_sec * 1000000UL + ( unsigned long )( ts.tv_nsec / 1000L );
+}
+static __inline void* AtomicLoadPtr( void* volatile* pp ) { return __atomic_load_n( pp, __ATOMIC_ACQUIRE ); }
+static __inline void* AtomicExchangePtr( void* volatile* pp, void* p ) { return __atomic_exchange_n( pp, p, __ATOMIC_ACQ_REL ); }
+static __inline int AtomicCasPtr( void* volatile* pp, void* pExpected, void* pDesired ) { return __atomic_compare_exchange_n( pp, &pExpected, pDesired, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE ); }
+#endif
 
 void AllocQueue( SQueue* ptrQueue )
 {
@@ -32,38 +272,93 @@ void ReallocQueue( SQueue* ptrQueue, unsigned long ulRequired )
 
     ptrQueue->m_ptrQueue = ( SThreadPoolTask* )realloc( ptrQueue->m_ptrQueue, ptrQueue->m_ulCapacity * sizeof( ptrQueue->m_ptrQueue[ 0 ] ) );
     if( 0 != ulMove2End )
-        memmove_s( ptrQueue->m_ptrQueue + ptrQueue->m_ulCapacity - ulMove2End, ulMove2End * sizeof( ptrQueue->m_ptrQueue[ 0 ] ), ptrQueue->m_ptrQueue + ulOldBeginOffset, ulMove2End * sizeof( ptrQueue->m_ptrQueue[ 0 ] ) );
-    ptrQueue->m_ptrBegin = ptrQueue->m_ptrQueue + ptrQueue->m_ulCapacity - ulMove2End;
+    {
+        memmove( ptrQueue->m_ptrQueue + ptrQueue->m_ulCapacity - ulMove2End, ptrQueue->m_ptrQueue + ulOldBeginOffset, ulMove2End * sizeof( ptrQueue->m_ptrQueue[ 0 ] ) );
+        ptrQueue->m_ptrBegin = ptrQueue->m_ptrQueue + ptrQueue->m_ulCapacity - ulMove2End;
+    }
+    else
+        ptrQueue->m_ptrBegin = ptrQueue->m_ptrQueue + ulOldBeginOffset;
 }
 
+/*
+ * Elements form one circular run starting at m_ptrBegin (the oldest task).
+ * Push appends after the newest one, pop takes from m_ptrBegin
+ */
 void PushQueue( SQueue* ptrQueue, const SThreadPoolTask* ptr )
 {
+    SThreadPoolTask* ptrPush;
+
+    if( NULL == ptrQueue->m_ptrBegin )
+        ptrQueue->m_ptrBegin = ptrQueue->m_ptrQueue;
     if( ptrQueue->m_ulCapacity == ptrQueue->m_ulSize )
         ReallocQueue( ptrQueue, ptrQueue->m_ulCapacity * 2 );
 
-    if( ptrQueue->m_ptrBegin == ptrQueue->m_ptrQueue || NULL == ptrQueue->m_ptrBegin )
-        ptrQueue->m_ptrBegin = ptrQueue->m_ptrQueue + ptrQueue->m_ulCapacity - 1;
-    else
-        ptrQueue->m_ptrBegin--;
-    memcpy_s( ptrQueue->m_ptrBegin, sizeof( ptrQueue->m_ptrBegin[ 0 ] ), ptr, sizeof( *ptr ) );
+    ptrPush = ptrQueue->m_ptrBegin + ptrQueue->m_ulSize;
+    if( ptrPush > ptrQueue->m_ptrQueue + ptrQueue->m_ulCapacity - 1 )
+        ptrPush -= ptrQueue->m_ulCapacity;
+    *ptrPush = *ptr;
     ptrQueue->m_ulSize++;
 }
 
 void PopQueue( SQueue* ptrQueue, SThreadPoolTask* ptr )
 {
-    const SThreadPoolTask* ptrPop = NULL;
     if( 0 == ptrQueue->m_ulSize )
         memset( ptr, 0, sizeof( *ptr ) );
     else
     {
-        ptrPop = ptrQueue->m_ptrBegin + ptrQueue->m_ulSize - 1;
-        if( ptrPop > ptrQueue->m_ptrQueue + ptrQueue->m_ulCapacity - 1 )
-            ptrPop -= ptrQueue->m_ulCapacity;
-        memcpy_s( ptr, sizeof( *ptr ), ptrPop, sizeof( *ptrPop ) );
+        *ptr = *( ptrQueue->m_ptrBegin++ );
+        if( ptrQueue->m_ptrBegin == ptrQueue->m_ptrQueue + ptrQueue->m_ulCapacity )
+            ptrQueue->m_ptrBegin = ptrQueue->m_ptrQueue;
         ptrQueue->m_ulSize--;
     }
 }
 
+void PushQueueBatch( SQueue* ptrQueue, const SThreadPoolTask* ptr, unsigned long ulCount )
+{
+    unsigned long ulTail, ulFirst;
+
+    if( NULL == ptrQueue->m_ptrBegin )
+        ptrQueue->m_ptrBegin = ptrQueue->m_ptrQueue;
+    if( ptrQueue->m_ulCapacity - ptrQueue->m_ulSize < ulCount )
+        ReallocQueue( ptrQueue, ptrQueue->m_ulSize + ulCount );
+
+    /* Reserved run may wrap around the end of the buffer */
+    ulTail = ( unsigned long )( ptrQueue->m_ptrBegin - ptrQueue->m_ptrQueue ) + ptrQueue->m_ulSize;
+    if( ulTail >= ptrQueue->m_ulCapacity )
+        ulTail -= ptrQueue->m_ulCapacity;
+    ulFirst = ptrQueue->m_ulCapacity - ulTail;
+    if( ulFirst > ulCount )
+        ulFirst = ulCount;
+    memcpy( ptrQueue->m_ptrQueue + ulTail, ptr, ulFirst * sizeof( *ptr ) );
+    if( ulFirst != ulCount )
+        memcpy( ptrQueue->m_ptrQueue, ptr + ulFirst, ( ulCount - ulFirst ) * sizeof( *ptr ) );
+    ptrQueue->m_ulSize += ulCount;
+}
+
+unsigned long PopQueueBatch( SQueue* ptrQueue, SThreadPoolTask* ptr, unsigned long ulMax )
+{
+    const unsigned long ulCount = ulMax < ptrQueue->m_ulSize ? ulMax : ptrQueue->m_ulSize;
+    unsigned long ulHead, ulFirst;
+
+    if( 0 == ulCount )
+        return 0;
+
+    ulHead = ( unsigned long )( ptrQueue->m_ptrBegin - ptrQueue->m_ptrQueue );
+    ulFirst = ptrQueue->m_ulCapacity - ulHead;
+    if( ulFirst > ulCount )
+        ulFirst = ulCount;
+    memcpy( ptr, ptrQueue->m_ptrBegin, ulFirst * sizeof( *ptr ) );
+    if( ulFirst != ulCount )
+        memcpy( ptr + ulFirst, ptrQueue->m_ptrQueue, ( ulCount - ulFirst ) * sizeof( *ptr ) );
+
+    ulHead += ulCount;
+    if( ulHead >= ptrQueue->m_ulCapacity )
+        ulHead -= ptrQueue->m_ulCapacity;
+    ptrQueue->m_ptrBegin = ptrQueue->m_ptrQueue + ulHead;
+    ptrQueue->m_ulSize -= ulCount;
+    return ulCount;
+}
+
 void PrintDebug( const SQueue* ptrQueue )
 {
     ptrQueue;
@@ -81,254 +376,1974 @@ void PrintDebug( const SQueue* ptrQueue )
     _putws( L"" );*/
 }
 
-void AllocMemPool( SMemPool* ptrPool )
+void AllocRingQueue( SRingQueue* ptrQueue, unsigned long ulCapacity )
 {
-    ptrPool->m_ulSize = 0;
-    ptrPool->m_ulCapacity = 100;
-    ptrPool->m_ptrPool = ( void** )malloc( ptrPool->m_ulCapacity * sizeof( ptrPool->m_ptrPool[ 0 ] ) );
+    unsigned long i, ulSize = 2;
+
+    while( ulSize < ulCapacity )
+        ulSize *= 2;
+
+    ptrQueue->m_ptrCells = ( SRingCell* )malloc( ulSize * sizeof( ptrQueue->m_ptrCells[ 0 ] ) );
+    ptrQueue->m_ulMask = ulSize - 1;
+    for( i = 0; i < ulSize; ++i )
+        ptrQueue->m_ptrCells[ i ].m_lSequence = ( long )i;
+    ptrQueue->m_lEnqueuePos = 0;
+    ptrQueue->m_lDequeuePos = 0;
+    FullFence();
 }
 
-void FreeMemPool( SMemPool* ptrPool )
+void FreeRingQueue( SRingQueue* ptrQueue )
 {
-    unsigned long i;
-    for( i = 0; i < ptrPool->m_ulSize; ++i )
-        free( ptrPool->m_ptrPool[ i ] );
-    free( ptrPool->m_ptrPool );
-    ptrPool->m_ptrPool = NULL;
-    ptrPool->m_ulSize = 0;
-    ptrPool->m_ulCapacity = 0;
+    free( ptrQueue->m_ptrCells );
+    ptrQueue->m_ptrCells = NULL;
+    ptrQueue->m_ulMask = 0;
+    ptrQueue->m_lEnqueuePos = 0;
+    ptrQueue->m_lDequeuePos = 0;
 }
 
-void ReallocMemPool( SMemPool* ptrPool, unsigned long ulRequired )
+int PushRingQueue( SRingQueue* ptrQueue, const SThreadPoolTask* ptr )
 {
-    if( ulRequired < ptrPool->m_ulCapacity )
-        return;
+    SRingCell* pCell;
+    long lPos = AtomicLoad( &( ptrQueue->m_lEnqueuePos ) );
+    long lDiff;
 
-    while( ulRequired > ptrPool->m_ulCapacity )
-        ptrPool->m_ulCapacity *= 2;
+    for(;;)
+    {
+        pCell = ptrQueue->m_ptrCells + ( ( unsigned long )lPos & ptrQueue->m_ulMask );
+        lDiff = ( long )( ( unsigned long )AtomicLoad( &( pCell->m_lSequence ) ) - ( unsigned long )lPos );
+        if( 0 == lDiff )
+        {
+            if( AtomicCas( &( ptrQueue->m_lEnqueuePos ), lPos, ( long )( ( unsigned long )lPos + 1 ) ) )
+                break;
+        }
+        else if( lDiff < 0 )
+            return 0;
+        lPos = AtomicLoad( &( ptrQueue->m_lEnqueuePos ) );
+    }
 
-    ptrPool->m_ptrPool = ( void** )realloc( ptrPool->m_ptrPool, ptrPool->m_ulCapacity * sizeof( ptrPool->m_ptrPool[ 0 ] ) );
+    pCell->m_cTask = *ptr;
+    AtomicStore( &( pCell->m_lSequence ), ( long )( ( unsigned long )lPos + 1 ) );
+    return 1;
 }
 
-void PushMemPool( SMemPool* ptrPool, void* ptr )
+int PopRingQueue( SRingQueue* ptrQueue, SThreadPoolTask* ptr )
 {
-    if( ptrPool->m_ulCapacity == ptrPool->m_ulSize )
-        ReallocMemPool( ptrPool, ptrPool->m_ulCapacity * 2 );
-    ptrPool->m_ptrPool[ ptrPool->m_ulSize++ ] = ptr;
-}
+    SRingCell* pCell;
+    long lPos = AtomicLoad( &( ptrQueue->m_lDequeuePos ) );
+    long lDiff;
 
-void PopMemPool( SMemPool* ptrPool, void** ptr )
-{
-    if( 0 == ptrPool->m_ulSize )
-        *ptr = malloc( 32 );
-    else
-        *ptr = ptrPool->m_ptrPool[ --( ptrPool->m_ulSize ) ];
+    for(;;)
+    {
+        pCell = ptrQueue->m_ptrCells + ( ( unsigned long )lPos & ptrQueue->m_ulMask );
+        lDiff = ( long )( ( unsigned long )AtomicLoad( &( pCell->m_lSequence ) ) - ( ( unsigned long )lPos + 1 ) );
+        if( 0 == lDiff )
+        {
+            if( AtomicCas( &( ptrQueue->m_lDequeuePos ), lPos, ( long )( ( unsigned long )lPos + 1 ) ) )
+                break;
+        }
+        else if( lDiff < 0 )
+            return 0;
+        lPos = AtomicLoad( &( ptrQueue->m_lDequeuePos ) );
+    }
+
+    *ptr = pCell->m_cTask;
+    AtomicStore( &( pCell->m_lSequence ), ( long )( ( unsigned long )lPos + ptrQueue->m_ulMask + 1 ) );
+    return 1;
 }
 
-void AllocThreadPool( SThreadPool* ppool, unsigned long ulThreadPoolSize, unsigned long ulMaxQueueSize )
+/* Claims the longest run of free cells (up to ulCount) with a single CAS. Returns the number of tasks pushed */
+unsigned long PushRingQueueBatch( SRingQueue* ptrQueue, const SThreadPoolTask* ptr, unsigned long ulCount )
 {
-    CRITICAL_SECTION* const pcs = &( ppool->m_cCriticalSection );
-    unsigned long i;
-    HANDLE thrd;
+    SRingCell* pCell;
+    long lPos, lDiff;
+    unsigned long i, ulFree;
 
-#if defined ( _WIN32_WINNT ) && ( _WIN32_WINNT >= 0x0403 )
-    InitializeCriticalSectionAndSpinCount( pcs, 0x00000064 );
-#else
-    InitializeCriticalSection( pcs );
-#endif
+    if( 0 == ulCount )
+        return 0;
 
-    if( ulThreadPoolSize > 5 )
-        ulThreadPoolSize = 5;
+    for(;;)
+    {
+        lPos = AtomicLoad( &( ptrQueue->m_lEnqueuePos ) );
+        for( ulFree = 0; ulFree < ulCount; ++ulFree )
+        {
+            pCell = ptrQueue->m_ptrCells + ( ( ( unsigned long )lPos + ulFree ) & ptrQueue->m_ulMask );
+            lDiff = ( long )( ( unsigned long )AtomicLoad( &( pCell->m_lSequence ) ) - ( ( unsigned long )lPos + ulFree ) );
+            if( 0 != lDiff )
+                break;
+        }
 
-    if( ulMaxQueueSize > 1500 )
-        ulMaxQueueSize = 1500;
+        if( 0 != ulFree )
+        {
+            if( AtomicCas( &( ptrQueue->m_lEnqueuePos ), lPos, ( long )( ( unsigned long )lPos + ulFree ) ) )
+                break;
+        }
+        else if( lDiff < 0 )
+            return 0;
+    }
 
-    EnterCriticalSection( pcs );
-    ppool->m_iIsWorking = 1;
-    ppool->m_dwThreadPoolSize = 0;
-    ppool->m_ulMaxQueueSize = ulMaxQueueSize;
-    ppool->m_ulTaskRemained = 0;
-    AllocMemPool( &( ppool->m_cMemPool ) );
-    AllocQueue( &( ppool->m_cTaskQueue ) );
-    ppool->m_hEventForThreads = CreateEvent( NULL, FALSE, FALSE, NULL );
-    ppool->m_hEventForJoinAll = CreateEvent( NULL, FALSE, FALSE, NULL );
-    ppool->m_hEventForPutTask = CreateEvent( NULL, FALSE, FALSE, NULL );
-    for( i = 0; i < ulThreadPoolSize; ++i )
+    for( i = 0; i < ulFree; ++i )
     {
-        thrd = CreateThread( NULL, 0, ThreadPoolWorkProc, ppool, 0, NULL );
-        if( NULL != thrd )
-            ppool->m_cThreadPool[ ppool->m_dwThreadPoolSize++ ] = thrd;
+        pCell = ptrQueue->m_ptrCells + ( ( ( unsigned long )lPos + i ) & ptrQueue->m_ulMask );
+        pCell->m_cTask = ptr[ i ];
+        AtomicStore( &( pCell->m_lSequence ), ( long )( ( unsigned long )lPos + i + 1 ) );
     }
-    LeaveCriticalSection( pcs );
+    return ulFree;
 }
 
-void FreeThreadPool( SThreadPool* ppool )
+/* Claims the longest run of published cells (up to ulMax) with a single CAS. Returns the number of tasks popped */
+unsigned long PopRingQueueBatch( SRingQueue* ptrQueue, SThreadPoolTask* ptr, unsigned long ulMax )
 {
-    CRITICAL_SECTION* const pcs = &( ppool->m_cCriticalSection );
-    DWORD dwIndex;
-
-    ThreadPoolJoinAll( ppool );
+    SRingCell* pCell;
+    long lPos, lDiff;
+    unsigned long i, ulReady;
 
-    EnterCriticalSection( pcs );
-    ppool->m_iIsWorking = 0;
-    LeaveCriticalSection( pcs );
+    if( 0 == ulMax )
+        return 0;
 
-    while( 0 != ppool->m_dwThreadPoolSize )
+    for(;;)
     {
-        SetEvent( ppool->m_hEventForThreads );
-        dwIndex = WaitForMultipleObjects( ppool->m_dwThreadPoolSize, ppool->m_cThreadPool, FALSE, INFINITE );
-        dwIndex -= WAIT_OBJECT_0;
-        if( dwIndex <= ppool->m_dwThreadPoolSize )
+        lPos = AtomicLoad( &( ptrQueue->m_lDequeuePos ) );
+        for( ulReady = 0; ulReady < ulMax; ++ulReady )
         {
-            CloseHandle( ppool->m_cThreadPool[ dwIndex ] );
-            memmove_s( ppool->m_cThreadPool + dwIndex, ( ppool->m_dwThreadPoolSize - dwIndex ) * sizeof( ppool->m_cThreadPool[ 0 ] ), ppool->m_cThreadPool + dwIndex + 1, ( ppool->m_dwThreadPoolSize - dwIndex - 1 ) * sizeof( ppool->m_cThreadPool[ 0 ] ) );
-            ppool->m_dwThreadPoolSize--;
+            pCell = ptrQueue->m_ptrCells + ( ( ( unsigned long )lPos + ulReady ) & ptrQueue->m_ulMask );
+            lDiff = ( long )( ( unsigned long )AtomicLoad( &( pCell->m_lSequence ) ) - ( ( unsigned long )lPos + ulReady + 1 ) );
+            if( 0 != lDiff )
+                break;
         }
-        else
+
+        if( 0 != ulReady )
         {
-            for( dwIndex = 0; dwIndex < ppool->m_dwThreadPoolSize; ++dwIndex )
-                CloseHandle( ppool->m_cThreadPool[ dwIndex ] );
-            ppool->m_dwThreadPoolSize = 0;
+            if( AtomicCas( &( ptrQueue->m_lDequeuePos ), lPos, ( long )( ( unsigned long )lPos + ulReady ) ) )
+                break;
         }
+        else if( lDiff < 0 )
+            return 0;
     }
 
-    EnterCriticalSection( pcs );
-    FreeMemPool( &( ppool->m_cMemPool ) );
-    FreeQueue( &( ppool->m_cTaskQueue ) );
-    memset( &( ppool->m_cThreadPool ), 0, sizeof( ppool->m_cThreadPool ) );
-    CloseHandle( ppool->m_hEventForThreads );
-    CloseHandle( ppool->m_hEventForJoinAll );
-    CloseHandle( ppool->m_hEventForPutTask );
-    ppool->m_hEventForThreads = NULL;
-    ppool->m_hEventForJoinAll = NULL;
-    ppool->m_hEventForPutTask = NULL;
-    ppool->m_dwThreadPoolSize = 0;
-    ppool->m_ulMaxQueueSize = 0;
-    ppool->m_ulTaskRemained = 0;
-    LeaveCriticalSection( pcs );
-    DeleteCriticalSection( pcs );
-    memset( pcs, 0, sizeof( *pcs ) );
+    for( i = 0; i < ulReady; ++i )
+    {
+        pCell = ptrQueue->m_ptrCells + ( ( ( unsigned long )lPos + i ) & ptrQueue->m_ulMask );
+        ptr[ i ] = pCell->m_cTask;
+        AtomicStore( &( pCell->m_lSequence ), ( long )( ( unsigned long )lPos + i + ptrQueue->m_ulMask + 1 ) );
+    }
+    return ulReady;
 }
 
-void AllocateTask( SThreadPool* ppool, SThreadPoolTask* ptask )
+unsigned long GetRingQueueSize( const SRingQueue* ptrQueue )
 {
-    CRITICAL_SECTION* const pcs = &( ppool->m_cCriticalSection );
-    EnterCriticalSection( pcs );
-    ptask->m_pFunc = NULL;
-    PopMemPool( &( ppool->m_cMemPool ), &( ptask->m_pPars ) );
-    LeaveCriticalSection( pcs );
+    SRingQueue* const pQueue = ( SRingQueue* )ptrQueue;
+    long lSize = ( long )( ( unsigned long )AtomicLoad( &( pQueue->m_lEnqueuePos ) ) - ( unsigned long )AtomicLoad( &( pQueue->m_lDequeuePos ) ) );
+    return lSize > 0 ? ( unsigned long )lSize : 0;
 }
 
-void PutTaskInQueue( SThreadPool* ppool, const SThreadPoolTask* ptask )
+void AllocBlockingQueue( SBlockingQueue* ptrQueue, unsigned long ulCapacity )
 {
-    CRITICAL_SECTION* const pcs = &( ppool->m_cCriticalSection );
-    unsigned long ulMaxQueueSize, ulQueueSize;
-    HANDLE hEventForPutTask;
-    int iIsWorking;
+    AllocRingQueue( &( ptrQueue->m_cQueue ), ulCapacity );
+    AllocLock( &( ptrQueue->m_cLock ) );
+    AllocCond( &( ptrQueue->m_cCond ) );
+    ptrQueue->m_lWaiters = 0;
+    ptrQueue->m_lSpin = TP_SPIN_MAX;
+    FullFence();
+}
 
-    if( NULL == ptask->m_pFunc )
+void FreeBlockingQueue( SBlockingQueue* ptrQueue )
+{
+    FreeCond( &( ptrQueue->m_cCond ) );
+    FreeLock( &( ptrQueue->m_cLock ) );
+    FreeRingQueue( &( ptrQueue->m_cQueue ) );
+}
+
+/* Wakes up to ulCount sleeping poppers. The fence pairs with the waiter increment done before a popper's last look */
+static void WakeBlockingQueue( SBlockingQueue* ptrQueue, unsigned long ulCount )
+{
+    FullFence();
+    if( 0 == AtomicLoad( &( ptrQueue->m_lWaiters ) ) )
         return;
 
-    for(;;)
+    EnterLock( &( ptrQueue->m_cLock ) );
+    if( ulCount >= ( unsigned long )AtomicLoad( &( ptrQueue->m_lWaiters ) ) )
+        WakeAllCond( &( ptrQueue->m_cCond ) );
+    else
     {
-        EnterCriticalSection( pcs );
-        iIsWorking = ppool->m_iIsWorking;
-        ulMaxQueueSize = ppool->m_ulMaxQueueSize;
-        ulQueueSize = ppool->m_cTaskQueue.m_ulSize;
-        hEventForPutTask = ppool->m_hEventForPutTask;
-        LeaveCriticalSection( pcs );
+        while( 0 != ulCount-- )
+            WakeCond( &( ptrQueue->m_cCond ) );
+    }
+    LeaveLock( &( ptrQueue->m_cLock ) );
+}
 
-        if( !iIsWorking )
-            return;
+int PushBlockingQueue( SBlockingQueue* ptrQueue, const SThreadPoolTask* ptr )
+{
+    if( !PushRingQueue( &( ptrQueue->m_cQueue ), ptr ) )
+        return 0;
 
-        if( ulQueueSize >= ulMaxQueueSize )
-            WaitForSingleObject( hEventForPutTask, INFINITE );
-        else
-            break;
-    }
+    WakeBlockingQueue( ptrQueue, 1 );
+    return 1;
+}
 
-    EnterCriticalSection( pcs );
-    PushQueue( &( ppool->m_cTaskQueue ), ptask );
-    ppool->m_ulTaskRemained++;
-    SetEvent( ppool->m_hEventForThreads );
-    LeaveCriticalSection( pcs );
+unsigned long PushBlockingQueueBatch( SBlockingQueue* ptrQueue, const SThreadPoolTask* ptr, unsigned long ulCount )
+{
+    const unsigned long ulPut = PushRingQueueBatch( &( ptrQueue->m_cQueue ), ptr, ulCount );
+
+    if( 0 != ulPut )
+        WakeBlockingQueue( ptrQueue, ulPut );
+    return ulPut;
 }
 
-void ThreadPoolJoinAll( SThreadPool* ppool )
+/* Spins up to m_lSpin pauses. A catch doubles the next spin, a miss halves it, so an idle queue costs a few pauses per pop */
+static int SpinBlockingQueue( SBlockingQueue* ptrQueue, SThreadPoolTask* ptr )
 {
-    CRITICAL_SECTION* const pcs = &( ppool->m_cCriticalSection );
-    unsigned long ulTaskRemained;
-    HANDLE hEventForJoinAll, hEventForThreads;
+    const long lSpin = AtomicLoad( &( ptrQueue->m_lSpin ) );
+    long i;
 
-    for(;;)
+    for( i = 0; i < lSpin; ++i )
     {
-        EnterCriticalSection( pcs );
-        ulTaskRemained = ppool->m_ulTaskRemained;
-        hEventForJoinAll = ppool->m_hEventForJoinAll;
-        hEventForThreads = ppool->m_hEventForThreads;
-        LeaveCriticalSection( pcs );
+        CpuPause();
+        if( 0 != GetRingQueueSize( &( ptrQueue->m_cQueue ) ) && PopRingQueue( &( ptrQueue->m_cQueue ), ptr ) )
+        {
+            if( lSpin < TP_SPIN_MAX )
+                AtomicStore( &( ptrQueue->m_lSpin ), lSpin * 2 );
+            return 1;
+        }
+    }
+
+    if( lSpin > TP_SPIN_MIN )
+        AtomicStore( &( ptrQueue->m_lSpin ), lSpin / 2 );
+    return 0;
+}
+
+/* Pops a task, waiting up to ulMs milliseconds (TP_WAIT_INFINITE: no limit, 0: no wait). Returns 0 on timeout */
+int PopBlockingQueue( SBlockingQueue* ptrQueue, SThreadPoolTask* ptr, unsigned long ulMs )
+{
+    unsigned long ulStart, ulElapsed;
+    int iDone;
+
+    if( PopRingQueue( &( ptrQueue->m_cQueue ), ptr ) )
+        return 1;
+    if( 0 == ulMs )
+        return 0;
+    if( SpinBlockingQueue( ptrQueue, ptr ) )
+        return 1;
 
-        if( 0 != ulTaskRemained )
+    ulStart = GetTickMs();
+    EnterLock( &( ptrQueue->m_cLock ) );
+
+    /* Announce the waiter before the last look, a pusher then has to take the lock before waking */
+    AtomicIncrement( &( ptrQueue->m_lWaiters ) );
+    while( 0 == ( iDone = PopRingQueue( &( ptrQueue->m_cQueue ), ptr ) ) )
+    {
+        if( TP_WAIT_INFINITE == ulMs )
+            WaitCond( &( ptrQueue->m_cCond ), &( ptrQueue->m_cLock ) );
+        else if( ( ulElapsed = GetTickMs() - ulStart ) >= ulMs || !WaitCondTimeout( &( ptrQueue->m_cCond ), &( ptrQueue->m_cLock ), ulMs - ulElapsed ) )
         {
-            SetEvent( hEventForThreads );
-            if( WAIT_FAILED == WaitForSingleObject( hEventForJoinAll, INFINITE ) )
-                return;
+            iDone = PopRingQueue( &( ptrQueue->m_cQueue ), ptr );
+            break;
         }
-        else
-            return;
     }
+    AtomicDecrement( &( ptrQueue->m_lWaiters ) );
+    LeaveLock( &( ptrQueue->m_cLock ) );
+    return iDone;
 }
 
-DWORD WINAPI ThreadPoolWorkProc( LPVOID lpParameter )
+void AllocWorkDeque( SWorkDeque* ptrDeque, unsigned long ulCapacity )
 {
-    SThreadPool* pThreadPool = ( SThreadPool* )lpParameter;
-    SThreadPoolTask task;
-    unsigned long ulSize;
-    int iIsWorking;
-    HANDLE hEventForThreads;
-    CRITICAL_SECTION* const pcs = &( pThreadPool->m_cCriticalSection );
+    unsigned long ulSize = 2;
 
-    for(;;)
+    while( ulSize < ulCapacity )
+        ulSize *= 2;
+
+    ptrDeque->m_ptrTasks = ( SThreadPoolTask* )malloc( ulSize * sizeof( ptrDeque->m_ptrTasks[ 0 ] ) );
+    ptrDeque->m_ulMask = ulSize - 1;
+    ptrDeque->m_lTop = 0;
+    ptrDeque->m_lBottom = 0;
+    FullFence();
+}
+
+void FreeWorkDeque( SWorkDeque* ptrDeque )
+{
+    free( ptrDeque->m_ptrTasks );
+    ptrDeque->m_ptrTasks = NULL;
+    ptrDeque->m_ulMask = 0;
+    ptrDeque->m_lTop = 0;
+    ptrDeque->m_lBottom = 0;
+}
+
+/* Owner only. Returns 0 when the deque is full */
+int PushWorkDeque( SWorkDeque* ptrDeque, const SThreadPoolTask* ptr )
+{
+    const long lBottom = ptrDeque->m_lBottom;
+    const long lTop = AtomicLoad( &( ptrDeque->m_lTop ) );
+
+    if( ( unsigned long )lBottom - ( unsigned long )lTop > ptrDeque->m_ulMask )
+        return 0;
+
+    ptrDeque->m_ptrTasks[ ( unsigned long )lBottom & ptrDeque->m_ulMask ] = *ptr;
+    AtomicStore( &( ptrDeque->m_lBottom ), ( long )( ( unsigned long )lBottom + 1 ) );
+    return 1;
+}
+
+/*
+ * Owner only, takes the most recently pushed task.
+ * The indices only grow and wrap, so they are compared by their unsigned difference, never directly
+ */
+int TakeWorkDeque( SWorkDeque* ptrDeque, SThreadPoolTask* ptr )
+{
+    const long lBottom = ( long )( ( unsigned long )ptrDeque->m_lBottom - 1 );
+    long lTop;
+    int iTaken = 1;
+
+    AtomicStore( &( ptrDeque->m_lBottom ), lBottom );
+    FullFence();
+    lTop = AtomicLoad( &( ptrDeque->m_lTop ) );
+
+    if( ( long )( ( unsigned long )lBottom - ( unsigned long )lTop ) < 0 )
+    {
+        AtomicStore( &( ptrDeque->m_lBottom ), ( long )( ( unsigned long )lBottom + 1 ) );
+        return 0;
+    }
+
+    *ptr = ptrDeque->m_ptrTasks[ ( unsigned long )lBottom & ptrDeque->m_ulMask ];
+    if( lTop == lBottom )
     {
-        task.m_pFunc = NULL;
-        task.m_pPars = NULL;
+        /* Last task: race against thieves for it */
+        iTaken = AtomicCas( &( ptrDeque->m_lTop ), lTop, ( long )( ( unsigned long )lTop + 1 ) );
+        AtomicStore( &( ptrDeque->m_lBottom ), ( long )( ( unsigned long )lBottom + 1 ) );
+    }
+    return iTaken;
+}
 
-        EnterCriticalSection( pcs );
-        ulSize = pThreadPool->m_cTaskQueue.m_ulSize;
-        hEventForThreads = pThreadPool->m_hEventForThreads;
-        LeaveCriticalSection( pcs );
+/* Any thread, takes the oldest task. Returns 0 when the deque is empty or another thief won the race */
+int StealWorkDeque( SWorkDeque* ptrDeque, SThreadPoolTask* ptr )
+{
+    const long lTop = AtomicLoad( &( ptrDeque->m_lTop ) );
+    long lBottom;
 
-        if( 0 != ulSize || WAIT_FAILED != WaitForSingleObject( hEventForThreads, INFINITE ) )
-        {
-            EnterCriticalSection( pcs );
-            iIsWorking = pThreadPool->m_iIsWorking;
-            LeaveCriticalSection( pcs );
+    FullFence();
+    lBottom = AtomicLoad( &( ptrDeque->m_lBottom ) );
+    if( ( long )( ( unsigned long )lBottom - ( unsigned long )lTop ) <= 0 )
+        return 0;
 
-            if( 0 == iIsWorking )
-                return 0;
+    *ptr = ptrDeque->m_ptrTasks[ ( unsigned long )lTop & ptrDeque->m_ulMask ];
+    return AtomicCas( &( ptrDeque->m_lTop ), lTop, ( long )( ( unsigned long )lTop + 1 ) );
+}
 
-            EnterCriticalSection( pcs );
-            if( 0 != pThreadPool->m_cTaskQueue.m_ulSize )
-            {
-                PopQueue( &( pThreadPool->m_cTaskQueue ), &task );
-                if( pThreadPool->m_ulMaxQueueSize - 1 == pThreadPool->m_cTaskQueue.m_ulSize )
-                    SetEvent( pThreadPool->m_hEventForPutTask );
-            }
-            LeaveCriticalSection( pcs );
-        }
+/*
+ * Task argument allocator. Requests up to TP_ARG_MAX_SIZE are rounded up to a power of two size class, larger ones go to malloc.
+ * Every thread allocates from its own cache refilled by slabs. A block freed by another thread is collected in a per class batch
+ * and handed back to the owning cache with one CAS, the owner picks returned blocks up when its free list runs dry
+ */
+#define TP_ARG_MIN_SHIFT 4
+#define TP_ARG_CLASSES 8                    /* 16 .. 2048 bytes */
+#define TP_ARG_MAX_SIZE ( 1UL << ( TP_ARG_MIN_SHIFT + TP_ARG_CLASSES - 1 ) )
+#define TP_ARG_LARGE_CLASS TP_ARG_CLASSES
+#define TP_ARG_SLAB_SIZE 32768
+#define TP_ARG_REMOTE_BATCH 32
+
+/* Free blocks are linked through their payload */
+typedef struct STaskArgBlock
+{
+    struct STaskArgBlock* m_pNext;
+} STaskArgBlock;
+
+/* Precedes every payload, size_t keeps the payload aligned to 2 * sizeof( void* ) */
+typedef struct STaskArgHeader
+{
+    struct STaskArgCache* m_pOwner;
+    size_t m_ulClass;
+} STaskArgHeader;
+
+typedef struct STaskArgCache
+{
+    STaskArgBlock* m_ptrFree[ TP_ARG_CLASSES ];
+    struct STaskArgCache* m_ptrPendingOwner[ TP_ARG_CLASSES ];
+    STaskArgBlock* m_ptrPendingHead[ TP_ARG_CLASSES ];
+    STaskArgBlock* m_ptrPendingTail[ TP_ARG_CLASSES ];
+    unsigned long m_ulPending[ TP_ARG_CLASSES ];
+    struct STaskArgCache* m_pNext;
+    volatile long m_lInUse;
+    char m_cPad0[ TP_CACHE_LINE_SIZE ];
+    void* volatile m_ptrRemote[ TP_ARG_CLASSES ];   /* Chains of blocks returned by other threads */
+    char m_cPad1[ TP_CACHE_LINE_SIZE ];
+} STaskArgCache;
+
+/* Caches outlive their threads: blocks still in flight keep a valid owner, a new thread adopts a released cache */
+static void* volatile g_pArgCaches = NULL;
+static TP_THREAD_LOCAL STaskArgCache* g_pArgCache = NULL;
+
+static void ReleaseArgCache( void* );
+
+#ifndef USE_PTHREAD_THREAD_FORCE
+static DWORD g_dwArgCacheFls = FLS_OUT_OF_INDEXES;
+static INIT_ONCE g_cArgCacheOnce = INIT_ONCE_STATIC_INIT;
+
+static VOID WINAPI ReleaseArgCacheFls( PVOID p ) { ReleaseArgCache( p ); }
+
+static BOOL CALLBACK InitArgCacheKey( PINIT_ONCE pOnce, PVOID pParam, PVOID* ppContext )
+{
+    pOnce; pParam; ppContext;
+    g_dwArgCacheFls = FlsAlloc( ReleaseArgCacheFls );
+    return TRUE;
+}
+
+/* The fiber local slot only serves as a thread exit notification */
+static void RegisterArgCache( STaskArgCache* pCache )
+{
+    InitOnceExecuteOnce( &g_cArgCacheOnce, InitArgCacheKey, NULL, NULL );
+    FlsSetValue( g_dwArgCacheFls, pCache );
+}
+#else
+static pthread_key_t g_cArgCacheKey;
+static pthread_once_t g_cArgCacheOnce = PTHREAD_ONCE_INIT;
+
+static void InitArgCacheKey( void ) { pthread_key_create( &g_cArgCacheKey, ReleaseArgCache ); }
+
+/* The key only serves as a thread exit notification */
+static void RegisterArgCache( STaskArgCache* pCache )
+{
+    pthread_once( &g_cArgCacheOnce, InitArgCacheKey );
+    pthread_setspecific( g_cArgCacheKey, pCache );
+}
+#endif
+
+static STaskArgCache* GetArgCache( void )
+{
+    STaskArgCache* pCache = g_pArgCache;
+    void* pHead;
 
-        if( task.m_pFunc && task.m_pPars )
+    if( NULL != pCache )
+        return pCache;
+
+    for( pCache = ( STaskArgCache* )AtomicLoadPtr( &g_pArgCaches ); NULL != pCache; pCache = pCache->m_pNext )
+    {
+        if( 0 == AtomicLoad( &( pCache->m_lInUse ) ) && AtomicCas( &( pCache->m_lInUse ), 0, 1 ) )
+            break;
+    }
+
+    if( NULL == pCache )
+    {
+        pCache = ( STaskArgCache* )calloc( 1, sizeof( *pCache ) );
+        pCache->m_lInUse = 1;
+        do
         {
-            ( *task.m_pFunc )( task.m_pPars );
-            EnterCriticalSection( pcs );
-            pThreadPool->m_ulTaskRemained--;
-            if( 0 == pThreadPool->m_ulTaskRemained )
-                SetEvent( pThreadPool->m_hEventForJoinAll );
-            PushMemPool( &( pThreadPool->m_cMemPool ), task.m_pPars );
-            iIsWorking = pThreadPool->m_iIsWorking;
-            LeaveCriticalSection( pcs );
-            if( 0 == iIsWorking )
-                return 0;
-        }
+            pHead = AtomicLoadPtr( &g_pArgCaches );
+            pCache->m_pNext = ( STaskArgCache* )pHead;
+        } while( !AtomicCasPtr( &g_pArgCaches, pHead, pCache ) );
     }
-}
\ No newline at end of file
+
+    g_pArgCache = pCache;
+    RegisterArgCache( pCache );
+    return pCache;
+}
+
+static void FlushArgPending( STaskArgCache* pCache, unsigned long ulClass )
+{
+    STaskArgCache* const pOwner = pCache->m_ptrPendingOwner[ ulClass ];
+    void* pHead;
+
+    if( NULL == pOwner )
+        return;
+
+    /* Only the owner ever detaches the chain and it takes it whole, so pushes are ABA safe */
+    do
+    {
+        pHead = AtomicLoadPtr( &( pOwner->m_ptrRemote[ ulClass ] ) );
+        pCache->m_ptrPendingTail[ ulClass ]->m_pNext = ( STaskArgBlock* )pHead;
+    } while( !AtomicCasPtr( &( pOwner->m_ptrRemote[ ulClass ] ), pHead, pCache->m_ptrPendingHead[ ulClass ] ) );
+
+    pCache->m_ptrPendingOwner[ ulClass ] = NULL;
+    pCache->m_ptrPendingHead[ ulClass ] = NULL;
+    pCache->m_ptrPendingTail[ ulClass ] = NULL;
+    pCache->m_ulPending[ ulClass ] = 0;
+}
+
+static void ReleaseArgCache( void* p )
+{
+    STaskArgCache* const pCache = ( STaskArgCache* )p;
+    unsigned long i;
+
+    for( i = 0; i < TP_ARG_CLASSES; ++i )
+        FlushArgPending( pCache, i );
+    g_pArgCache = NULL;
+    AtomicStore( &( pCache->m_lInUse ), 0 );
+}
+
+/* Blocks returned by other threads come first, a new slab is carved only when there are none */
+static STaskArgBlock* RefillArgCache( STaskArgCache* pCache, unsigned long ulClass )
+{
+    const size_t ulStride = sizeof( STaskArgHeader ) + ( ( size_t )1 << ( ulClass + TP_ARG_MIN_SHIFT ) );
+    size_t ulCount = TP_ARG_SLAB_SIZE / ulStride;
+    STaskArgBlock* pList;
+    STaskArgHeader* pHeader;
+    char* pSlab;
+
+    pList = ( STaskArgBlock* )AtomicExchangePtr( &( pCache->m_ptrRemote[ ulClass ] ), NULL );
+    if( NULL != pList )
+        return pList;
+
+    pSlab = ( char* )malloc( TP_ARG_SLAB_SIZE );
+    while( ulCount-- > 0 )
+    {
+        pHeader = ( STaskArgHeader* )( pSlab + ulCount * ulStride );
+        pHeader->m_pOwner = pCache;
+        pHeader->m_ulClass = ulClass;
+        ( ( STaskArgBlock* )( pHeader + 1 ) )->m_pNext = pList;
+        pList = ( STaskArgBlock* )( pHeader + 1 );
+    }
+    return pList;
+}
+
+void* AllocTaskArg( unsigned long ulSize )
+{
+    unsigned long ulClass = 0;
+    STaskArgCache* pCache;
+    STaskArgHeader* pHeader;
+    STaskArgBlock* pBlock;
+
+    if( ulSize > TP_ARG_MAX_SIZE )
+    {
+        pHeader = ( STaskArgHeader* )malloc( sizeof( *pHeader ) + ulSize );
+        pHeader->m_pOwner = NULL;
+        pHeader->m_ulClass = TP_ARG_LARGE_CLASS;
+        return pHeader + 1;
+    }
+
+    while( ( 1UL << ( ulClass + TP_ARG_MIN_SHIFT ) ) < ulSize )
+        ulClass++;
+
+    pCache = GetArgCache();
+    pBlock = pCache->m_ptrFree[ ulClass ];
+    if( NULL == pBlock )
+        pBlock = RefillArgCache( pCache, ulClass );
+    pCache->m_ptrFree[ ulClass ] = pBlock->m_pNext;
+    return pBlock;
+}
+
+void FreeTaskArg( void* ptr )
+{
+    STaskArgBlock* const pBlock = ( STaskArgBlock* )ptr;
+    STaskArgHeader* pHeader;
+    STaskArgCache* pCache;
+    unsigned long ulClass;
+
+    if( NULL == ptr )
+        return;
+
+    pHeader = ( STaskArgHeader* )ptr - 1;
+    ulClass = ( unsigned long )pHeader->m_ulClass;
+    if( TP_ARG_LARGE_CLASS == ulClass )
+    {
+        free( pHeader );
+        return;
+    }
+
+    pCache = GetArgCache();
+    if( pHeader->m_pOwner == pCache )
+    {
+        pBlock->m_pNext = pCache->m_ptrFree[ ulClass ];
+        pCache->m_ptrFree[ ulClass ] = pBlock;
+        return;
+    }
+
+    if( pHeader->m_pOwner != pCache->m_ptrPendingOwner[ ulClass ] )
+        FlushArgPending( pCache, ulClass );
+    if( NULL == pCache->m_ptrPendingHead[ ulClass ] )
+        pCache->m_ptrPendingTail[ ulClass ] = pBlock;
+    pBlock->m_pNext = pCache->m_ptrPendingHead[ ulClass ];
+    pCache->m_ptrPendingHead[ ulClass ] = pBlock;
+    pCache->m_ptrPendingOwner[ ulClass ] = pHeader->m_pOwner;
+    if( ++( pCache->m_ulPending[ ulClass ] ) >= TP_ARG_REMOTE_BATCH )
+        FlushArgPending( pCache, ulClass );
+}
+
+void FlushTaskArgCache( void )
+{
+    STaskArgCache* const pCache = g_pArgCache;
+    unsigned long i;
+
+    if( NULL == pCache )
+        return;
+    for( i = 0; i < TP_ARG_CLASSES; ++i )
+        FlushArgPending( pCache, i );
+}
+
+static TP_THREAD_LOCAL SThreadPoolWorker* g_pCurrentWorker = NULL;
+
+#ifndef USE_PTHREAD_THREAD_FORCE
+unsigned long GetAvailableCpuCount( void )
+{
+    DWORD_PTR dwProcessMask, dwSystemMask;
+    unsigned long ulCount = 0;
+
+    if( !GetProcessAffinityMask( GetCurrentProcess(), &dwProcessMask, &dwSystemMask ) )
+        return 1;
+
+    for( ; 0 != dwProcessMask; dwProcessMask &= dwProcessMask - 1 )
+        ulCount++;
+    return 0 != ulCount ? ulCount : 1;
+}
+
+static void SetCurrentAffinity( const unsigned long* pulCpus, unsigned long ulCount )
+{
+    DWORD_PTR dwMask = 0;
+    unsigned long i;
+
+    for( i = 0; i < ulCount; ++i )
+    {
+        if( pulCpus[ i ] < TP_MAX_CPUS )
+            dwMask |= ( DWORD_PTR )1 << pulCpus[ i ];
+    }
+    if( 0 != dwMask )
+        SetThreadAffinityMask( GetCurrentThread(), dwMask );
+}
+
+static void SetCurrentPriority( unsigned long ulPriority )
+{
+    if( TP_THREAD_PRIORITY_HIGH == ulPriority )
+        SetThreadPriority( GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL );
+    else if( TP_THREAD_PRIORITY_LOW == ulPriority )
+        SetThreadPriority( GetCurrentThread(), THREAD_PRIORITY_IDLE );
+}
+#else
+/* CFS bandwidth limit in whole CPUs (rounded up), 0 if there is no quota */
+static unsigned long GetCgroupCpuQuota( void )
+{
+    FILE* pFile;
+    long lQuota = -1, lPeriod = 0;
+    char szQuota[ 32 ];
+
+    if( NULL != ( pFile = fopen( "/sys/fs/cgroup/cpu.max", "r" ) ) )
+    {
+        /* cgroup v2: "<quota|max> <period>" */
+        if( 2 == fscanf( pFile, "%31s %ld", szQuota, &lPeriod ) && 0 != strcmp( szQuota, "max" ) )
+            lQuota = atol( szQuota );
+        fclose( pFile );
+    }
+    else if( NULL != ( pFile = fopen( "/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r" ) ) )
+    {
+        /* cgroup v1, -1 means unlimited */
+        if( 1 != fscanf( pFile, "%ld", &lQuota ) )
+            lQuota = -1;
+        fclose( pFile );
+        if( NULL != ( pFile = fopen( "/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r" ) ) )
+        {
+            if( 1 != fscanf( pFile, "%ld", &lPeriod ) )
+                lPeriod = 0;
+            fclose( pFile );
+        }
+    }
+
+    if( lQuota <= 0 || lPeriod <= 0 )
+        return 0;
+    return ( unsigned long )( ( lQuota + lPeriod - 1 ) / lPeriod );
+}
+
+unsigned long GetAvailableCpuCount( void )
+{
+    cpu_set_t cpuset;
+    unsigned long ulCount = 0, ulQuota;
+    long lOnline;
+
+    if( 0 == sched_getaffinity( 0, sizeof( cpuset ), &cpuset ) )
+        ulCount = ( unsigned long )CPU_COUNT( &cpuset );
+    else if( ( lOnline = sysconf( _SC_NPROCESSORS_ONLN ) ) > 0 )
+        ulCount = ( unsigned long )lOnline;
+
+    ulQuota = GetCgroupCpuQuota();
+    if( 0 != ulQuota && ( 0 == ulCount || ulQuota < ulCount ) )
+        ulCount = ulQuota;
+    return 0 != ulCount ? ulCount : 1;
+}
+
+static void SetCurrentAffinity( const unsigned long* pulCpus, unsigned long ulCount )
+{
+    cpu_set_t cSet;
+    unsigned long i;
+
+    CPU_ZERO( &cSet );
+    for( i = 0; i < ulCount; ++i )
+    {
+        if( pulCpus[ i ] < CPU_SETSIZE )
+            CPU_SET( pulCpus[ i ], &cSet );
+    }
+    if( 0 != CPU_COUNT( &cSet ) )
+        sched_setaffinity( 0, sizeof( cSet ), &cSet );
+}
+
+/* Linux keeps nice values per thread, elsewhere nice is per process and is left alone */
+static void SetCurrentNice( int iNice )
+{
+#if defined( __linux__ ) && defined( SYS_gettid )
+    setpriority( PRIO_PROCESS, ( id_t )syscall( SYS_gettid ), iNice );
+#else
+    ( void )iNice;
+#endif
+}
+
+static void SetCurrentPriority( unsigned long ulPriority )
+{
+    struct sched_param sp;
+
+    memset( &sp, 0, sizeof( sp ) );
+    if( TP_THREAD_PRIORITY_HIGH == ulPriority )
+    {
+        /* Real-time FIFO needs CAP_SYS_NICE */
+        sp.sched_priority = sched_get_priority_min( SCHED_FIFO );
+        if( 0 != pthread_setschedparam( pthread_self(), SCHED_FIFO, &sp ) )
+            SetCurrentNice( -5 );
+    }
+    else if( TP_THREAD_PRIORITY_LOW == ulPriority )
+        SetCurrentNice( 10 );
+}
+#endif
+
+#define TP_WORKER_FREE 0
+#define TP_WORKER_RUNNING 1
+#define TP_WORKER_EXITED 2
+
+void InitThreadPoolParams( SThreadPoolParams* pparams )
+{
+    pparams->m_ulThreadPoolSize = 0;
+    pparams->m_ulMaxQueueSize = 1500;
+    pparams->m_ulLocalQueueSize = 256;
+    pparams->m_ulFlags = 0;
+    pparams->m_ulMinThreads = 0;
+    pparams->m_ulMaxThreads = 0;
+    pparams->m_ulGrowQueueDepth = 0;
+    pparams->m_ulKeepAliveMs = 60000;
+    pparams->m_ulPriorityLanes = 1;
+    pparams->m_ulStarvationLimit = 0;
+    pparams->m_ulAffinity = TP_AFFINITY_NONE;
+    pparams->m_ulAffinityNode = 0;
+    pparams->m_ptrAffinityCpus = NULL;
+    pparams->m_ulAffinityCpuCount = 0;
+    pparams->m_ulThreadPriority = TP_THREAD_PRIORITY_NORMAL;
+}
+
+/* Resolves the worker CPU set once, a spec that matches no CPU leaves workers unpinned */
+static void AllocAffinity( SThreadPool* ppool, const SThreadPoolParams* pparams )
+{
+    unsigned long ulCount = 0;
+
+    ppool->m_ulAffinity = TP_AFFINITY_NONE;
+    ppool->m_ptrAffinityCpus = NULL;
+    ppool->m_ulAffinityCpuCount = 0;
+    if( TP_AFFINITY_NONE == pparams->m_ulAffinity )
+        return;
+
+    if( TP_AFFINITY_CPUS == pparams->m_ulAffinity )
+    {
+        if( NULL == pparams->m_ptrAffinityCpus || 0 == pparams->m_ulAffinityCpuCount )
+            return;
+        ulCount = pparams->m_ulAffinityCpuCount;
+        ppool->m_ptrAffinityCpus = ( unsigned long* )malloc( ulCount * sizeof( ppool->m_ptrAffinityCpus[ 0 ] ) );
+        if( NULL != ppool->m_ptrAffinityCpus )
+            memcpy( ppool->m_ptrAffinityCpus, pparams->m_ptrAffinityCpus, ulCount * sizeof( ppool->m_ptrAffinityCpus[ 0 ] ) );
+    }
+    else
+    {
+        ppool->m_ptrAffinityCpus = ( unsigned long* )malloc( TP_MAX_CPUS * sizeof( ppool->m_ptrAffinityCpus[ 0 ] ) );
+        if( NULL != ppool->m_ptrAffinityCpus )
+            ulCount = GetTopologyCpus( TP_AFFINITY_NUMA == pparams->m_ulAffinity ? CT_NUMA_NODE : CT_CORES, pparams->m_ulAffinityNode, ppool->m_ptrAffinityCpus );
+    }
+
+    if( NULL == ppool->m_ptrAffinityCpus || 0 == ulCount )
+    {
+        free( ppool->m_ptrAffinityCpus );
+        ppool->m_ptrAffinityCpus = NULL;
+        return;
+    }
+    ppool->m_ulAffinity = pparams->m_ulAffinity;
+    ppool->m_ulAffinityCpuCount = ulCount;
+}
+
+/* Pins the calling worker and applies the worker priority */
+static void SetWorkerPlacement( const SThreadPoolWorker* pWorker )
+{
+    const SThreadPool* ppool = pWorker->m_pPool;
+
+    if( TP_AFFINITY_CORE == ppool->m_ulAffinity )
+        SetCurrentAffinity( ppool->m_ptrAffinityCpus + pWorker->m_ulIndex % ppool->m_ulAffinityCpuCount, 1 );
+    else if( TP_AFFINITY_NONE != ppool->m_ulAffinity )
+        SetCurrentAffinity( ppool->m_ptrAffinityCpus, ppool->m_ulAffinityCpuCount );
+
+    if( TP_THREAD_PRIORITY_NORMAL != ppool->m_ulThreadPriority )
+        SetCurrentPriority( ppool->m_ulThreadPriority );
+}
+
+/*
+ * Starts a worker in a free slot, reaping a retired thread there first.
+ * Lock is held by the caller
+ */
+static int GrowThreadPool( SThreadPool* ppool )
+{
+    SThreadPoolWorker* pWorker = NULL;
+    unsigned long i;
+
+    if( AtomicLoad( &( ppool->m_lThreadPoolSize ) ) >= AtomicLoad( &( ppool->m_lMaxThreads ) ) )
+        return 0;
+
+    for( i = 0; i < ppool->m_ulThreadPoolCapacity && NULL == pWorker; ++i )
+    {
+        if( TP_WORKER_RUNNING != ppool->m_ptrThreadPool[ i ].m_iState )
+            pWorker = ppool->m_ptrThreadPool + i;
+    }
+    if( NULL == pWorker )
+        return 0;
+
+    if( TP_WORKER_EXITED == pWorker->m_iState )
+        JoinWorker( pWorker->m_hThread );
+    pWorker->m_iState = TP_WORKER_FREE;
+    if( !CreateWorker( &( pWorker->m_hThread ), pWorker ) )
+        return 0;
+
+    pWorker->m_iState = TP_WORKER_RUNNING;
+    AtomicIncrement( &( ppool->m_lThreadPoolSize ) );
+    AtomicIncrement( &( ppool->m_lThreadsGrown ) );
+    return 1;
+}
+
+void AllocThreadPoolEx( SThreadPool* ppool, const SThreadPoolParams* pparams )
+{
+    TP_LOCK* const pcs = &( ppool->m_cCriticalSection );
+    unsigned long ulThreadPoolSize = pparams->m_ulThreadPoolSize;
+    unsigned long ulMaxQueueSize = pparams->m_ulMaxQueueSize;
+    unsigned long ulMinThreads, ulMaxThreads;
+    SThreadPoolWorker* pWorker;
+    unsigned long i;
+
+    AllocLock( pcs );
+    AllocCond( &( ppool->m_cCondForThreads ) );
+    AllocCond( &( ppool->m_cCondForJoinAll ) );
+    AllocCond( &( ppool->m_cCondForPutTask ) );
+
+    if( 0 == ulThreadPoolSize )
+        ulThreadPoolSize = GetAvailableCpuCount();
+
+    if( 0 == pparams->m_ulMaxThreads )
+    {
+        ulMinThreads = ulThreadPoolSize;
+        ulMaxThreads = ulThreadPoolSize;
+    }
+    else
+    {
+        ulMaxThreads = pparams->m_ulMaxThreads;
+        ulMinThreads = pparams->m_ulMinThreads < ulMaxThreads ? pparams->m_ulMinThreads : ulMaxThreads;
+        if( ulThreadPoolSize > ulMaxThreads )
+            ulThreadPoolSize = ulMaxThreads;
+        if( ulThreadPoolSize < ulMinThreads )
+            ulThreadPoolSize = ulMinThreads;
+    }
+
+    if( 0 == ulMaxQueueSize )
+#ifdef THREAD_POOL_LOCKFREE_QUEUE
+        ulMaxQueueSize = TP_DEFAULT_RING_SIZE;
+#else
+        ulMaxQueueSize = ( unsigned long )-1;
+#endif
+
+    AllocAffinity( ppool, pparams );
+    ppool->m_ulThreadPriority = pparams->m_ulThreadPriority;
+
+    EnterLock( pcs );
+    ppool->m_iIsWorking = 1;
+    ppool->m_ulFlags = pparams->m_ulFlags;
+    ppool->m_ulMaxQueueSize = ulMaxQueueSize;
+    ppool->m_lTaskRemained = 0;
+    ppool->m_lPutTaskWaiters = 0;
+    ppool->m_lPutWaits = 0;
+    ppool->m_lPutWaitUs = 0;
+    ppool->m_lIdleThreads = 0;
+    ppool->m_lWakePending = 0;
+    ppool->m_lWakeups = 0;
+    ppool->m_lLocalTasks = 0;
+    ppool->m_ulThreadPoolCapacity = ulMaxThreads;
+    ppool->m_lThreadPoolSize = 0;
+    ppool->m_lMinThreads = ( long )ulMinThreads;
+    ppool->m_lMaxThreads = ( long )ulMaxThreads;
+    ppool->m_ulGrowQueueDepth = pparams->m_ulGrowQueueDepth;
+    ppool->m_ulKeepAliveMs = pparams->m_ulKeepAliveMs;
+    ppool->m_lThreadsGrown = 0;
+    ppool->m_lThreadsRetired = 0;
+    ppool->m_ulPriorityLanes = pparams->m_ulPriorityLanes;
+    if( 0 == ppool->m_ulPriorityLanes )
+        ppool->m_ulPriorityLanes = 1;
+    else if( ppool->m_ulPriorityLanes > TP_PRIORITY_LANES )
+        ppool->m_ulPriorityLanes = TP_PRIORITY_LANES;
+    ppool->m_ulStarvationLimit = pparams->m_ulStarvationLimit;
+    ppool->m_lLaneMask = 0;
+    ppool->m_lLaneStreak = 0;
+    ppool->m_lStarvedLane = 0;
+    memset( ppool->m_cLanes, 0, sizeof( ppool->m_cLanes ) );
+    for( i = 0; i < ppool->m_ulPriorityLanes; ++i )
+#ifdef THREAD_POOL_LOCKFREE_QUEUE
+        AllocRingQueue( &( ppool->m_cLanes[ i ].m_cQueue ), ulMaxQueueSize );
+#else
+        AllocQueue( &( ppool->m_cLanes[ i ].m_cQueue ) );
+#endif
+    ppool->m_ptrThreadPool = ( SThreadPoolWorker* )calloc( ulMaxThreads, sizeof( ppool->m_ptrThreadPool[ 0 ] ) );
+    /* Deques of all slots are set up before any worker starts, thieves scan all of them */
+    for( i = 0; i < ulMaxThreads; ++i )
+    {
+        pWorker = ppool->m_ptrThreadPool + i;
+        pWorker->m_pPool = ppool;
+        pWorker->m_iState = TP_WORKER_FREE;
+        pWorker->m_ulIndex = i;
+        pWorker->m_ulSeed = ( 2654435761UL * ( i + 1 ) ) & 0xFFFFFFFFUL;
+        AllocWorkDeque( &( pWorker->m_cDeque ), ( ppool->m_ulFlags & TPF_WORK_STEALING ) ? pparams->m_ulLocalQueueSize : 0 );
+    }
+    for( i = 0; i < ulThreadPoolSize; ++i )
+        GrowThreadPool( ppool );
+    ppool->m_lThreadsGrown = 0;
+    LeaveLock( pcs );
+}
+
+void AllocThreadPool( SThreadPool* ppool, unsigned long ulThreadPoolSize, unsigned long ulMaxQueueSize )
+{
+    SThreadPoolParams params;
+
+    InitThreadPoolParams( &params );
+    params.m_ulThreadPoolSize = ulThreadPoolSize;
+    params.m_ulMaxQueueSize = ulMaxQueueSize;
+    AllocThreadPoolEx( ppool, &params );
+}
+
+void FreeThreadPool( SThreadPool* ppool )
+{
+    TP_LOCK* const pcs = &( ppool->m_cCriticalSection );
+    unsigned long i;
+    int iState;
+
+    ThreadPoolJoinAll( ppool );
+
+    EnterLock( pcs );
+    ppool->m_iIsWorking = 0;
+    WakeAllCond( &( ppool->m_cCondForThreads ) );
+    WakeAllCond( &( ppool->m_cCondForPutTask ) );
+    LeaveLock( pcs );
+
+    for( i = 0; i < ppool->m_ulThreadPoolCapacity; ++i )
+    {
+        EnterLock( pcs );
+        iState = ppool->m_ptrThreadPool[ i ].m_iState;
+        LeaveLock( pcs );
+        if( TP_WORKER_FREE != iState )
+            JoinWorker( ppool->m_ptrThreadPool[ i ].m_hThread );
+    }
+
+    EnterLock( pcs );
+    for( i = 0; i < ppool->m_ulThreadPoolCapacity; ++i )
+        FreeWorkDeque( &( ppool->m_ptrThreadPool[ i ].m_cDeque ) );
+    for( i = 0; i < ppool->m_ulPriorityLanes; ++i )
+#ifdef THREAD_POOL_LOCKFREE_QUEUE
+        FreeRingQueue( &( ppool->m_cLanes[ i ].m_cQueue ) );
+#else
+        FreeQueue( &( ppool->m_cLanes[ i ].m_cQueue ) );
+#endif
+    free( ppool->m_ptrThreadPool );
+    free( ppool->m_ptrAffinityCpus );
+    ppool->m_ptrThreadPool = NULL;
+    ppool->m_ulThreadPoolCapacity = 0;
+    ppool->m_lThreadPoolSize = 0;
+    ppool->m_ulMaxQueueSize = 0;
+    ppool->m_lTaskRemained = 0;
+    LeaveLock( pcs );
+    FreeCond( &( ppool->m_cCondForThreads ) );
+    FreeCond( &( ppool->m_cCondForJoinAll ) );
+    FreeCond( &( ppool->m_cCondForPutTask ) );
+    FreeLock( pcs );
+    memset( pcs, 0, sizeof( *pcs ) );
+}
+
+/*
+ * Changes the elastic bounds at runtime. The maximum is capped by the worker slots allocated in AllocThreadPoolEx.
+ * Missing workers start at once, extra ones retire as soon as they go idle
+ */
+void ResizeThreadPool( SThreadPool* ppool, unsigned long ulMinThreads, unsigned long ulMaxThreads )
+{
+    TP_LOCK* const pcs = &( ppool->m_cCriticalSection );
+
+    if( ulMaxThreads > ppool->m_ulThreadPoolCapacity )
+        ulMaxThreads = ppool->m_ulThreadPoolCapacity;
+    if( ulMinThreads > ulMaxThreads )
+        ulMinThreads = ulMaxThreads;
+
+    EnterLock( pcs );
+    AtomicStore( &( ppool->m_lMinThreads ), ( long )ulMinThreads );
+    AtomicStore( &( ppool->m_lMaxThreads ), ( long )ulMaxThreads );
+    while( AtomicLoad( &( ppool->m_lThreadPoolSize ) ) < ( long )ulMinThreads && GrowThreadPool( ppool ) )
+        ;
+    WakeAllCond( &( ppool->m_cCondForThreads ) );
+    LeaveLock( pcs );
+}
+
+void GetThreadPoolCounters( SThreadPool* ppool, SThreadPoolCounters* pcounters )
+{
+    pcounters->m_ulThreads = ( unsigned long )AtomicLoad( &( ppool->m_lThreadPoolSize ) );
+    pcounters->m_ulIdleThreads = ( unsigned long )AtomicLoad( &( ppool->m_lIdleThreads ) );
+    pcounters->m_ulThreadsGrown = ( unsigned long )AtomicLoad( &( ppool->m_lThreadsGrown ) );
+    pcounters->m_ulThreadsRetired = ( unsigned long )AtomicLoad( &( ppool->m_lThreadsRetired ) );
+    pcounters->m_ulWakeups = ( unsigned long )AtomicLoad( &( ppool->m_lWakeups ) );
+}
+
+/* Percentiles are upper bounds of the histogram bucket they fall in */
+void GetThreadPoolLaneCounters( SThreadPool* ppool, unsigned long ulLane, SThreadPoolLaneCounters* pcounters )
+{
+    SThreadPoolLane* pLane;
+    unsigned long ulTotal = 0, ulSeen = 0, i;
+
+    memset( pcounters, 0, sizeof( *pcounters ) );
+    if( ulLane >= ppool->m_ulPriorityLanes )
+        return;
+
+    pLane = ppool->m_cLanes + ulLane;
+#ifdef THREAD_POOL_LOCKFREE_QUEUE
+    pcounters->m_ulDepth = GetRingQueueSize( &( pLane->m_cQueue ) );
+#else
+    EnterLock( &( ppool->m_cCriticalSection ) );
+    pcounters->m_ulDepth = pLane->m_cQueue.m_ulSize;
+    LeaveLock( &( ppool->m_cCriticalSection ) );
+#endif
+    pcounters->m_ulDequeued = ( unsigned long )AtomicLoad( &( pLane->m_lDequeued ) );
+    for( i = 0; i < TP_WAIT_BUCKETS; ++i )
+        ulTotal += ( pcounters->m_ulWaitHistogram[ i ] = ( unsigned long )AtomicLoad( pLane->m_lWaitHistogram + i ) );
+
+    for( i = 0; i < TP_WAIT_BUCKETS && 0 != ulTotal; ++i )
+    {
+        ulSeen += pcounters->m_ulWaitHistogram[ i ];
+        if( 0 == pcounters->m_ulWaitP50Us && ulSeen * 2 >= ulTotal )
+            pcounters->m_ulWaitP50Us = 2UL << i;
+        if( ulSeen * 100 >= ulTotal * 99 )
+        {
+            pcounters->m_ulWaitP99Us = 2UL << i;
+            break;
+        }
+    }
+}
+
+/* Counter owned by the calling worker: a plain increment, published for the snapshot readers */
+static __inline void CountStats( volatile long* pl, long l ) { AtomicStore( pl, *pl + l ); }
+
+static unsigned long GetStatsBucket( unsigned long ulValue )
+{
+    unsigned long ulShift;
+
+    if( ulValue > 0xFFFFFFFFUL )
+        ulValue = 0xFFFFFFFFUL;
+    if( ulValue < ( 1UL << TP_STATS_SUB_BITS ) )
+        return ulValue;
+
+    ulShift = HighBit( ulValue ) - TP_STATS_SUB_BITS;
+    return ( ( ulShift + 1 ) << TP_STATS_SUB_BITS ) + ( ( ulValue >> ulShift ) & ( ( 1UL << TP_STATS_SUB_BITS ) - 1 ) );
+}
+
+/* Lowest value counted in a histogram bucket */
+unsigned long GetStatsBucketValue( unsigned long ulBucket )
+{
+    if( ulBucket < ( 1UL << TP_STATS_SUB_BITS ) )
+        return ulBucket;
+    return ( ( 1UL << TP_STATS_SUB_BITS ) | ( ulBucket & ( ( 1UL << TP_STATS_SUB_BITS ) - 1 ) ) ) << ( ( ulBucket >> TP_STATS_SUB_BITS ) - 1 );
+}
+
+static unsigned long GetStatsPercentile( const unsigned long* pHistogram, unsigned long ulPerMille )
+{
+    double dTotal = 0, dSeen = 0;
+    unsigned long i;
+
+    for( i = 0; i < TP_STATS_BUCKETS; ++i )
+        dTotal += pHistogram[ i ];
+
+    for( i = 0; i < TP_STATS_BUCKETS && 0 != dTotal; ++i )
+    {
+        dSeen += pHistogram[ i ];
+        if( dSeen * 1000 >= dTotal * ulPerMille )
+            return i + 1 < TP_STATS_BUCKETS ? GetStatsBucketValue( i + 1 ) : 0xFFFFFFFFUL;
+    }
+    return 0;
+}
+
+static void AddWorkerStats( SThreadPoolWorkerStats* pStats, SThreadPoolStats* pSnapshot )
+{
+    unsigned long i;
+
+    pSnapshot->m_ulExecuted += ( unsigned long )AtomicLoad( &( pStats->m_lExecuted ) );
+    pSnapshot->m_ulStolen += ( unsigned long )AtomicLoad( &( pStats->m_lStolen ) );
+    pSnapshot->m_ulParks += ( unsigned long )AtomicLoad( &( pStats->m_lParks ) );
+    pSnapshot->m_ulWakes += ( unsigned long )AtomicLoad( &( pStats->m_lWakes ) );
+    pSnapshot->m_ulIdleUs += ( unsigned long )AtomicLoad( &( pStats->m_lIdleUs ) );
+    for( i = 0; i < TP_STATS_BUCKETS; ++i )
+    {
+        pSnapshot->m_ulSojournHistogram[ i ] += ( unsigned long )AtomicLoad( pStats->m_lSojournHistogram + i );
+        pSnapshot->m_ulRunHistogram[ i ] += ( unsigned long )AtomicLoad( pStats->m_lRunHistogram + i );
+    }
+}
+
+static void SetStatsPercentiles( SThreadPoolStats* pSnapshot )
+{
+    pSnapshot->m_ulSojournP50Us = GetStatsPercentile( pSnapshot->m_ulSojournHistogram, 500 );
+    pSnapshot->m_ulSojournP99Us = GetStatsPercentile( pSnapshot->m_ulSojournHistogram, 990 );
+    pSnapshot->m_ulSojournP999Us = GetStatsPercentile( pSnapshot->m_ulSojournHistogram, 999 );
+    pSnapshot->m_ulRunP50Ns = GetStatsPercentile( pSnapshot->m_ulRunHistogram, 500 );
+    pSnapshot->m_ulRunP99Ns = GetStatsPercentile( pSnapshot->m_ulRunHistogram, 990 );
+    pSnapshot->m_ulRunP999Ns = GetStatsPercentile( pSnapshot->m_ulRunHistogram, 999 );
+}
+
+/* Sums the blocks of all worker slots, retired workers included, without taking the pool lock */
+void GetThreadPoolStats( SThreadPool* ppool, SThreadPoolStats* pstats )
+{
+    unsigned long i;
+
+    memset( pstats, 0, sizeof( *pstats ) );
+    for( i = 0; i < ppool->m_ulThreadPoolCapacity; ++i )
+        AddWorkerStats( &( ppool->m_ptrThreadPool[ i ].m_cStats ), pstats );
+    pstats->m_ulPending = ( unsigned long )AtomicLoad( &( ppool->m_lTaskRemained ) );
+    pstats->m_ulPutWaits = ( unsigned long )AtomicLoad( &( ppool->m_lPutWaits ) );
+    pstats->m_ulPutWaitUs = ( unsigned long )AtomicLoad( &( ppool->m_lPutWaitUs ) );
+    SetStatsPercentiles( pstats );
+}
+
+void GetThreadPoolWorkerStats( SThreadPool* ppool, unsigned long ulWorker, SThreadPoolStats* pstats )
+{
+    memset( pstats, 0, sizeof( *pstats ) );
+    if( ulWorker >= ppool->m_ulThreadPoolCapacity )
+        return;
+
+    AddWorkerStats( &( ppool->m_ptrThreadPool[ ulWorker ].m_cStats ), pstats );
+    SetStatsPercentiles( pstats );
+}
+
+/* Time a put spent blocked on a full queue */
+static void CountPutWait( SThreadPool* ppool, unsigned long ulStartUs )
+{
+    AtomicIncrement( &( ppool->m_lPutWaits ) );
+    AtomicAdd( &( ppool->m_lPutWaitUs ), ( long )( GetTickUs() - ulStartUs ) );
+}
+
+void AllocateTask( SThreadPool* ppool, SThreadPoolTask* ptask )
+{
+    AllocateTaskEx( ppool, ptask, TP_TASK_ARG_SIZE );
+}
+
+/* The block is released with FreeTaskArg by the worker once the task has run */
+void AllocateTaskEx( SThreadPool* ppool, SThreadPoolTask* ptask, unsigned long ulSize )
+{
+    ( void )ppool;
+    ptask->m_pFunc = NULL;
+    ptask->m_pPars = AllocTaskArg( ulSize );
+}
+
+/*
+ * Returns where the caller writes the argument: the task itself when it fits TP_TASK_INLINE_SIZE in a THREAD_POOL_INLINE_TASK build,
+ * an allocated block otherwise. The function receives a pointer to the worker's copy of the inline argument
+ */
+void* AllocateTaskInline( SThreadPool* ppool, SThreadPoolTask* ptask, unsigned long ulSize )
+{
+#ifdef THREAD_POOL_INLINE_TASK
+    if( ulSize <= TP_TASK_INLINE_SIZE )
+    {
+        ptask->m_pFunc = NULL;
+        ptask->m_pPars = TP_INLINE_PARS;
+        return ptask->m_cInline.m_cData;
+    }
+#endif
+    AllocateTaskEx( ppool, ptask, ulSize );
+    return ptask->m_pPars;
+}
+
+static void CompleteTasks( SThreadPool* ppool, unsigned long ulCount )
+{
+    TP_LOCK* const pcs = &( ppool->m_cCriticalSection );
+
+    if( 0 == AtomicAdd( &( ppool->m_lTaskRemained ), -( long )ulCount ) )
+    {
+        EnterLock( pcs );
+        WakeAllCond( &( ppool->m_cCondForJoinAll ) );
+        LeaveLock( pcs );
+    }
+}
+
+/* Parked workers no signal is on the way to yet */
+static long GetSleepingThreads( SThreadPool* ppool )
+{
+    return AtomicLoad( &( ppool->m_lIdleThreads ) ) - AtomicLoad( &( ppool->m_lWakePending ) );
+}
+
+/*
+ * Wakes min( ulCount, sleeping ) parked workers, one per task. Workers already signalled are not signalled again,
+ * so a burst of single pushes wakes as many workers as it has tasks instead of one. Lock is held by the caller
+ */
+static void WakeThreads( SThreadPool* ppool, unsigned long ulCount )
+{
+    const long lSleeping = GetSleepingThreads( ppool );
+    unsigned long ulWake;
+
+    if( lSleeping <= 0 || 0 == ulCount )
+        return;
+
+    if( ulCount >= ( unsigned long )lSleeping )
+    {
+        ulWake = ( unsigned long )lSleeping;
+        WakeAllCond( &( ppool->m_cCondForThreads ) );
+    }
+    else
+    {
+        for( ulWake = 0; ulWake < ulCount; ++ulWake )
+            WakeCond( &( ppool->m_cCondForThreads ) );
+    }
+    AtomicAdd( &( ppool->m_lWakePending ), ( long )ulWake );
+    AtomicAdd( &( ppool->m_lWakeups ), ( long )ulWake );
+}
+
+/*
+ * Wakes up to ulCount parked workers, otherwise grows an elastic pool when ulDepth tasks are waiting.
+ * The caller has already published the tasks, the full fence pairs with the idle counter increment
+ * done by a worker before its last look at the queues
+ */
+static void WakeIdleThreads( SThreadPool* ppool, unsigned long ulCount, unsigned long ulDepth )
+{
+    TP_LOCK* const pcs = &( ppool->m_cCriticalSection );
+
+    FullFence();
+    if( 0 < GetSleepingThreads( ppool ) )
+    {
+        EnterLock( pcs );
+        WakeThreads( ppool, ulCount );
+        LeaveLock( pcs );
+    }
+    else if( 0 == AtomicLoad( &( ppool->m_lIdleThreads ) ) && ulDepth > ppool->m_ulGrowQueueDepth && AtomicLoad( &( ppool->m_lThreadPoolSize ) ) < AtomicLoad( &( ppool->m_lMaxThreads ) ) )
+    {
+        /* Grow only while every worker is busy, a signalled worker is about to take its share */
+        EnterLock( pcs );
+        if( 0 < GetSleepingThreads( ppool ) )
+            WakeThreads( ppool, ulCount );
+        else if( 0 == AtomicLoad( &( ppool->m_lIdleThreads ) ) )
+            GrowThreadPool( ppool );
+        LeaveLock( pcs );
+    }
+}
+
+/* Fair share of ulDepth waiting tasks for one worker, so a batch never starves the others */
+static unsigned long GetBatchShare( SThreadPool* ppool, unsigned long ulDepth, unsigned long ulMax )
+{
+    const long lThreads = AtomicLoad( &( ppool->m_lThreadPoolSize ) );
+    const unsigned long ulShare = 1 + ulDepth / ( lThreads > 0 ? ( unsigned long )lThreads : 1 );
+
+    return ulShare < ulMax ? ulShare : ulMax;
+}
+
+/*
+ * Picks the highest priority lane of the non-empty lane bitmap. After m_ulStarvationLimit tasks in a row
+ * went past waiting lower lanes, one dispatch goes to a lower lane instead, lower lanes take turns.
+ * *piPassed tells the caller to add the tasks it takes to the streak
+ */
+static unsigned long SelectLane( SThreadPool* ppool, unsigned long ulMask, int* piPassed )
+{
+    unsigned long ulLane = 0, ulLower, ulStarved, i;
+
+    while( 0 == ( ulMask & ( 1UL << ulLane ) ) )
+        ulLane++;
+
+    ulLower = ulMask & ~( ( 2UL << ulLane ) - 1 );
+    *piPassed = 0 != ulLower && 0 != ppool->m_ulStarvationLimit;
+    if( !*piPassed || ( unsigned long )AtomicLoad( &( ppool->m_lLaneStreak ) ) < ppool->m_ulStarvationLimit )
+        return ulLane;
+
+    *piPassed = 0;
+
+    AtomicStore( &( ppool->m_lLaneStreak ), 0 );
+    ulStarved = ( unsigned long )AtomicLoad( &( ppool->m_lStarvedLane ) );
+    for( i = 1; i <= TP_PRIORITY_LANES; ++i )
+    {
+        ulLane = ( ulStarved + i ) % TP_PRIORITY_LANES;
+        if( 0 != ( ulLower & ( 1UL << ulLane ) ) )
+            break;
+    }
+    AtomicStore( &( ppool->m_lStarvedLane ), ( long )ulLane );
+    return ulLane;
+}
+
+/* Queue wait histogram of a lane, kept only when the pool has several lanes */
+static void CountLaneWait( SThreadPool* ppool, SThreadPoolLane* pLane, const SThreadPoolTask* ptasks, unsigned long ulCount )
+{
+    unsigned long ulNow, ulWait, ulBucket, i;
+
+    if( ppool->m_ulPriorityLanes < 2 )
+        return;
+
+    ulNow = GetTickUs();
+    AtomicAdd( &( pLane->m_lDequeued ), ( long )ulCount );
+    for( i = 0; i < ulCount; ++i )
+    {
+        ulWait = ulNow - ptasks[ i ].m_ulQueuedUs;
+        for( ulBucket = 0; ulWait > 1 && ulBucket < TP_WAIT_BUCKETS - 1; ++ulBucket )
+            ulWait >>= 1;
+        AtomicIncrement( pLane->m_lWaitHistogram + ulBucket );
+    }
+}
+
+#ifdef THREAD_POOL_LOCKFREE_QUEUE
+static unsigned long PutGlobalTasks( SThreadPool* ppool, unsigned long ulLane, const SThreadPoolTask* ptasks, unsigned long ulCount )
+{
+    TP_LOCK* const pcs = &( ppool->m_cCriticalSection );
+    SRingQueue* const pQueue = &( ppool->m_cLanes[ ulLane ].m_cQueue );
+    unsigned long ulPut = 0, ulChunk, ulWaitUs;
+
+    while( ulPut < ulCount )
+    {
+        if( 0 == ( ulChunk = PushRingQueueBatch( pQueue, ptasks + ulPut, ulCount - ulPut ) ) )
+        {
+            /* Back-pressure: announce the waiter first, then retry under the lock so a pop cannot slip in between */
+            EnterLock( pcs );
+            ulWaitUs = GetTickUs();
+            AtomicIncrement( &( ppool->m_lPutTaskWaiters ) );
+            while( 0 == ( ulChunk = PushRingQueueBatch( pQueue, ptasks + ulPut, ulCount - ulPut ) ) && ppool->m_iIsWorking )
+                WaitCond( &( ppool->m_cCondForPutTask ), pcs );
+            AtomicDecrement( &( ppool->m_lPutTaskWaiters ) );
+            CountPutWait( ppool, ulWaitUs );
+            LeaveLock( pcs );
+
+            if( 0 == ulChunk )
+                break;
+        }
+
+        /* A popper clearing the bit rechecks the ring afterwards, the fence keeps this load after the push */
+        FullFence();
+        if( 0 == ( AtomicLoad( &( ppool->m_lLaneMask ) ) & ( 1L << ulLane ) ) )
+            AtomicOr( &( ppool->m_lLaneMask ), 1L << ulLane );
+
+        ulPut += ulChunk;
+        WakeIdleThreads( ppool, ulChunk, GetRingQueueSize( pQueue ) );
+    }
+    return ulPut;
+}
+
+/* Lock is held by the caller when iLocked is set */
+static unsigned long PopGlobalTasks( SThreadPool* ppool, SThreadPoolTask* ptasks, unsigned long ulMax, int iLocked )
+{
+    TP_LOCK* const pcs = &( ppool->m_cCriticalSection );
+    unsigned long ulMask, ulLane, ulCount;
+    SThreadPoolLane* pLane;
+    int iPassed;
+
+    for(;;)
+    {
+        if( 0 == ( ulMask = ( unsigned long )AtomicLoad( &( ppool->m_lLaneMask ) ) ) )
+            return 0;
+
+        ulLane = SelectLane( ppool, ulMask, &iPassed );
+        pLane = ppool->m_cLanes + ulLane;
+        if( 0 != ( ulCount = PopRingQueueBatch( &( pLane->m_cQueue ), ptasks, GetBatchShare( ppool, GetRingQueueSize( &( pLane->m_cQueue ) ), ulMax ) ) ) )
+            break;
+
+        /* Lane drained: drop its bit, put it back if a push slipped in meanwhile */
+        AtomicAnd( &( ppool->m_lLaneMask ), ~( 1L << ulLane ) );
+        if( 0 != GetRingQueueSize( &( pLane->m_cQueue ) ) )
+            AtomicOr( &( ppool->m_lLaneMask ), 1L << ulLane );
+    }
+
+    if( iPassed )
+        AtomicAdd( &( ppool->m_lLaneStreak ), ( long )ulCount );
+    CountLaneWait( ppool, pLane, ptasks, ulCount );
+
+    FullFence();
+    if( 0 != AtomicLoad( &( ppool->m_lPutTaskWaiters ) ) )
+    {
+        if( !iLocked )
+            EnterLock( pcs );
+        WakeAllCond( &( ppool->m_cCondForPutTask ) );
+        if( !iLocked )
+            LeaveLock( pcs );
+    }
+    return ulCount;
+}
+#else
+static unsigned long PutGlobalTasks( SThreadPool* ppool, unsigned long ulLane, const SThreadPoolTask* ptasks, unsigned long ulCount )
+{
+    TP_LOCK* const pcs = &( ppool->m_cCriticalSection );
+    SQueue* const pQueue = &( ppool->m_cLanes[ ulLane ].m_cQueue );
+    unsigned long ulPut = 0, ulChunk, ulWaitUs;
+
+    EnterLock( pcs );
+    while( ulPut < ulCount )
+    {
+        /* Back-pressure: sleep until a worker takes a task out of the full lane */
+        if( ppool->m_iIsWorking && pQueue->m_ulSize >= ppool->m_ulMaxQueueSize )
+        {
+            ulWaitUs = GetTickUs();
+            while( ppool->m_iIsWorking && pQueue->m_ulSize >= ppool->m_ulMaxQueueSize )
+            {
+                ppool->m_lPutTaskWaiters++;
+                WaitCond( &( ppool->m_cCondForPutTask ), pcs );
+                ppool->m_lPutTaskWaiters--;
+            }
+            CountPutWait( ppool, ulWaitUs );
+        }
+
+        if( !ppool->m_iIsWorking )
+            break;
+
+        ulChunk = ppool->m_ulMaxQueueSize - pQueue->m_ulSize;
+        if( ulChunk > ulCount - ulPut )
+            ulChunk = ulCount - ulPut;
+        PushQueueBatch( pQueue, ptasks + ulPut, ulChunk );
+        AtomicOr( &( ppool->m_lLaneMask ), 1L << ulLane );
+        ulPut += ulChunk;
+
+        if( 0 < GetSleepingThreads( ppool ) )
+            WakeThreads( ppool, ulChunk );
+        else if( 0 == ppool->m_lIdleThreads && pQueue->m_ulSize > ppool->m_ulGrowQueueDepth )
+            GrowThreadPool( ppool );
+    }
+    LeaveLock( pcs );
+    return ulPut;
+}
+
+/* Lock is held by the caller when iLocked is set. The bitmap only changes under the lock, an empty one skips it */
+static unsigned long PopGlobalTasks( SThreadPool* ppool, SThreadPoolTask* ptasks, unsigned long ulMax, int iLocked )
+{
+    TP_LOCK* const pcs = &( ppool->m_cCriticalSection );
+    unsigned long ulMask, ulLane, ulCount = 0;
+    SThreadPoolLane* pLane;
+    int iPassed;
+
+    if( !iLocked )
+    {
+        if( 0 == AtomicLoad( &( ppool->m_lLaneMask ) ) )
+            return 0;
+        EnterLock( pcs );
+    }
+
+    if( 0 != ( ulMask = ( unsigned long )ppool->m_lLaneMask ) )
+    {
+        ulLane = SelectLane( ppool, ulMask, &iPassed );
+        pLane = ppool->m_cLanes + ulLane;
+        ulCount = PopQueueBatch( &( pLane->m_cQueue ), ptasks, GetBatchShare( ppool, pLane->m_cQueue.m_ulSize, ulMax ) );
+        if( iPassed )
+            AtomicAdd( &( ppool->m_lLaneStreak ), ( long )ulCount );
+        if( 0 == pLane->m_cQueue.m_ulSize )
+            AtomicAnd( &( ppool->m_lLaneMask ), ~( 1L << ulLane ) );
+        CountLaneWait( ppool, pLane, ptasks, ulCount );
+        if( 0 != ppool->m_lPutTaskWaiters )
+            WakeAllCond( &( ppool->m_cCondForPutTask ) );
+    }
+
+    if( !iLocked )
+        LeaveLock( pcs );
+    return ulCount;
+}
+#endif
+
+/* Stamps the queue entry time for the lane wait histogram and the sojourn statistics, a pool keeping neither skips it */
+static unsigned long PutLaneTasks( SThreadPool* ppool, unsigned long ulLane, const SThreadPoolTask* ptasks, unsigned long ulCount )
+{
+    SThreadPoolTask cStamped[ TP_WORKER_BATCH_SIZE ];
+    unsigned long ulPut = 0, ulChunk, ulNow, ulDone, i;
+
+    if( ppool->m_ulPriorityLanes < 2 && 0 == ( ppool->m_ulFlags & TPF_COLLECT_STATS ) )
+        return PutGlobalTasks( ppool, 0, ptasks, ulCount );
+
+    ulNow = GetTickUs();
+    while( ulPut < ulCount )
+    {
+        ulChunk = ulCount - ulPut < TP_WORKER_BATCH_SIZE ? ulCount - ulPut : TP_WORKER_BATCH_SIZE;
+        memcpy( cStamped, ptasks + ulPut, ulChunk * sizeof( cStamped[ 0 ] ) );
+        for( i = 0; i < ulChunk; ++i )
+            cStamped[ i ].m_ulQueuedUs = ulNow;
+
+        ulDone = PutGlobalTasks( ppool, ulLane, cStamped, ulChunk );
+        ulPut += ulDone;
+        if( ulDone < ulChunk )
+            break;
+    }
+    return ulPut;
+}
+
+/* Pushes to the worker's own deque, stamped for the sojourn statistics when the pool keeps them */
+static int PushLocalTask( SThreadPool* ppool, SThreadPoolWorker* pWorker, const SThreadPoolTask* ptask )
+{
+    SThreadPoolTask cStamped;
+
+    if( 0 == ( ppool->m_ulFlags & TPF_COLLECT_STATS ) )
+        return PushWorkDeque( &( pWorker->m_cDeque ), ptask );
+
+    cStamped = *ptask;
+    cStamped.m_ulQueuedUs = GetTickUs();
+    return PushWorkDeque( &( pWorker->m_cDeque ), &cStamped );
+}
+
+/*
+ * Returns how many tasks were accepted, fewer than ulCount only when the pool is stopping.
+ * ulPriority is clamped to the lanes of the pool, tasks of a worker keep going to its own deque only with TP_PRIORITY_NORMAL
+ * and without TP_PRIORITY_GLOBAL
+ */
+unsigned long PutTasksInQueueEx( SThreadPool* ppool, const SThreadPoolTask* ptasks, unsigned long ulCount, unsigned long ulPriority )
+{
+    SThreadPoolWorker* const pWorker = 0 == ( ulPriority & TP_PRIORITY_GLOBAL ) ? g_pCurrentWorker : NULL;
+    unsigned long ulPut = 0;
+
+    ulPriority &= ~( unsigned long )TP_PRIORITY_GLOBAL;
+    if( 0 == ulCount )
+        return 0;
+
+    /* Count the tasks before publishing them, a worker may complete them before the push returns */
+    AtomicAdd( &( ppool->m_lTaskRemained ), ( long )ulCount );
+
+    if( ( ppool->m_ulFlags & TPF_WORK_STEALING ) && NULL != pWorker && ppool == pWorker->m_pPool && TP_PRIORITY_NORMAL == ulPriority )
+    {
+        /* Spawned from inside a worker: keep them local, overflow goes to the global queue */
+        while( ulPut < ulCount && PushLocalTask( ppool, pWorker, ptasks + ulPut ) )
+            ulPut++;
+        if( 0 != ulPut )
+            WakeIdleThreads( ppool, ulPut, ( unsigned long )AtomicAdd( &( ppool->m_lLocalTasks ), ( long )ulPut ) );
+    }
+
+    if( ulPriority >= ppool->m_ulPriorityLanes )
+        ulPriority = ppool->m_ulPriorityLanes - 1;
+    if( ulPut < ulCount )
+        ulPut += PutLaneTasks( ppool, ulPriority, ptasks + ulPut, ulCount - ulPut );
+
+    if( ulPut < ulCount )
+        CompleteTasks( ppool, ulCount - ulPut );
+    THREAD_TRACE_INSTANT( "tp push", ulPut );
+    return ulPut;
+}
+
+unsigned long PutTasksInQueue( SThreadPool* ppool, const SThreadPoolTask* ptasks, unsigned long ulCount )
+{
+    return PutTasksInQueueEx( ppool, ptasks, ulCount, TP_PRIORITY_NORMAL );
+}
+
+void PutTaskInQueueEx( SThreadPool* ppool, const SThreadPoolTask* ptask, unsigned long ulPriority )
+{
+    if( NULL == ptask->m_pFunc )
+        return;
+
+    PutTasksInQueueEx( ppool, ptask, 1, ulPriority );
+}
+
+void PutTaskInQueue( SThreadPool* ppool, const SThreadPoolTask* ptask )
+{
+    PutTaskInQueueEx( ppool, ptask, TP_PRIORITY_NORMAL );
+}
+
+void ThreadPoolJoinAll( SThreadPool* ppool )
+{
+    TP_LOCK* const pcs = &( ppool->m_cCriticalSection );
+
+    EnterLock( pcs );
+    while( 0 != AtomicLoad( &( ppool->m_lTaskRemained ) ) )
+        WaitCond( &( ppool->m_cCondForJoinAll ), pcs );
+    LeaveLock( pcs );
+}
+
+/*
+ * Task group waiters park in a small static table of lock + condition variable buckets picked by the group address,
+ * a group itself is only one word. m_lState keeps the pending count shifted left by one and a "someone waits" bit
+ */
+#define TP_PARKING_BUCKETS 64
+#define TP_GROUP_WAITER 1L
+
+typedef struct SParkingBucket
+{
+    TP_LOCK m_cLock;
+    TP_COND m_cCond;
+} SParkingBucket;
+
+static SParkingBucket g_cParkingLot[ TP_PARKING_BUCKETS ];
+
+static void InitParkingLotBuckets( void )
+{
+    unsigned long i;
+    for( i = 0; i < TP_PARKING_BUCKETS; ++i )
+    {
+        AllocLock( &( g_cParkingLot[ i ].m_cLock ) );
+        AllocCond( &( g_cParkingLot[ i ].m_cCond ) );
+    }
+}
+
+#ifndef USE_PTHREAD_THREAD_FORCE
+static INIT_ONCE g_cParkingLotOnce = INIT_ONCE_STATIC_INIT;
+
+static BOOL CALLBACK InitParkingLot( PINIT_ONCE pOnce, PVOID pParam, PVOID* ppContext )
+{
+    pOnce; pParam; ppContext;
+    InitParkingLotBuckets();
+    return TRUE;
+}
+
+static SParkingBucket* GetParkingBucket( const STaskGroup* pGroup )
+{
+    InitOnceExecuteOnce( &g_cParkingLotOnce, InitParkingLot, NULL, NULL );
+    return g_cParkingLot + ( ( ( ( size_t )pGroup >> 4 ) * 2654435761UL ) >> 16 ) % TP_PARKING_BUCKETS;
+}
+#else
+static pthread_once_t g_cParkingLotOnce = PTHREAD_ONCE_INIT;
+
+static SParkingBucket* GetParkingBucket( const STaskGroup* pGroup )
+{
+    pthread_once( &g_cParkingLotOnce, InitParkingLotBuckets );
+    return g_cParkingLot + ( ( ( ( size_t )pGroup >> 4 ) * 2654435761UL ) >> 16 ) % TP_PARKING_BUCKETS;
+}
+#endif
+
+void InitTaskGroup( STaskGroup* pGroup, unsigned long ulCount )
+{
+    pGroup->m_lState = ( long )ulCount << 1;
+}
+
+void AddTaskGroup( STaskGroup* pGroup, unsigned long ulCount )
+{
+    AtomicAdd( &( pGroup->m_lState ), ( long )ulCount << 1 );
+}
+
+/* The waiter may release the group as soon as the count hits zero, so it is not touched after the decrement */
+void DoneTaskGroup( STaskGroup* pGroup, unsigned long ulCount )
+{
+    SParkingBucket* pBucket;
+
+    if( TP_GROUP_WAITER != AtomicAdd( &( pGroup->m_lState ), -( ( long )ulCount << 1 ) ) )
+        return;
+
+    pBucket = GetParkingBucket( pGroup );
+    EnterLock( &( pBucket->m_cLock ) );
+    WakeAllCond( &( pBucket->m_cCond ) );
+    LeaveLock( &( pBucket->m_cLock ) );
+}
+
+int TryWaitTaskGroup( STaskGroup* pGroup )
+{
+    return 0 == ( AtomicLoad( &( pGroup->m_lState ) ) >> 1 );
+}
+
+/* Returns 0 on timeout, ulMs ( unsigned long )-1 waits forever */
+int WaitTaskGroupTimeout( STaskGroup* pGroup, unsigned long ulMs )
+{
+    SParkingBucket* pBucket;
+    const unsigned long ulStart = GetTickMs();
+    unsigned long ulElapsed;
+    long lState;
+    int iDone;
+
+    if( TryWaitTaskGroup( pGroup ) )
+        return 1;
+
+    pBucket = GetParkingBucket( pGroup );
+    EnterLock( &( pBucket->m_cLock ) );
+    for(;;)
+    {
+        /* Announce the waiter under the bucket lock, the last DoneTaskGroup then has to take it before waking */
+        lState = AtomicLoad( &( pGroup->m_lState ) );
+        if( 0 != ( iDone = ( 0 == ( lState >> 1 ) ) ) )
+            break;
+        if( 0 == ( lState & TP_GROUP_WAITER ) && !AtomicCas( &( pGroup->m_lState ), lState, lState | TP_GROUP_WAITER ) )
+            continue;
+
+        if( ( unsigned long )-1 == ulMs )
+            WaitCond( &( pBucket->m_cCond ), &( pBucket->m_cLock ) );
+        else if( ( ulElapsed = GetTickMs() - ulStart ) >= ulMs || !WaitCondTimeout( &( pBucket->m_cCond ), &( pBucket->m_cLock ), ulMs - ulElapsed ) )
+        {
+            iDone = TryWaitTaskGroup( pGroup );
+            break;
+        }
+    }
+    LeaveLock( &( pBucket->m_cLock ) );
+    return iDone;
+}
+
+void WaitTaskGroup( STaskGroup* pGroup )
+{
+    WaitTaskGroupTimeout( pGroup, ( unsigned long )-1 );
+}
+
+int TryWaitTaskHandle( STaskHandle* phandle ) { return TryWaitTaskGroup( &( phandle->m_cGroup ) ); }
+void WaitTaskHandle( STaskHandle* phandle ) { WaitTaskGroup( &( phandle->m_cGroup ) ); }
+int WaitTaskHandleTimeout( STaskHandle* phandle, unsigned long ulMs ) { return WaitTaskGroupTimeout( &( phandle->m_cGroup ), ulMs ); }
+void* GetTaskResult( const STaskHandle* phandle ) { return phandle->m_pResult; }
+
+static TP_THREAD_LOCAL STaskHandle* g_pCurrentHandle = NULL;
+
+/* Stores the result of the task run with PutTaskWithHandle, ignored for other tasks */
+void SetTaskResult( void* pResult )
+{
+    if( NULL != g_pCurrentHandle )
+        g_pCurrentHandle->m_pResult = pResult;
+}
+
+/* Runs the function and releases its argument block unless the task owns it */
+static void RunTask( SThreadPoolTask* ptask )
+{
+#ifdef THREAD_POOL_INLINE_TASK
+    if( TP_INLINE_PARS == ptask->m_pPars )
+    {
+        if( NULL != ptask->m_pFunc )
+            ( *ptask->m_pFunc )( ptask->m_cInline.m_cData );
+        return;
+    }
+#endif
+    if( 0 != ( ( size_t )ptask->m_pPars & 1 ) )
+    {
+        /* TP_OWNED_PARS: the block may be gone once the function returns */
+        if( NULL != ptask->m_pFunc )
+            ( *ptask->m_pFunc )( ( void* )( ( size_t )ptask->m_pPars & ~( size_t )1 ) );
+        return;
+    }
+    if( NULL != ptask->m_pFunc )
+        ( *ptask->m_pFunc )( ptask->m_pPars );
+    FreeTaskArg( ptask->m_pPars );
+}
+
+/* Runs a sampled task of a TPF_COLLECT_STATS pool, its queue sojourn and run time go to the worker's histograms */
+static void RunTaskCounted( SThreadPoolWorker* pWorker, SThreadPoolTask* ptask )
+{
+    SThreadPoolWorkerStats* const pStats = &( pWorker->m_cStats );
+    TP_STAMP cStart;
+
+    GetStamp( &cStart );
+    CountStats( pStats->m_lSojournHistogram + GetStatsBucket( GetStampUs( &cStart ) - ptask->m_ulQueuedUs ), 1 );
+    RunTask( ptask );
+    CountStats( pStats->m_lRunHistogram + GetStatsBucket( GetElapsedNs( &cStart ) ), 1 );
+}
+
+/* A task wrapped together with the group it counts down */
+typedef struct STaskCompletion
+{
+    SThreadPoolTask m_cTask;
+    STaskGroup* m_pGroup;
+    STaskHandle* m_pHandle;
+} STaskCompletion;
+
+static void RunCompletionTask( void* pPars )
+{
+    STaskCompletion* const pCompletion = ( STaskCompletion* )pPars;
+    STaskHandle* const pOuterHandle = g_pCurrentHandle;
+
+    g_pCurrentHandle = pCompletion->m_pHandle;
+    RunTask( &( pCompletion->m_cTask ) );
+    g_pCurrentHandle = pOuterHandle;
+    DoneTaskGroup( pCompletion->m_pGroup, 1 );
+}
+
+static int PutCompletionTask( SThreadPool* ppool, const SThreadPoolTask* ptask, STaskGroup* pGroup, STaskHandle* phandle )
+{
+    STaskCompletion* pCompletion;
+    SThreadPoolTask task;
+
+    AllocateTaskEx( ppool, &task, sizeof( *pCompletion ) );
+    task.m_pFunc = RunCompletionTask;
+    pCompletion = ( STaskCompletion* )task.m_pPars;
+    pCompletion->m_cTask = *ptask;
+    pCompletion->m_pGroup = pGroup;
+    pCompletion->m_pHandle = phandle;
+    if( 0 != PutTasksInQueue( ppool, &task, 1 ) )
+        return 1;
+
+    /* Not accepted by a stopping pool: the caller keeps the task argument, but its waiters must not hang */
+    FreeTaskArg( task.m_pPars );
+    DoneTaskGroup( pGroup, 1 );
+    return 0;
+}
+
+/* Counts the task in the group before it is queued, WaitTaskGroup then waits for exactly the tasks put this way */
+int PutTaskInGroup( SThreadPool* ppool, const SThreadPoolTask* ptask, STaskGroup* pGroup )
+{
+    AddTaskGroup( pGroup, 1 );
+    return PutCompletionTask( ppool, ptask, pGroup, NULL );
+}
+
+int PutTaskWithHandle( SThreadPool* ppool, const SThreadPoolTask* ptask, STaskHandle* phandle )
+{
+    phandle->m_pResult = NULL;
+    InitTaskGroup( &( phandle->m_cGroup ), 1 );
+    return PutCompletionTask( ppool, ptask, &( phandle->m_cGroup ), phandle );
+}
+
+static int StealTask( SThreadPoolWorker* pWorker, SThreadPoolTask* ptask )
+{
+    SThreadPool* const ppool = pWorker->m_pPool;
+    const unsigned long ulCount = ppool->m_ulThreadPoolCapacity;
+    unsigned long i, ulVictim, ulSeed;
+
+    if( ulCount < 2 )
+        return 0;
+
+    /* xorshift32, a random starting victim spreads thieves over the pool */
+    ulSeed = pWorker->m_ulSeed;
+    ulSeed ^= ( ulSeed << 13 ) & 0xFFFFFFFFUL;
+    ulSeed ^= ulSeed >> 17;
+    ulSeed ^= ( ulSeed << 5 ) & 0xFFFFFFFFUL;
+    pWorker->m_ulSeed = ulSeed;
+    ulVictim = ulSeed % ulCount;
+
+    for( i = 0; i < ulCount; ++i, ulVictim = ( ulVictim + 1 ) % ulCount )
+    {
+        if( ulVictim != pWorker->m_ulIndex && StealWorkDeque( &( ppool->m_ptrThreadPool[ ulVictim ].m_cDeque ), ptask ) )
+        {
+            CountStats( &( pWorker->m_cStats.m_lStolen ), 1 );
+            THREAD_TRACE_INSTANT( "tp steal", ulVictim );
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Serves the first task of a freshly popped batch, the rest is kept in the worker */
+static int TakeBatch( SThreadPoolWorker* pWorker, unsigned long ulCount, SThreadPoolTask* ptask )
+{
+    THREAD_TRACE_INSTANT( "tp pop", ulCount );
+    *ptask = pWorker->m_cBatch[ 0 ];
+    pWorker->m_ulBatchSize = ulCount;
+    pWorker->m_ulBatchPos = 1;
+    return 1;
+}
+
+/*
+ * Takes the next task: own batch, own deque (LIFO), global queue, then steals from other workers (FIFO).
+ * Sleeps while there is nothing to do, returns 0 when the pool is stopping or this worker retires
+ */
+static int WaitForTask( SThreadPoolWorker* pWorker, SThreadPoolTask* ptask )
+{
+    SThreadPool* const pThreadPool = pWorker->m_pPool;
+    TP_LOCK* const pcs = &( pThreadPool->m_cCriticalSection );
+    const int iStealing = 0 != ( pThreadPool->m_ulFlags & TPF_WORK_STEALING );
+    int iIsWorking, iTimedOut, iRetire;
+    unsigned long ulPopped = 0, ulParkUs;
+    long lThreads;
+
+    if( pWorker->m_ulBatchPos < pWorker->m_ulBatchSize )
+    {
+        *ptask = pWorker->m_cBatch[ pWorker->m_ulBatchPos++ ];
+        return 1;
+    }
+
+    for(;;)
+    {
+        if( iStealing && ( TakeWorkDeque( &( pWorker->m_cDeque ), ptask ) || StealTask( pWorker, ptask ) ) )
+        {
+            AtomicDecrement( &( pThreadPool->m_lLocalTasks ) );
+            return 1;
+        }
+
+        if( 0 != ( ulPopped = PopGlobalTasks( pThreadPool, pWorker->m_cBatch, TP_WORKER_BATCH_SIZE, 0 ) ) )
+            return TakeBatch( pWorker, ulPopped, ptask );
+
+        /* Blocks freed for other threads must not wait in this one while it sleeps */
+        FlushTaskArgCache();
+
+        /* Become visible as idle before the last look at the queues, producers wake us under the same lock */
+        EnterLock( pcs );
+        AtomicIncrement( &( pThreadPool->m_lIdleThreads ) );
+        iTimedOut = 0;
+        iRetire = 0;
+        while( ( iIsWorking = pThreadPool->m_iIsWorking ) && 0 == ( ulPopped = PopGlobalTasks( pThreadPool, pWorker->m_cBatch, TP_WORKER_BATCH_SIZE, 1 ) ) && AtomicLoad( &( pThreadPool->m_lLocalTasks ) ) <= 0 )
+        {
+            /* Above the upper bound after a resize, or idle past the keep-alive above the lower one */
+            lThreads = AtomicLoad( &( pThreadPool->m_lThreadPoolSize ) );
+            if( lThreads > AtomicLoad( &( pThreadPool->m_lMaxThreads ) ) || ( iTimedOut && lThreads > AtomicLoad( &( pThreadPool->m_lMinThreads ) ) ) )
+            {
+                iRetire = 1;
+                break;
+            }
+
+            ulParkUs = GetTickUs();
+            THREAD_TRACE_BEGIN( "tp park", lThreads );
+            if( 0 != pThreadPool->m_ulKeepAliveMs && lThreads > AtomicLoad( &( pThreadPool->m_lMinThreads ) ) )
+                iTimedOut = !WaitCondTimeout( &( pThreadPool->m_cCondForThreads ), pcs, pThreadPool->m_ulKeepAliveMs );
+            else
+            {
+                WaitCond( &( pThreadPool->m_cCondForThreads ), pcs );
+                iTimedOut = 0;
+            }
+            THREAD_TRACE_END( "tp park" );
+            CountStats( &( pWorker->m_cStats.m_lParks ), 1 );
+            CountStats( &( pWorker->m_cStats.m_lWakes ), !iTimedOut );
+            CountStats( &( pWorker->m_cStats.m_lIdleUs ), ( long )( GetTickUs() - ulParkUs ) );
+
+            /* Take one pending signal. A timed out or spurious return may take another worker's, that costs one extra wake later */
+            if( 0 < pThreadPool->m_lWakePending )
+                AtomicDecrement( &( pThreadPool->m_lWakePending ) );
+        }
+        AtomicDecrement( &( pThreadPool->m_lIdleThreads ) );
+        if( iRetire )
+        {
+            pWorker->m_iState = TP_WORKER_EXITED;
+            AtomicDecrement( &( pThreadPool->m_lThreadPoolSize ) );
+            AtomicIncrement( &( pThreadPool->m_lThreadsRetired ) );
+        }
+        LeaveLock( pcs );
+
+        if( !iIsWorking || iRetire )
+            return 0;
+        if( 0 != ulPopped )
+            return TakeBatch( pWorker, ulPopped, ptask );
+    }
+}
+
+/* Nothing waits in the queues and the deques, a worker looking for a task now would find none */
+int IsThreadPoolHungry( SThreadPool* ppool )
+{
+    return 0 == AtomicLoad( &( ppool->m_lLaneMask ) ) && AtomicLoad( &( ppool->m_lLocalTasks ) ) <= 0;
+}
+
+/*
+ * Runs one waiting task on the calling thread, returns 0 if there was none. A thread waiting for tasks it queued helps with it.
+ * A worker of the pool takes its own batch and deque first, so a task waiting for its children mostly runs them itself
+ */
+int RunThreadPoolTask( SThreadPool* ppool )
+{
+    SThreadPoolWorker* const pWorker = g_pCurrentWorker;
+    SThreadPoolTask task;
+
+    if( NULL != pWorker && ppool == pWorker->m_pPool && pWorker->m_ulBatchPos < pWorker->m_ulBatchSize )
+        task = pWorker->m_cBatch[ pWorker->m_ulBatchPos++ ];
+    else if( NULL != pWorker && ppool == pWorker->m_pPool && ( ppool->m_ulFlags & TPF_WORK_STEALING ) &&
+        ( TakeWorkDeque( &( pWorker->m_cDeque ), &task ) || StealTask( pWorker, &task ) ) )
+        AtomicDecrement( &( ppool->m_lLocalTasks ) );
+    else if( 0 == PopGlobalTasks( ppool, &task, 1, 0 ) )
+        return 0;
+
+    THREAD_TRACE_BEGIN( "tp task", ( size_t )task.m_pFunc );
+    RunTask( &task );
+    THREAD_TRACE_END( "tp task" );
+    if( NULL != pWorker && ppool == pWorker->m_pPool )
+        CountStats( &( pWorker->m_cStats.m_lExecuted ), 1 );
+    CompleteTasks( ppool, 1 );
+    return 1;
+}
+
+TP_THREAD_RESULT TP_THREAD_CALL ThreadPoolWorkProc( void* lpParameter )
+{
+    SThreadPoolWorker* pWorker = ( SThreadPoolWorker* )lpParameter;
+    SThreadPool* pThreadPool = pWorker->m_pPool;
+    SThreadPoolTask task;
+    TP_LOCK* const pcs = &( pThreadPool->m_cCriticalSection );
+    const int iStats = 0 != ( pThreadPool->m_ulFlags & TPF_COLLECT_STATS );
+
+#ifdef USE_PTHREAD_THREAD_FORCE
+    sigset_t signal_mask;
+    sigfillset( &signal_mask );
+    pthread_sigmask( SIG_BLOCK, &signal_mask, NULL );
+#endif
+
+    /* AllocThreadPoolEx holds the lock until every worker is published */
+    EnterLock( pcs );
+    LeaveLock( pcs );
+
+    SetWorkerPlacement( pWorker );
+    g_pCurrentWorker = pWorker;
+    pWorker->m_ulBatchSize = 0;
+    pWorker->m_ulBatchPos = 0;
+    THREAD_TRACE_NAME( "ThreadPool worker" );
+
+    while( WaitForTask( pWorker, &task ) )
+    {
+        THREAD_TRACE_BEGIN( "tp task", ( size_t )task.m_pFunc );
+        if( iStats && 0 == ( ++pWorker->m_ulStatsTick & ( TP_STATS_SAMPLE - 1 ) ) )
+            RunTaskCounted( pWorker, &task );
+        else
+            RunTask( &task );
+        THREAD_TRACE_END( "tp task" );
+        CountStats( &( pWorker->m_cStats.m_lExecuted ), 1 );
+        CompleteTasks( pThreadPool, 1 );
+    }
+
+    g_pCurrentWorker = NULL;
+    return 0;
+}
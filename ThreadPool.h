@@ -1,13 +1,60 @@
 #ifndef __THREAD_POOL_H__
 #define __THREAD_POOL_H__
 
+#ifndef WIN32
+#ifndef USE_PTHREAD_THREAD_FORCE
+#define USE_PTHREAD_THREAD_FORCE
+#endif
+#endif
+
+/*
+ * Synchronization backend is chosen at compile time the same way as in CrossThread.h:
+ * Win32 critical section + condition variables (Vista and later) or pthread mutex + condition variables
+ */
+#ifndef USE_PTHREAD_THREAD_FORCE
 #include <Windows.h>
+typedef CRITICAL_SECTION TP_LOCK;
+typedef CONDITION_VARIABLE TP_COND;
+typedef HANDLE TP_THREAD;
+typedef DWORD TP_THREAD_RESULT;
+#define TP_THREAD_CALL WINAPI
+#else
+#include <pthread.h>
+typedef pthread_mutex_t TP_LOCK;
+typedef pthread_cond_t TP_COND;
+typedef pthread_t TP_THREAD;
+typedef void* TP_THREAD_RESULT;
+#define TP_THREAD_CALL
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 typedef void ( *ThreadPoolFunc )( void* );
+
+/*
+ * Build with THREAD_POOL_INLINE_TASK to give every task an inline argument buffer, on 64 bit targets a task then
+ * fills exactly one cache line. AllocateTaskInline copies small arguments right into the task (and so into the queue slot),
+ * larger ones still go to the task argument allocator
+ */
+#define TP_TASK_INLINE_SIZE 40
+#define TP_INLINE_PARS ( ( void* )-1 )    /* m_pPars of a task whose argument is kept in m_cInline */
+#define TP_OWNED_PARS( p ) ( ( void* )( ( size_t )( p ) | 1 ) )    /* m_pPars of a task that frees its argument block p itself, the function gets p */
+
 typedef struct SThreadPoolTask
 {
     ThreadPoolFunc m_pFunc;
     void*          m_pPars;
+    unsigned long  m_ulQueuedUs;        /* Set by the pool, queue entry time for the lane wait histogram */
+#ifdef THREAD_POOL_INLINE_TASK
+    union
+    {
+        char   m_cData[ TP_TASK_INLINE_SIZE ];
+        double m_dAlign;
+        void*  m_pAlign;
+    } m_cInline;
+#endif
 } SThreadPoolTask;
 
 typedef struct SQueue
@@ -18,26 +65,252 @@ typedef struct SQueue
     unsigned long m_ulCapacity;
 } SQueue;
 
-typedef struct SMemPool
+#define TP_CACHE_LINE_SIZE 64
+
+/*
+ * Bounded lock-free MPMC ring (D. Vyukov's sequence numbered cells).
+ * Build with THREAD_POOL_LOCKFREE_QUEUE to make the thread pool use it instead of the locked SQueue
+ */
+typedef struct SRingCell
 {
-    void** m_ptrPool;
-    unsigned long m_ulSize;
-    unsigned long m_ulCapacity;
-} SMemPool;
+    volatile long m_lSequence;
+    SThreadPoolTask m_cTask;
+} SRingCell;
+
+typedef struct SRingQueue
+{
+    SRingCell* m_ptrCells;
+    unsigned long m_ulMask;
+    char m_cPad0[ TP_CACHE_LINE_SIZE ];
+    volatile long m_lEnqueuePos;
+    char m_cPad1[ TP_CACHE_LINE_SIZE ];
+    volatile long m_lDequeuePos;
+    char m_cPad2[ TP_CACHE_LINE_SIZE ];
+} SRingQueue;
+
+/*
+ * SRingQueue whose poppers can wait: a pop spins a little with a pause instruction, then sleeps until a push or the timeout.
+ * The spin adapts to how often it catches an item, pushers take the lock only while a popper sleeps
+ */
+#define TP_WAIT_INFINITE ( ( unsigned long )-1 )
+#define TP_SPIN_MIN 16
+#define TP_SPIN_MAX 4096
+
+typedef struct SBlockingQueue
+{
+    SRingQueue m_cQueue;
+    volatile long m_lWaiters;
+    volatile long m_lSpin;
+    TP_LOCK m_cLock;
+    TP_COND m_cCond;
+} SBlockingQueue;
+
+/*
+ * Chase-Lev work-stealing deque (bounded). The owner pushes and takes at the bottom, thieves steal from the top
+ */
+typedef struct SWorkDeque
+{
+    volatile long m_lTop;
+    char m_cPad0[ TP_CACHE_LINE_SIZE ];
+    volatile long m_lBottom;
+    SThreadPoolTask* m_ptrTasks;
+    unsigned long m_ulMask;
+    char m_cPad1[ TP_CACHE_LINE_SIZE ];
+} SWorkDeque;
+
+/*
+ * Runtime statistics. Every worker counts into a block of its own and GetThreadPoolStats adds the blocks up with plain loads,
+ * it never stops the workers: scrape it at any rate and take differences, counters only grow (and wrap).
+ * Counters are always kept, the histograms only by a pool with TPF_COLLECT_STATS: every TP_STATS_SAMPLE-th task of a worker
+ * is timed, two clock reads. Histograms are log-linear, 1 << TP_STATS_SUB_BITS buckets per power of two,
+ * values above 2^32 - 1 go to the last bucket
+ */
+#define TP_STATS_SAMPLE 16
+#define TP_STATS_SUB_BITS 2
+#define TP_STATS_BUCKETS ( ( 32 - TP_STATS_SUB_BITS + 1 ) << TP_STATS_SUB_BITS )
+
+typedef struct SThreadPoolWorkerStats
+{
+    char m_cPad0[ TP_CACHE_LINE_SIZE ];
+    volatile long m_lExecuted;
+    volatile long m_lStolen;
+    volatile long m_lParks;
+    volatile long m_lWakes;             /* Parks ended by a wake-up rather than the keep-alive time out */
+    volatile long m_lIdleUs;
+    volatile long m_lSojournHistogram[ TP_STATS_BUCKETS ];  /* Queue entry to start, microseconds */
+    volatile long m_lRunHistogram[ TP_STATS_BUCKETS ];      /* Run time, nanoseconds */
+    char m_cPad1[ TP_CACHE_LINE_SIZE ];
+} SThreadPoolWorkerStats;
+
+/* Snapshot of the whole pool or of one worker. Percentiles are upper bucket bounds, 0 without samples */
+typedef struct SThreadPoolStats
+{
+    unsigned long m_ulExecuted;
+    unsigned long m_ulStolen;
+    unsigned long m_ulParks;
+    unsigned long m_ulWakes;
+    unsigned long m_ulIdleUs;
+    unsigned long m_ulPending;          /* Tasks queued or running, pool snapshot only */
+    unsigned long m_ulPutWaits;         /* Puts blocked by a full queue, pool snapshot only */
+    unsigned long m_ulPutWaitUs;
+    unsigned long m_ulSojournP50Us;
+    unsigned long m_ulSojournP99Us;
+    unsigned long m_ulSojournP999Us;
+    unsigned long m_ulRunP50Ns;
+    unsigned long m_ulRunP99Ns;
+    unsigned long m_ulRunP999Ns;
+    unsigned long m_ulSojournHistogram[ TP_STATS_BUCKETS ];
+    unsigned long m_ulRunHistogram[ TP_STATS_BUCKETS ];
+} SThreadPoolStats;
+
+struct SThreadPool;
+
+#define TP_WORKER_BATCH_SIZE 8     /* Most tasks a worker takes from the global queue per acquisition */
+
+typedef struct SThreadPoolWorker
+{
+    struct SThreadPool* m_pPool;
+    TP_THREAD m_hThread;
+    SWorkDeque m_cDeque;
+    int m_iState;
+    unsigned long m_ulIndex;
+    unsigned long m_ulSeed;
+    SThreadPoolTask m_cBatch[ TP_WORKER_BATCH_SIZE ];
+    unsigned long m_ulBatchSize;
+    unsigned long m_ulBatchPos;
+    unsigned long m_ulStatsTick;
+    SThreadPoolWorkerStats m_cStats;
+} SThreadPoolWorker;
+
+#define TP_DEFAULT_RING_SIZE 65536
+#define TP_TASK_ARG_SIZE 32        /* Argument block size of AllocateTask */
+
+#define TPF_WORK_STEALING 0x00000001    /* Tasks put from a worker go to its own deque, idle workers steal */
+#define TPF_COLLECT_STATS 0x00000002    /* Workers keep sojourn and run time histograms, see SThreadPoolStats */
+
+/*
+ * Priority lanes, 0 is served first. Each lane is a queue of its own bounded by m_ulMaxQueueSize,
+ * a bitmap of non-empty lanes keeps dispatch to one load. Priorities past the lanes of a pool go to its last lane
+ */
+#define TP_PRIORITY_LANES 4
+#define TP_PRIORITY_HIGH 0
+#define TP_PRIORITY_NORMAL 1
+#define TP_PRIORITY_LOW 2
+#define TP_PRIORITY_BACKGROUND 3
+#define TP_PRIORITY_GLOBAL 0x00000100    /* Or'ed into a priority: the task goes to the lane even when put from a worker of a TPF_WORK_STEALING pool */
+
+#define TP_WAIT_BUCKETS 24      /* Log2 histogram of the queue wait, bucket i counts waits below 2^( i + 1 ) microseconds */
+
+#define TP_AFFINITY_NONE 0
+#define TP_AFFINITY_CPUS 1      /* Every worker runs on the m_ptrAffinityCpus set */
+#define TP_AFFINITY_CORE 2      /* Worker i is pinned to one CPU of physical core i (wrapping), SMT siblings stay free */
+#define TP_AFFINITY_NUMA 3      /* Workers run on the CPUs of NUMA node m_ulAffinityNode */
+
+#define TP_THREAD_PRIORITY_LOW 0      /* SCHED_OTHER nice 10, THREAD_PRIORITY_IDLE on Windows */
+#define TP_THREAD_PRIORITY_NORMAL 1
+#define TP_THREAD_PRIORITY_HIGH 2     /* SCHED_FIFO (nice -5 without CAP_SYS_NICE), THREAD_PRIORITY_TIME_CRITICAL on Windows */
+
+typedef struct SThreadPoolParams
+{
+    unsigned long m_ulThreadPoolSize;   /* 0 - one worker per available CPU, see GetAvailableCpuCount */
+    unsigned long m_ulMaxQueueSize;     /* 0 - unbounded (the lock-free ring falls back to TP_DEFAULT_RING_SIZE) */
+    unsigned long m_ulLocalQueueSize;   /* Per-worker deque capacity for TPF_WORK_STEALING */
+    unsigned long m_ulFlags;
+    unsigned long m_ulMinThreads;       /* Elastic pool bounds, m_ulMaxThreads 0 - fixed size pool */
+    unsigned long m_ulMaxThreads;
+    unsigned long m_ulGrowQueueDepth;   /* Spawn a worker when none is idle and more tasks than this are waiting */
+    unsigned long m_ulKeepAliveMs;      /* Workers above m_ulMinThreads retire after idling this long, 0 - never */
+    unsigned long m_ulPriorityLanes;    /* 1 .. TP_PRIORITY_LANES, 1 - single FIFO */
+    unsigned long m_ulStarvationLimit;  /* Dispatches in a row past a waiting lower lane before it gets one, 0 - strict priority */
+    unsigned long m_ulAffinity;         /* TP_AFFINITY_*, workers stay unpinned if the spec matches no CPU of the process */
+    unsigned long m_ulAffinityNode;
+    const unsigned long* m_ptrAffinityCpus;  /* CPU indexes of TP_AFFINITY_CPUS, copied by AllocThreadPoolEx */
+    unsigned long m_ulAffinityCpuCount;
+    unsigned long m_ulThreadPriority;   /* TP_THREAD_PRIORITY_* of the workers */
+} SThreadPoolParams;
+
+typedef struct SThreadPoolCounters
+{
+    unsigned long m_ulThreads;
+    unsigned long m_ulIdleThreads;
+    unsigned long m_ulThreadsGrown;
+    unsigned long m_ulThreadsRetired;
+    unsigned long m_ulWakeups;          /* Worker wake-up signals sent */
+} SThreadPoolCounters;
+
+typedef struct SThreadPoolLaneCounters
+{
+    unsigned long m_ulDepth;
+    unsigned long m_ulDequeued;
+    unsigned long m_ulWaitP50Us;
+    unsigned long m_ulWaitP99Us;
+    unsigned long m_ulWaitHistogram[ TP_WAIT_BUCKETS ];
+} SThreadPoolLaneCounters;
+
+/* Dequeue counters and the wait histogram are kept only by a pool with several lanes */
+typedef struct SThreadPoolLane
+{
+#ifdef THREAD_POOL_LOCKFREE_QUEUE
+    SRingQueue m_cQueue;
+#else
+    SQueue m_cQueue;
+#endif
+    volatile long m_lDequeued;
+    volatile long m_lWaitHistogram[ TP_WAIT_BUCKETS ];
+} SThreadPoolLane;
+
+/*
+ * Counts tasks down to zero, the waiter waits for exactly the tasks put with PutTaskInGroup (or counted by hand as a latch).
+ * Only m_lState lives in the group, waiters park in a shared table of condition variables
+ */
+typedef struct STaskGroup
+{
+    volatile long m_lState;
+} STaskGroup;
+
+/* Completion of one task put with PutTaskWithHandle, the task stores m_pResult with SetTaskResult */
+typedef struct STaskHandle
+{
+    STaskGroup m_cGroup;
+    void* m_pResult;
+} STaskHandle;
 
 typedef struct SThreadPool
 {
     int m_iIsWorking;
-    HANDLE m_hEventForThreads;
-    HANDLE m_hEventForJoinAll;
-    HANDLE m_hEventForPutTask;
-    CRITICAL_SECTION m_cCriticalSection;
-    SQueue m_cTaskQueue;
-    HANDLE m_cThreadPool[ 5 ];
-    DWORD m_dwThreadPoolSize;
-    SMemPool m_cMemPool;
+    TP_COND m_cCondForThreads;
+    TP_COND m_cCondForJoinAll;
+    TP_COND m_cCondForPutTask;
+    TP_LOCK m_cCriticalSection;
+    SThreadPoolLane m_cLanes[ TP_PRIORITY_LANES ];
+    unsigned long m_ulPriorityLanes;
+    unsigned long m_ulStarvationLimit;
+    volatile long m_lLaneMask;
+    volatile long m_lLaneStreak;
+    volatile long m_lStarvedLane;
+    unsigned long m_ulAffinity;
+    unsigned long* m_ptrAffinityCpus;   /* Resolved CPU set, one entry per core for TP_AFFINITY_CORE */
+    unsigned long m_ulAffinityCpuCount;
+    unsigned long m_ulThreadPriority;
+    SThreadPoolWorker* m_ptrThreadPool;
+    unsigned long m_ulThreadPoolCapacity;
+    volatile long m_lThreadPoolSize;
+    volatile long m_lMinThreads;
+    volatile long m_lMaxThreads;
+    unsigned long m_ulGrowQueueDepth;
+    unsigned long m_ulKeepAliveMs;
+    volatile long m_lThreadsGrown;
+    volatile long m_lThreadsRetired;
+    unsigned long m_ulFlags;
     unsigned long m_ulMaxQueueSize;
-    unsigned long m_ulTaskRemained;
+    volatile long m_lTaskRemained;
+    volatile long m_lPutTaskWaiters;
+    volatile long m_lPutWaits;
+    volatile long m_lPutWaitUs;
+    volatile long m_lIdleThreads;
+    volatile long m_lWakePending;       /* Parked workers signalled and not yet running, changed under the lock */
+    volatile long m_lWakeups;
+    volatile long m_lLocalTasks;
 } SThreadPool;
 
 void AllocQueue( SQueue* );
@@ -45,19 +318,86 @@ void FreeQueue( SQueue* );
 void ReallocQueue( SQueue*, unsigned long );
 void PushQueue( SQueue*, const SThreadPoolTask* );
 void PopQueue( SQueue*, SThreadPoolTask* );
+void PushQueueBatch( SQueue*, const SThreadPoolTask*, unsigned long );
+unsigned long PopQueueBatch( SQueue*, SThreadPoolTask*, unsigned long );
 void PrintDebug( const SQueue* );
 
-void AllocMemPool( SMemPool* );
-void FreeMemPool( SMemPool* );
-void ReallocMemPool( SMemPool*, unsigned long );
-void PushMemPool( SMemPool*, void* );
-void PopMemPool( SMemPool*, void** );
+void AllocRingQueue( SRingQueue*, unsigned long );
+void FreeRingQueue( SRingQueue* );
+int PushRingQueue( SRingQueue*, const SThreadPoolTask* );
+int PopRingQueue( SRingQueue*, SThreadPoolTask* );
+unsigned long PushRingQueueBatch( SRingQueue*, const SThreadPoolTask*, unsigned long );
+unsigned long PopRingQueueBatch( SRingQueue*, SThreadPoolTask*, unsigned long );
+unsigned long GetRingQueueSize( const SRingQueue* );
+
+void AllocBlockingQueue( SBlockingQueue*, unsigned long );
+void FreeBlockingQueue( SBlockingQueue* );
+int PushBlockingQueue( SBlockingQueue*, const SThreadPoolTask* );
+unsigned long PushBlockingQueueBatch( SBlockingQueue*, const SThreadPoolTask*, unsigned long );
+int PopBlockingQueue( SBlockingQueue*, SThreadPoolTask*, unsigned long );
 
+void AllocWorkDeque( SWorkDeque*, unsigned long );
+void FreeWorkDeque( SWorkDeque* );
+int PushWorkDeque( SWorkDeque*, const SThreadPoolTask* );
+int TakeWorkDeque( SWorkDeque*, SThreadPoolTask* );
+int StealWorkDeque( SWorkDeque*, SThreadPoolTask* );
+
+/*
+ * Task arguments come from size classed thread caches, a block may be freed by any thread.
+ * FlushTaskArgCache hands blocks of other threads freed by the caller back to their owners right away.
+ * A task put with TP_OWNED_PARS( p ) keeps its argument block from the worker, e.g. to share it with a waiter
+ */
+void* AllocTaskArg( unsigned long );
+void FreeTaskArg( void* );
+void FlushTaskArgCache( void );
+
+unsigned long GetAvailableCpuCount( void );
+void InitThreadPoolParams( SThreadPoolParams* );
+void AllocThreadPoolEx( SThreadPool*, const SThreadPoolParams* );
 void AllocThreadPool( SThreadPool*, unsigned long, unsigned long );
 void FreeThreadPool( SThreadPool* );
+void ResizeThreadPool( SThreadPool*, unsigned long, unsigned long );
+void GetThreadPoolCounters( SThreadPool*, SThreadPoolCounters* );
+void GetThreadPoolLaneCounters( SThreadPool*, unsigned long, SThreadPoolLaneCounters* );
+void GetThreadPoolStats( SThreadPool*, SThreadPoolStats* );
+void GetThreadPoolWorkerStats( SThreadPool*, unsigned long, SThreadPoolStats* );
+unsigned long GetStatsBucketValue( unsigned long );
 void AllocateTask( SThreadPool*, SThreadPoolTask* );
+void AllocateTaskEx( SThreadPool*, SThreadPoolTask*, unsigned long );
+void* AllocateTaskInline( SThreadPool*, SThreadPoolTask*, unsigned long );
+
+/*
+ * A task the pool does not accept (only while it is stopping) is neither run nor freed: the caller still owns its m_pPars
+ * and releases it with FreeTaskArg unless it is TP_INLINE_PARS (the block p of TP_OWNED_PARS( p )). PutTasksInQueue(Ex) return how many tasks were accepted, the first ones of the array,
+ * PutTaskInGroup and PutTaskWithHandle return 0 and count the group down. PutTaskInQueue(Ex) cannot tell, the argument of
+ * a rejected task is leaked
+ */
 void PutTaskInQueue( SThreadPool*, const SThreadPoolTask* );
+unsigned long PutTasksInQueue( SThreadPool*, const SThreadPoolTask*, unsigned long );
+void PutTaskInQueueEx( SThreadPool*, const SThreadPoolTask*, unsigned long );
+unsigned long PutTasksInQueueEx( SThreadPool*, const SThreadPoolTask*, unsigned long, unsigned long );
 void ThreadPoolJoinAll( SThreadPool* );
-DWORD WINAPI ThreadPoolWorkProc( LPVOID );
+int IsThreadPoolHungry( SThreadPool* );
+int RunThreadPoolTask( SThreadPool* );
+
+void InitTaskGroup( STaskGroup*, unsigned long );
+void AddTaskGroup( STaskGroup*, unsigned long );
+void DoneTaskGroup( STaskGroup*, unsigned long );
+int TryWaitTaskGroup( STaskGroup* );
+void WaitTaskGroup( STaskGroup* );
+int WaitTaskGroupTimeout( STaskGroup*, unsigned long );
+int PutTaskInGroup( SThreadPool*, const SThreadPoolTask*, STaskGroup* );
+
+int PutTaskWithHandle( SThreadPool*, const SThreadPoolTask*, STaskHandle* );
+int TryWaitTaskHandle( STaskHandle* );
+void WaitTaskHandle( STaskHandle* );
+int WaitTaskHandleTimeout( STaskHandle*, unsigned long );
+void* GetTaskResult( const STaskHandle* );
+void SetTaskResult( void* );
+TP_THREAD_RESULT TP_THREAD_CALL ThreadPoolWorkProc( void* );
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif//__THREAD_POOL_H__
\ No newline at end of file
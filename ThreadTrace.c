@@ -0,0 +1,331 @@
+#if !defined( WIN32 ) && !defined( _GNU_SOURCE )
+#define _GNU_SOURCE
+#endif
+
+#include "ThreadTrace.h"
+
+#ifdef THREAD_TRACE
+
+#ifndef WIN32
+#ifndef USE_PTHREAD_THREAD_FORCE
+#define USE_PTHREAD_THREAD_FORCE
+#endif
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef USE_PTHREAD_THREAD_FORCE
+#include <Windows.h>
+#include <intrin.h>
+#define TT_THREAD_LOCAL __declspec( thread )
+
+static __inline unsigned long AtomicLoadUl( volatile unsigned long* pul ) { unsigned long ul = *pul; _ReadWriteBarrier(); return ul; }
+static __inline void AtomicStoreUl( volatile unsigned long* pul, unsigned long ul ) { _ReadWriteBarrier(); *pul = ul; }
+static __inline int AtomicCasUl( volatile unsigned long* pul, unsigned long ulExpected, unsigned long ulDesired ) { return ( LONG )ulExpected == InterlockedCompareExchange( ( volatile LONG* )pul, ( LONG )ulDesired, ( LONG )ulExpected ); }
+static __inline void FullFence( void ) { MemoryBarrier(); }
+static __inline void* AtomicLoadPtr( void* volatile* pp ) { void* p = *pp; _ReadWriteBarrier(); return p; }
+static __inline void* AtomicExchangePtr( void* volatile* pp, void* p ) { return InterlockedExchangePointer( pp, p ); }
+static __inline int AtomicCasPtr( void* volatile* pp, void* pExpected, void* pDesired ) { return pExpected == InterlockedCompareExchangePointer( pp, pDesired, pExpected ); }
+
+static unsigned long GetTraceThreadId( void ) { return ( unsigned long )GetCurrentThreadId(); }
+static unsigned long GetTraceProcessId( void ) { return ( unsigned long )GetCurrentProcessId(); }
+
+static unsigned long long GetClockNs( void )
+{
+    static LARGE_INTEGER s_cFrequency;
+    LARGE_INTEGER cCounter;
+
+    if( 0 == s_cFrequency.QuadPart )
+        QueryPerformanceFrequency( &s_cFrequency );
+    QueryPerformanceCounter( &cCounter );
+    return ( unsigned long long )( ( double )cCounter.QuadPart * 1e9 / ( double )s_cFrequency.QuadPart );
+}
+
+/* The fiber local slot calls back on thread exit, like a pthread key destructor */
+static DWORD g_dwTraceSlot = FLS_OUT_OF_INDEXES;
+static void ReleaseTraceRing( void* pRing );
+static VOID WINAPI OnTraceThreadExit( PVOID pRing ) { ReleaseTraceRing( pRing ); }
+static BOOL CALLBACK InitTraceSlotOnce( PINIT_ONCE pOnce, PVOID pParam, PVOID* ppContext ) { g_dwTraceSlot = FlsAlloc( OnTraceThreadExit ); return TRUE; }
+
+static int InitTraceSlot( void )
+{
+    static INIT_ONCE s_cOnce = INIT_ONCE_STATIC_INIT;
+
+    InitOnceExecuteOnce( &s_cOnce, InitTraceSlotOnce, NULL, NULL );
+    return FLS_OUT_OF_INDEXES != g_dwTraceSlot;
+}
+static void SetTraceSlot( void* pRing ) { FlsSetValue( g_dwTraceSlot, pRing ); }
+
+#if defined( _M_IX86 ) || defined( _M_X64 )
+static __inline unsigned long long ReadStamp( void ) { return __rdtsc(); }
+#else
+static __inline unsigned long long ReadStamp( void ) { LARGE_INTEGER cCounter; QueryPerformanceCounter( &cCounter ); return ( unsigned long long )cCounter.QuadPart; }
+#endif
+#else
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#define TT_THREAD_LOCAL __thread
+
+static __inline unsigned long AtomicLoadUl( volatile unsigned long* pul ) { return __atomic_load_n( pul, __ATOMIC_ACQUIRE ); }
+static __inline void AtomicStoreUl( volatile unsigned long* pul, unsigned long ul ) { __atomic_store_n( pul, ul, __ATOMIC_RELEASE ); }
+static __inline int AtomicCasUl( volatile unsigned long* pul, unsigned long ulExpected, unsigned long ulDesired ) { return __atomic_compare_exchange_n( pul, &ulExpected, ulDesired, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE ); }
+static __inline void FullFence( void ) { __atomic_thread_fence( __ATOMIC_SEQ_CST ); }
+static __inline void* AtomicLoadPtr( void* volatile* pp ) { return __atomic_load_n( pp, __ATOMIC_ACQUIRE ); }
+static __inline void* AtomicExchangePtr( void* volatile* pp, void* p ) { return __atomic_exchange_n( pp, p, __ATOMIC_ACQ_REL ); }
+static __inline int AtomicCasPtr( void* volatile* pp, void* pExpected, void* pDesired ) { return __atomic_compare_exchange_n( pp, &pExpected, pDesired, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE ); }
+
+#if defined( __linux__ ) && defined( SYS_gettid )
+static unsigned long GetTraceThreadId( void ) { return ( unsigned long )syscall( SYS_gettid ); }
+#else
+static unsigned long GetTraceThreadId( void ) { static volatile long s_lThreads; return ( unsigned long )__atomic_add_fetch( &s_lThreads, 1, __ATOMIC_RELAXED ); }
+#endif
+static unsigned long GetTraceProcessId( void ) { return ( unsigned long )getpid(); }
+
+/* The key destructor runs on thread exit */
+static pthread_key_t g_cTraceKey;
+static int g_iTraceKey;
+static void ReleaseTraceRing( void* pRing );
+static void InitTraceKeyOnce( void ) { g_iTraceKey = 0 == pthread_key_create( &g_cTraceKey, ReleaseTraceRing ); }
+
+static int InitTraceSlot( void )
+{
+    static pthread_once_t s_cOnce = PTHREAD_ONCE_INIT;
+
+    pthread_once( &s_cOnce, InitTraceKeyOnce );
+    return g_iTraceKey;
+}
+static void SetTraceSlot( void* pRing ) { pthread_setspecific( g_cTraceKey, pRing ); }
+
+static unsigned long long GetClockNs( void )
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ( unsigned long long )ts.tv_sec * 1000000000ULL + ( unsigned long long )ts.tv_nsec;
+}
+
+#if defined( __i386__ ) || defined( __x86_64__ )
+static __inline unsigned long long ReadStamp( void ) { return __builtin_ia32_rdtsc(); }
+#elif defined( __aarch64__ )
+static __inline unsigned long long ReadStamp( void ) { unsigned long long ull; __asm__ __volatile__( "mrs %0, cntvct_el0" : "=r"( ull ) ); return ull; }
+#else
+static __inline unsigned long long ReadStamp( void ) { return GetClockNs(); }
+#endif
+#endif
+
+#define TT_RING_MASK ( TT_RING_SIZE - 1 )
+
+static TT_THREAD_LOCAL STraceRing* g_pTraceRing;
+static void* volatile g_pTraceRings;
+
+/* Counter and clock at the first ring, the export maps counter values to the clock with a second pair */
+static volatile long g_lTraceBase;
+static unsigned long long g_ullBaseStamp;
+static unsigned long long g_ullBaseNs;
+
+static void SetTraceBase( void )
+{
+    static void* volatile s_pOwner;
+
+    if( 0 != g_lTraceBase || !AtomicCasPtr( &s_pOwner, NULL, ( void* )&g_lTraceBase ) )
+        return;
+    g_ullBaseNs = GetClockNs();
+    g_ullBaseStamp = ReadStamp();
+    FullFence();
+    g_lTraceBase = 1;
+}
+
+/* Called on exit of the ring's thread, the next thread that starts tracing takes the ring */
+static void ReleaseTraceRing( void* pRing )
+{
+    g_pTraceRing = NULL;
+    if( NULL != pRing )
+        AtomicStoreUl( &( ( ( STraceRing* )pRing )->m_ulInUse ), 0 );
+}
+
+static STraceRing* AllocTraceRing( void )
+{
+    STraceRing* pRing;
+    void* pHead;
+
+    /* Without a thread exit callback a ring could never be given back, so none is handed out */
+    if( !InitTraceSlot() )
+        return NULL;
+
+    for( pRing = ( STraceRing* )AtomicLoadPtr( &g_pTraceRings ); NULL != pRing; pRing = pRing->m_pNext )
+    {
+        if( 0 == AtomicLoadUl( &( pRing->m_ulInUse ) ) && AtomicCasUl( &( pRing->m_ulInUse ), 0, 1 ) )
+        {
+            pRing->m_szName = NULL;
+            AtomicStoreUl( &( pRing->m_ulThreadId ), GetTraceThreadId() );
+            AtomicStoreUl( &( pRing->m_ulStart ), pRing->m_ulHead );
+            break;
+        }
+    }
+
+    if( NULL == pRing )
+    {
+        if( NULL == ( pRing = ( STraceRing* )calloc( 1, sizeof( STraceRing ) ) ) )
+            return NULL;
+
+        SetTraceBase();
+        pRing->m_ulInUse = 1;
+        pRing->m_ulThreadId = GetTraceThreadId();
+        do
+        {
+            pHead = AtomicLoadPtr( &g_pTraceRings );
+            pRing->m_pNext = ( STraceRing* )pHead;
+        } while( !AtomicCasPtr( &g_pTraceRings, pHead, pRing ) );
+    }
+
+    SetTraceSlot( pRing );
+    g_pTraceRing = pRing;
+    return pRing;
+}
+
+void TraceEvent( unsigned long ulType, const char* szName, unsigned long long ullArg )
+{
+    STraceRing* pRing = g_pTraceRing;
+    STraceEvent* pEvent;
+    unsigned long ulHead;
+
+    if( NULL == pRing && NULL == ( pRing = AllocTraceRing() ) )
+        return;
+
+    /* Only this thread writes the ring, the release store of the head publishes the event to the exporter */
+    ulHead = pRing->m_ulHead;
+    pEvent = pRing->m_cEvents + ( ulHead & TT_RING_MASK );
+    pEvent->m_ullStamp = ReadStamp();
+    pEvent->m_szName = szName;
+    pEvent->m_ullArg = ullArg;
+    pEvent->m_ulType = ulType;
+    AtomicStoreUl( &( pRing->m_ulHead ), ulHead + 1 );
+}
+
+void SetThreadTraceName( const char* szName )
+{
+    STraceRing* pRing = g_pTraceRing;
+
+    if( NULL != pRing || NULL != ( pRing = AllocTraceRing() ) )
+        pRing->m_szName = szName;
+}
+
+static void WriteTraceString( FILE* pFile, const char* sz )
+{
+    fputc( '"', pFile );
+    for( ; NULL != sz && '\0' != *sz; ++sz )
+    {
+        if( '"' == *sz || '\\' == *sz )
+            fputc( '\\', pFile );
+        if( ( unsigned char )*sz >= 0x20 )
+            fputc( *sz, pFile );
+    }
+    fputc( '"', pFile );
+}
+
+/* Copies the events of the ring's current thread, returns their count. The ones the writer may have reached meanwhile are dropped */
+static unsigned long CopyTraceRing( STraceRing* pRing, STraceEvent* pEvents )
+{
+    const unsigned long ulHead = AtomicLoadUl( &( pRing->m_ulHead ) );
+    const unsigned long ulStart = AtomicLoadUl( &( pRing->m_ulStart ) );
+    unsigned long ulFirst = ulHead > TT_RING_SIZE ? ulHead - TT_RING_SIZE : 0;
+    unsigned long ulLast, i;
+
+    if( ulHead - ulStart < ulHead - ulFirst )
+        ulFirst = ulStart;
+
+    for( i = ulFirst; i != ulHead; ++i )
+        pEvents[ i - ulFirst ] = pRing->m_cEvents[ i & TT_RING_MASK ];
+
+    /* The copies above must be done before the second look at the head */
+    FullFence();
+    ulLast = AtomicLoadUl( &( pRing->m_ulHead ) );
+    if( ulLast - ulFirst >= TT_RING_SIZE )
+    {
+        i = ulLast - ulFirst - TT_RING_SIZE + 1;
+        if( i >= ulHead - ulFirst )
+            return 0;
+        memmove( pEvents, pEvents + i, ( ulHead - ulFirst - i ) * sizeof( STraceEvent ) );
+        ulFirst += i;
+    }
+    return ulHead - ulFirst;
+}
+
+int ExportThreadTrace( const char* szFileName )
+{
+    static const char* const s_szPhases[] = { "B", "E", "i" };
+    STraceEvent* pEvents;
+    STraceRing* pRing;
+    FILE* pFile;
+    unsigned long long ullNowStamp, ullNowNs;
+    unsigned long ulCount, ulPid, ulTid, i;
+    double dNsPerTick = 1.0, dUs;
+    int iFirst = 1;
+
+    if( NULL == ( pFile = fopen( szFileName, "w" ) ) )
+        return 0;
+    if( NULL == ( pEvents = ( STraceEvent* )malloc( TT_RING_SIZE * sizeof( STraceEvent ) ) ) )
+    {
+        fclose( pFile );
+        return 0;
+    }
+
+    ullNowNs = GetClockNs();
+    ullNowStamp = ReadStamp();
+    if( 0 != g_lTraceBase && ullNowStamp > g_ullBaseStamp && ullNowNs > g_ullBaseNs )
+        dNsPerTick = ( double )( ullNowNs - g_ullBaseNs ) / ( double )( ullNowStamp - g_ullBaseStamp );
+
+    ulPid = GetTraceProcessId();
+    fputs( "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", pFile );
+    for( pRing = ( STraceRing* )AtomicLoadPtr( &g_pTraceRings ); NULL != pRing; pRing = pRing->m_pNext )
+    {
+        ulTid = AtomicLoadUl( &( pRing->m_ulThreadId ) );
+        if( NULL != pRing->m_szName )
+        {
+            fprintf( pFile, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%lu,\"tid\":%lu,\"args\":{\"name\":", iFirst ? "" : ",", ulPid, ulTid );
+            WriteTraceString( pFile, pRing->m_szName );
+            fputs( "}}", pFile );
+            iFirst = 0;
+        }
+
+        ulCount = CopyTraceRing( pRing, pEvents );
+        for( i = 0; i < ulCount; ++i )
+        {
+            /* Signed, a thread may have read its counter just before the base was taken */
+            dUs = ( double )( long long )( pEvents[ i ].m_ullStamp - g_ullBaseStamp ) * dNsPerTick * 1e-3;
+            fprintf( pFile, "%s\n{\"name\":", iFirst ? "" : "," );
+            WriteTraceString( pFile, pEvents[ i ].m_szName );
+            fprintf( pFile, ",\"ph\":\"%s\",\"ts\":%.3f,\"pid\":%lu,\"tid\":%lu", s_szPhases[ pEvents[ i ].m_ulType ], dUs, ulPid, ulTid );
+            if( TTE_INSTANT == pEvents[ i ].m_ulType )
+                fputs( ",\"s\":\"t\"", pFile );
+            if( TTE_END != pEvents[ i ].m_ulType )
+                fprintf( pFile, ",\"args\":{\"arg\":%llu}", pEvents[ i ].m_ullArg );
+            fputc( '}', pFile );
+            iFirst = 0;
+        }
+    }
+    fputs( "\n]}\n", pFile );
+
+    free( pEvents );
+    return 0 == fclose( pFile );
+}
+
+void FreeThreadTrace( void )
+{
+    STraceRing* pRing = ( STraceRing* )AtomicExchangePtr( &g_pTraceRings, NULL );
+    STraceRing* pNext;
+
+    for( ; NULL != pRing; pRing = pNext )
+    {
+        pNext = pRing->m_pNext;
+        free( pRing );
+    }
+    g_pTraceRing = NULL;
+    if( InitTraceSlot() )
+        SetTraceSlot( NULL );
+}
+
+#endif
@@ -0,0 +1,79 @@
+#ifndef __THREAD_TRACE_H__
+#define __THREAD_TRACE_H__
+
+/*
+ * Per-thread timeline of the pool workers, CrossThread loops and queues.
+ * Build everything with THREAD_TRACE and link ThreadTrace.c to record, without it the macros below expand to nothing.
+ * Every thread writes its own ring of TT_RING_SIZE events, the oldest are overwritten, so the rings always hold
+ * the last moments before a stall. A record is a counter read and one store of 32 bytes, no lock and no shared write.
+ * A ring is released when its thread exits and the next thread that starts tracing takes it over.
+ * ExportThreadTrace writes the rings as Chrome trace JSON, open it in chrome://tracing or ui.perfetto.dev
+ */
+
+#ifdef THREAD_TRACE
+
+#ifndef TT_RING_SIZE
+#define TT_RING_SIZE 16384    /* Events per thread, power of two */
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum ETraceEventType
+{
+    TTE_BEGIN = 0,    /* Start of a span */
+    TTE_END = 1,      /* End of the innermost span */
+    TTE_INSTANT = 2   /* Point event, e.g. a push or a state change */
+} ETraceEventType;
+
+typedef struct STraceEvent
+{
+    unsigned long long m_ullStamp;    /* Time stamp counter */
+    const char* m_szName;             /* Static string */
+    unsigned long long m_ullArg;
+    unsigned long m_ulType;
+} STraceEvent;
+
+typedef struct STraceRing
+{
+    volatile unsigned long m_ulHead;    /* Events written so far, the writer publishes it after the event */
+    volatile unsigned long m_ulStart;   /* Head when the current thread took the ring, older events are of an exited thread */
+    volatile unsigned long m_ulInUse;   /* 1 while a thread writes the ring, 0 once it exited */
+    volatile unsigned long m_ulThreadId;
+    const char* m_szName;
+    struct STraceRing* m_pNext;
+    STraceEvent m_cEvents[ TT_RING_SIZE ];
+} STraceRing;
+
+/* Records an event of the calling thread, szName must outlive the export */
+void TraceEvent( unsigned long ulType, const char* szName, unsigned long long ullArg );
+
+/* Names the calling thread in the export, szName must outlive the export */
+void SetThreadTraceName( const char* szName );
+
+/* Writes all rings as Chrome trace JSON. Events overwritten during the copy are left out. Returns 0 if the file cannot be written */
+int ExportThreadTrace( const char* szFileName );
+
+/* Releases all rings, traced threads other than the caller must have exited */
+void FreeThreadTrace( void );
+
+#ifdef __cplusplus
+}
+#endif
+
+#define THREAD_TRACE_BEGIN( szName, ullArg ) TraceEvent( TTE_BEGIN, szName, ( unsigned long long )( ullArg ) )
+#define THREAD_TRACE_END( szName ) TraceEvent( TTE_END, szName, 0 )
+#define THREAD_TRACE_INSTANT( szName, ullArg ) TraceEvent( TTE_INSTANT, szName, ( unsigned long long )( ullArg ) )
+#define THREAD_TRACE_NAME( szName ) SetThreadTraceName( szName )
+
+#else
+
+#define THREAD_TRACE_BEGIN( szName, ullArg ) ( ( void )0 )
+#define THREAD_TRACE_END( szName ) ( ( void )0 )
+#define THREAD_TRACE_INSTANT( szName, ullArg ) ( ( void )0 )
+#define THREAD_TRACE_NAME( szName ) ( ( void )0 )
+
+#endif
+
+#endif
@@ -0,0 +1,478 @@
+#pragma once
+#include "CrossThread.h"
+#include "ThreadPool.h"
+
+//
+// Hierarchical timer wheel firing delayed and periodic callbacks as ThreadPool tasks.
+// Four levels of 64 slots at 1 ms tick cover 2^24 ms (4.6 hours), later deadlines wait in the last level and are
+// re-sorted when it turns. Timers are intrusive list nodes, so schedule and cancel are O(1) under the wheel lock.
+// One timer thread parks until the next non-empty slot and queues all timers expired by then as one pool batch:
+// idle timers cost no CPU however many there are
+//
+
+#define TW_SLOT_BITS 6
+#define TW_SLOTS ( 1 << TW_SLOT_BITS )
+#define TW_SLOT_MASK ( TW_SLOTS - 1 )
+#define TW_LEVELS 4
+#define TW_FIRE_BATCH 64
+
+//!
+//!	@brief	Timer wheel on a thread pool
+//!	@remark	The pool must outlive the wheel. Timers must not outlive the wheel they were scheduled on, fired and
+//!		cancelled ones included: a timer destructor cancels through its last wheel
+//!
+class TimerWheel
+{
+public:
+	//!
+	//!	@brief	Type definition of timer callback
+	//!
+	typedef void (* TimerCallBack)( void * pParam );
+
+	//!
+	//!	@brief	Timer, owned by the caller
+	//!	@remark	A timer callback never runs twice at once: a periodic tick that comes while the previous call is still
+	//!		queued or running is skipped, a one-shot that comes due meanwhile is called again right after that call returns.
+	//!		Destroying a timer cancels it and waits for its running callback
+	//!
+	class Timer
+	{
+	public:
+		Timer():m_pWheel(NULL),m_pPrev(NULL),m_pNext(NULL),m_ppSlot(NULL),m_nExpiry(0),m_nPeriod(0),m_bDeferred(false),m_Function(NULL),m_pParam(NULL)
+		{
+			InitTaskGroup( &m_Group, 0 );
+		}
+
+		~Timer();
+
+		//!
+		//!	@brief	Checks if timer waits in a wheel
+		//!	@return	True/false
+		//!	@remark	Snapshot, the timer thread may fire it meanwhile
+		//!
+		inline bool IsScheduled() const { return m_ppSlot != NULL || m_bDeferred; }
+
+	private:
+		Timer( const Timer & );
+		Timer & operator=( const Timer & );
+
+	private:
+		friend class TimerWheel;
+
+		TimerWheel *						m_pWheel;						//!< Wheel of the last Schedule
+		Timer *								m_pPrev;						//!< Slot list links
+		Timer *								m_pNext;
+		Timer **							m_ppSlot;						//!< Slot list head, NULL if not scheduled
+		unsigned long long					m_nExpiry;						//!< Deadline, wheel ticks
+		unsigned long						m_nPeriod;						//!< Period, 0 - one shot
+		bool								m_bDeferred;					//!< One-shot came due during its previous call, under the wheel lock
+		TimerCallBack						m_Function;						//!< Callback
+		void *								m_pParam;						//!< Callback parameter
+		STaskGroup							m_Group;						//!< Callback calls queued or running
+	};
+
+public:
+	//!
+	//!	@brief	Constructor
+	//!	@param	pPool Pool running timer callbacks
+	//!	@param	nPriority Pool lane of timer callbacks, TP_PRIORITY_*
+	//!	@param	Priority Timer thread priority
+	//!	@throw	std::exception with error description
+	//!
+	explicit TimerWheel( SThreadPool * pPool, unsigned long nPriority = TP_PRIORITY_NORMAL, ThreadPriority Priority = TP_Normal ):
+		m_pPool(pPool), m_nPriority(nPriority), m_nCurrent(ThreadStateSignal::NowMs()), m_nCount(0), m_nWakeAt(0),
+		m_bStopping(false), m_Thread(Priority)
+	{
+		memset( m_Slots, 0, sizeof(m_Slots) );
+		m_Thread.SetData( this, &TimerWheel::TimerThread );
+		m_Thread.Run();
+	}
+
+	~TimerWheel()
+	{
+		{
+			ThreadStateLocker alock( m_Signal );
+			m_bStopping = true;
+			m_Signal.NotifyAll();
+		}
+
+		//
+		// Timers are destroyed before the wheel and have cancelled themselves, nothing waits in the slots
+		//
+		m_Thread.Terminate( true );
+	}
+
+	//!
+	//!	@brief	Schedules timer, a scheduled timer is moved to the new deadline
+	//!	@param	WheelTimer Timer
+	//!	@param	nDelay Milliseconds until the first call
+	//!	@param	Function Callback
+	//!	@param	pParam Callback parameter
+	//!	@param	nPeriod Milliseconds between calls, 0 - one shot
+	//!	@return	False if the wheel is stopping or the timer belongs to another wheel
+	//!
+	bool Schedule( Timer & WheelTimer, unsigned long nDelay, TimerCallBack Function, void * pParam, unsigned long nPeriod = 0 )
+	{
+		const unsigned long long nNow = ThreadStateSignal::NowMs();
+		ThreadStateLocker alock( m_Signal );
+
+		if( m_bStopping || Function == NULL || ( WheelTimer.m_pWheel != NULL && WheelTimer.m_pWheel != this ) )
+			return false;
+
+		if( WheelTimer.m_ppSlot != NULL )
+			Unlink( WheelTimer );
+
+		WheelTimer.m_pWheel = this;
+		WheelTimer.m_bDeferred = false;
+		WheelTimer.m_Function = Function;
+		WheelTimer.m_pParam = pParam;
+		WheelTimer.m_nPeriod = nPeriod;
+
+		//
+		// The current tick is already fired
+		//
+		WheelTimer.m_nExpiry = nNow + nDelay > m_nCurrent ? nNow + nDelay : m_nCurrent + 1;
+		Insert( WheelTimer );
+
+		//
+		// Wake the timer thread only if it sleeps past the new deadline
+		//
+		if( WheelTimer.m_nExpiry < m_nWakeAt )
+		{
+			m_nWakeAt = 0;
+			m_Signal.NotifyAll();
+		}
+		return true;
+	}
+
+	//!
+	//!	@brief	Cancels timer
+	//!	@param	WheelTimer Timer
+	//!	@param	bWait Wait for the callback call in progress, pass false from the timer's own callback
+	//!	@return	True if the timer was waiting
+	//!
+	bool Cancel( Timer & WheelTimer, bool bWait = true )
+	{
+		bool bScheduled;
+		{
+			ThreadStateLocker alock( m_Signal );
+			bScheduled = WheelTimer.m_ppSlot != NULL || WheelTimer.m_bDeferred;
+			if( WheelTimer.m_ppSlot != NULL )
+				Unlink( WheelTimer );
+			WheelTimer.m_bDeferred = false;
+		}
+
+		if( bWait )
+			WaitTaskGroup( &WheelTimer.m_Group );
+		return bScheduled;
+	}
+
+	//!
+	//!	@brief	Gets number of waiting timers
+	//!	@return	Count
+	//!
+	size_t GetTimerCount() const
+	{
+		ThreadStateLocker alock( m_Signal );
+		return m_nCount;
+	}
+
+private:
+	TimerWheel( const TimerWheel & );
+	TimerWheel & operator=( const TimerWheel & );
+
+	static inline unsigned int SlotIndex( unsigned long long nTick, unsigned int nLevel )
+	{
+		return (unsigned int) ( nTick >> ( nLevel * TW_SLOT_BITS ) ) & TW_SLOT_MASK;
+	}
+
+	//!
+	//!	@brief	Puts timer to the level its deadline falls in, lock must be held
+	//!
+	void Insert( Timer & WheelTimer )
+	{
+		unsigned int nLevel = 0;
+		unsigned int nSlot;
+
+		if( WheelTimer.m_nExpiry <= m_nCurrent )
+			nSlot = SlotIndex( m_nCurrent, 0 );
+		else
+		{
+			const unsigned long long nDelta = WheelTimer.m_nExpiry - m_nCurrent;
+			while( nLevel + 1 < TW_LEVELS && nDelta >= ( 1ULL << ( ( nLevel + 1 ) * TW_SLOT_BITS ) ) )
+				nLevel++;
+
+			//
+			// Past the last level: wait for its next turn and get re-sorted
+			//
+			if( nDelta >= ( 1ULL << ( TW_LEVELS * TW_SLOT_BITS ) ) )
+				nSlot = SlotIndex( m_nCurrent, nLevel );
+			else
+				nSlot = SlotIndex( WheelTimer.m_nExpiry, nLevel );
+		}
+
+		Timer ** ppSlot = &m_Slots[ nLevel ][ nSlot ];
+		WheelTimer.m_ppSlot = ppSlot;
+		WheelTimer.m_pPrev = NULL;
+		WheelTimer.m_pNext = *ppSlot;
+		if( *ppSlot != NULL )
+			(*ppSlot)->m_pPrev = &WheelTimer;
+		*ppSlot = &WheelTimer;
+		m_nCount++;
+	}
+
+	void Unlink( Timer & WheelTimer )
+	{
+		if( WheelTimer.m_pPrev != NULL )
+			WheelTimer.m_pPrev->m_pNext = WheelTimer.m_pNext;
+		else
+			*WheelTimer.m_ppSlot = WheelTimer.m_pNext;
+		if( WheelTimer.m_pNext != NULL )
+			WheelTimer.m_pNext->m_pPrev = WheelTimer.m_pPrev;
+
+		WheelTimer.m_ppSlot = NULL;
+		WheelTimer.m_pPrev = NULL;
+		WheelTimer.m_pNext = NULL;
+		m_nCount--;
+	}
+
+	//!
+	//!	@brief	Re-sorts a slot of an upper level into lower levels
+	//!
+	void Cascade( unsigned int nLevel, unsigned int nSlot )
+	{
+		//
+		// Detach the slot first, a deadline past the last level comes back to it
+		//
+		Timer * pTimer = m_Slots[ nLevel ][ nSlot ];
+		m_Slots[ nLevel ][ nSlot ] = NULL;
+
+		while( pTimer != NULL )
+		{
+			Timer * const pNext = pTimer->m_pNext;
+			m_nCount--;
+			Insert( *pTimer );
+			pTimer = pNext;
+		}
+	}
+
+	//!
+	//!	@brief	Takes timers of the current tick, reschedules periodic ones and defers one-shots still busy with their previous call
+	//!
+	void Expire()
+	{
+		Timer ** ppSlot = &m_Slots[ 0 ][ SlotIndex( m_nCurrent, 0 ) ];
+
+		//
+		// Detach the slot first, a periodic timer may come back to it
+		//
+		Timer * pTimer = *ppSlot;
+		*ppSlot = NULL;
+
+		while( pTimer != NULL )
+		{
+			Timer * const pNext = pTimer->m_pNext;
+			pTimer->m_ppSlot = NULL;
+			pTimer->m_pPrev = NULL;
+			pTimer->m_pNext = NULL;
+			m_nCount--;
+
+			//
+			// The previous call of this timer is still queued or running, e.g. it re-armed the timer itself
+			//
+			const bool bIdle = TryWaitTaskGroup( &pTimer->m_Group ) != 0;
+
+			if( pTimer->m_nPeriod != 0 )
+			{
+				pTimer->m_nExpiry += pTimer->m_nPeriod;
+				if( pTimer->m_nExpiry <= m_nCurrent )
+					pTimer->m_nExpiry = m_nCurrent + pTimer->m_nPeriod;
+				Insert( *pTimer );
+			}
+			else if( !bIdle )
+			{
+				//
+				// A one-shot is never lost, the running call makes it once more when it returns
+				//
+				pTimer->m_bDeferred = true;
+			}
+
+			if( bIdle )
+			{
+				AddTaskGroup( &pTimer->m_Group, 1 );
+				m_Expired.push_back( pTimer );
+			}
+			pTimer = pNext;
+		}
+	}
+
+	//!
+	//!	@brief	Moves the wheel to the time, lock must be held
+	//!
+	void Advance( unsigned long long nNow )
+	{
+		while( m_nCurrent < nNow )
+		{
+			if( m_nCount == 0 )
+			{
+				m_nCurrent = nNow;
+				break;
+			}
+
+			//
+			// Jump over empty ticks straight to the next slot to fire or cascade
+			//
+			if( m_Slots[ 0 ][ SlotIndex( m_nCurrent + 1, 0 ) ] == NULL )
+			{
+				const unsigned long long nNext = NextEvent();
+				if( nNext > nNow )
+				{
+					m_nCurrent = nNow;
+					break;
+				}
+				m_nCurrent = nNext - 1;
+			}
+
+			m_nCurrent++;
+			for( unsigned int nLevel = 1; nLevel < TW_LEVELS && SlotIndex( m_nCurrent, nLevel - 1 ) == 0; ++nLevel )
+				Cascade( nLevel, SlotIndex( m_nCurrent, nLevel ) );
+			Expire();
+		}
+	}
+
+	//!
+	//!	@brief	Gets the first tick something has to be done at, lock must be held
+	//!	@return	Tick, ~0 if there are no timers
+	//!
+	unsigned long long NextEvent() const
+	{
+		unsigned long long nNext = ~0ULL;
+
+		if( m_nCount == 0 )
+			return nNext;
+
+		for( unsigned int nLevel = 0; nLevel < TW_LEVELS; ++nLevel )
+		{
+			const unsigned int nShift = nLevel * TW_SLOT_BITS;
+			const unsigned long long nBase = m_nCurrent >> nShift;
+
+			for( unsigned int i = 1; i <= TW_SLOTS; ++i )
+			{
+				if( m_Slots[ nLevel ][ ( nBase + i ) & TW_SLOT_MASK ] != NULL )
+				{
+					//
+					// Level 0 slot fires at its tick, upper level slot is cascaded at the start of its span
+					//
+					const unsigned long long nTick = ( nBase + i ) << nShift;
+					if( nTick < nNext )
+						nNext = nTick;
+					break;
+				}
+			}
+		}
+		return nNext;
+	}
+
+	//!
+	//!	@brief	Queues expired timers as one pool batch
+	//!
+	void Fire()
+	{
+		SThreadPoolTask Tasks[ TW_FIRE_BATCH ];
+
+		for( size_t nFirst = 0; nFirst < m_Expired.size(); nFirst += TW_FIRE_BATCH )
+		{
+			const size_t nCount = m_Expired.size() - nFirst < TW_FIRE_BATCH ? m_Expired.size() - nFirst : TW_FIRE_BATCH;
+
+			for( size_t i = 0; i < nCount; ++i )
+			{
+				*(Timer **) AllocateTaskInline( m_pPool, &Tasks[ i ], sizeof(Timer *) ) = m_Expired[ nFirst + i ];
+				Tasks[ i ].m_pFunc = &FireTask;
+			}
+
+			//
+			// Rejected by a stopping pool: the calls are dropped
+			//
+			for( size_t i = PutTasksInQueueEx( m_pPool, Tasks, (unsigned long) nCount, m_nPriority ); i < nCount; ++i )
+			{
+				if( Tasks[ i ].m_pPars != TP_INLINE_PARS )
+					FreeTaskArg( Tasks[ i ].m_pPars );
+				DoneTaskGroup( &m_Expired[ nFirst + i ]->m_Group, 1 );
+			}
+		}
+		m_Expired.clear();
+	}
+
+	static void FireTask( void * pPars )
+	{
+		Timer * const pTimer = *(Timer **) pPars;
+		TimerWheel * const pWheel = pTimer->m_pWheel;
+
+		for( ;; )
+		{
+			( *pTimer->m_Function )( pTimer->m_pParam );
+
+			//
+			// Completing under the wheel lock, Expire then either defers the timer before this look or sees the call done.
+			// The timer may be destroyed right after this
+			//
+			ThreadStateLocker alock( pWheel->m_Signal );
+			if( !pTimer->m_bDeferred )
+			{
+				DoneTaskGroup( &pTimer->m_Group, 1 );
+				break;
+			}
+			pTimer->m_bDeferred = false;
+		}
+	}
+
+	int TimerThread()
+	{
+		{
+			ThreadStateLocker alock( m_Signal );
+
+			if( m_bStopping )
+				return 1;
+
+			Advance( ThreadStateSignal::NowMs() );
+
+			if( m_Expired.empty() )
+			{
+				//
+				// Park until the next event or an earlier new deadline
+				//
+				m_nWakeAt = NextEvent();
+				const unsigned long long nNow = ThreadStateSignal::NowMs();
+				if( m_nWakeAt == ~0ULL )
+					m_Signal.Wait();
+				else if( m_nWakeAt > nNow )
+					m_Signal.WaitFor( (unsigned long) ( m_nWakeAt - nNow ) );
+				m_nWakeAt = 0;
+				return 0;
+			}
+		}
+
+		Fire();
+		return 0;
+	}
+
+private:
+	SThreadPool *							m_pPool;						//!< Pool running timer callbacks
+	unsigned long							m_nPriority;					//!< Pool lane of timer callbacks
+	Timer *									m_Slots[ TW_LEVELS ][ TW_SLOTS ];	//!< Wheel levels
+	unsigned long long						m_nCurrent;						//!< Last processed tick
+	size_t									m_nCount;						//!< Waiting timers
+	unsigned long long						m_nWakeAt;						//!< Tick the parked timer thread wakes up at, 0 - not parked
+	bool									m_bStopping;					//!< Destructor is running
+	std::vector<Timer *>					m_Expired;						//!< Timers to fire, used by the timer thread only
+	ThreadStateSignal						m_Signal;						//!< Wheel lock, wakes the timer thread
+	CrossThreadNeighbor<TimerWheel>			m_Thread;						//!< Timer thread
+};
+
+inline TimerWheel::Timer::~Timer()
+{
+	if( m_pWheel != NULL )
+		m_pWheel->Cancel( *this );
+	else
+		WaitTaskGroup( &m_Group );
+}
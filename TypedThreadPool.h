@@ -0,0 +1,464 @@
+#pragma once
+#include <atomic>
+#include <exception>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include "ThreadPool.h"
+
+//
+// Typed C++ (C++11) front end of ThreadPool.
+// A callable is moved straight into the task argument. Submit puts it behind the state its future waits on, in one block
+// of the task argument allocator. Post keeps trivially copyable ones that fit TP_TASK_INLINE_SIZE inside the task itself
+// (THREAD_POOL_INLINE_TASK builds), others get an allocator block too.
+// The C function pointer of the task is a per type trampoline, so there is no std::function and no extra indirection
+//
+
+namespace TypedPoolDetail
+{
+	//!
+	//!	@brief	Result slot of a task
+	//!
+	template<typename _Result>
+	class TaskValue
+	{
+	public:
+		TaskValue():m_HasValue(false) {}
+		~TaskValue() { if( m_HasValue ) reinterpret_cast<_Result*>( &m_Storage )->~_Result(); }
+
+		template<typename _Callable>
+		inline void Invoke( _Callable & Function )
+		{
+			new( &m_Storage ) _Result( Function() );
+			m_HasValue = true;
+		}
+
+		inline _Result Take()
+		{
+			return std::move( *reinterpret_cast<_Result*>( &m_Storage ) );
+		}
+
+	private:
+		typename std::aligned_storage<sizeof(_Result), alignof(_Result)>::type	m_Storage;	//!< Result object
+		bool											m_HasValue;						//!< Result was constructed
+	};
+
+	//!
+	//!	@brief	Result slot of a task returning a reference, the referred object must outlive the future
+	//!
+	template<typename _Result>
+	class TaskValue<_Result &>
+	{
+	public:
+		TaskValue():m_pValue(NULL) {}
+
+		template<typename _Callable>
+		inline void Invoke( _Callable & Function ) { m_pValue = std::addressof( Function() ); }
+
+		inline _Result & Take() { return *m_pValue; }
+
+	private:
+		_Result *										m_pValue;						//!< Referred object
+	};
+
+	template<typename _Result>
+	class TaskValue<_Result &&>
+	{
+	public:
+		TaskValue():m_pValue(NULL) {}
+
+		template<typename _Callable>
+		inline void Invoke( _Callable & Function ) { _Result && Value = Function(); m_pValue = std::addressof( Value ); }
+
+		inline _Result && Take() { return std::move( *m_pValue ); }
+
+	private:
+		_Result *										m_pValue;						//!< Referred object
+	};
+
+	template<>
+	class TaskValue<void>
+	{
+	public:
+		template<typename _Callable>
+		inline void Invoke( _Callable & Function ) { Function(); }
+
+		inline void Take() {}
+	};
+
+	//!
+	//!	@brief	State shared by a task and its future, starts a task argument block
+	//!
+	template<typename _Result>
+	class TaskState
+	{
+	public:
+		//!
+		//!	@brief	Creates not completed state referenced by the task and by the future
+		//!	@param	Block Task argument block of at least sizeof(TaskState), the last reference frees it
+		//!
+		static TaskState * Create( void * Block )
+		{
+			static_assert( alignof(TaskState) <= 2 * sizeof(void*), "Task result is over-aligned" );
+			return new( Block ) TaskState();
+		}
+
+		inline void Release()
+		{
+			if( 1 == m_References.fetch_sub( 1, std::memory_order_acq_rel ) )
+			{
+				this->~TaskState();
+				FreeTaskArg( this );
+			}
+		}
+
+		//!
+		//!	@brief	Runs the task, an exception is kept for the waiter
+		//!
+		template<typename _Callable>
+		inline void Invoke( _Callable & Function )
+		{
+			try
+			{
+				m_Value.Invoke( Function );
+			}
+			catch( ... )
+			{
+				m_Exception = std::current_exception();
+			}
+		}
+
+		inline void Fail( std::exception_ptr Exception )
+		{
+			m_Exception = Exception;
+		}
+
+		//!
+		//!	@brief	Signals waiters and drops the reference of the task
+		//!
+		inline void Complete()
+		{
+			DoneTaskGroup( &m_Group, 1 );
+			Release();
+		}
+
+		inline STaskGroup * GetGroup() { return &m_Group; }
+
+		inline _Result Take()
+		{
+			if( m_Exception )
+				std::rethrow_exception( m_Exception );
+			return m_Value.Take();
+		}
+
+	private:
+		TaskState():m_References(2) { InitTaskGroup( &m_Group, 1 ); }
+
+	private:
+		STaskGroup										m_Group;						//!< Completion latch
+		std::atomic<long>								m_References;					//!< Task and future references
+		std::exception_ptr								m_Exception;					//!< Exception thrown by the task
+		TaskValue<_Result>								m_Value;						//!< Task result
+	};
+
+	//!
+	//!	@brief	Task argument of Submit: the state, then the callable, in one block
+	//!	@remark	The block is the task argument and the future's state at once, so it is put as TP_OWNED_PARS:
+	//!			the task drops its reference instead of the worker freeing it
+	//!
+	template<typename _Callable, typename _Result>
+	struct SubmitBox
+	{
+		typedef TaskState<_Result> State;
+
+		static const size_t FunctionOffset = ( sizeof(State) + alignof(_Callable) - 1 ) / alignof(_Callable) * alignof(_Callable);
+
+		//!
+		//!	@brief	Allocates the block and moves the callable into it
+		//!	@param	Function Callable
+		//!	@return	State referenced by the task and by the future
+		//!
+		template<typename _Func>
+		static State * Create( _Func && Function )
+		{
+			static_assert( alignof(_Callable) <= 2 * sizeof(void*), "Callable is over-aligned" );
+
+			void * const Block = AllocTaskArg( ( unsigned long )( FunctionOffset + sizeof(_Callable) ) );
+			try
+			{
+				new( static_cast<char*>( Block ) + FunctionOffset ) _Callable( std::forward<_Func>( Function ) );
+			}
+			catch( ... )
+			{
+				FreeTaskArg( Block );
+				throw;
+			}
+			return State::Create( Block );
+		}
+
+		static inline _Callable & GetFunction( void * Pars )
+		{
+			return *reinterpret_cast<_Callable*>( static_cast<char*>( Pars ) + FunctionOffset );
+		}
+
+		static void Run( void * Pars )
+		{
+			State * const pState = static_cast<State*>( Pars );
+			_Callable & Function = GetFunction( Pars );
+
+			//
+			// Captures are released before the waiter wakes up
+			//
+			pState->Invoke( Function );
+			Function.~_Callable();
+			pState->Complete();
+		}
+
+		static void Reject( void * Pars )
+		{
+			State * const pState = static_cast<State*>( Pars );
+
+			pState->Fail( std::make_exception_ptr( std::runtime_error( "Thread pool is stopping" ) ) );
+			GetFunction( Pars ).~_Callable();
+			pState->Complete();
+		}
+	};
+
+	//!
+	//!	@brief	Task argument of a fire-and-forget task
+	//!
+	template<typename _Callable>
+	struct PostBox
+	{
+		template<typename _Func>
+		explicit PostBox( _Func && Function ):m_Function(std::forward<_Func>(Function)) {}
+
+		static void Run( void * Pars )
+		{
+			PostBox * const Box = static_cast<PostBox*>( Pars );
+			try
+			{
+				Box->m_Function();
+			}
+			catch( ... )
+			{
+				//
+				// Nobody waits for the result, same as an exception leaving std::thread
+				//
+				std::terminate();
+			}
+			Box->~PostBox();
+		}
+
+		static void Reject( void * Pars )
+		{
+			static_cast<PostBox*>( Pars )->~PostBox();
+		}
+
+		_Callable										m_Function;						//!< User callable
+	};
+}
+
+//!
+//!	@brief	Typed result of a task submitted to TypedThreadPool
+//!	@remark	Move only. Dropping a future does not cancel the task
+//!
+template<typename _Result>
+class TaskFuture
+{
+public:
+	TaskFuture():m_State(NULL) {}
+	explicit TaskFuture( TypedPoolDetail::TaskState<_Result> * State ):m_State(State) {}
+	TaskFuture( TaskFuture && Other ):m_State(Other.m_State) { Other.m_State = NULL; }
+
+	TaskFuture & operator=( TaskFuture && Other )
+	{
+		if( this != &Other )
+		{
+			if( m_State )
+				m_State->Release();
+			m_State = Other.m_State;
+			Other.m_State = NULL;
+		}
+		return *this;
+	}
+
+	~TaskFuture()
+	{
+		if( m_State )
+			m_State->Release();
+	}
+
+	TaskFuture( const TaskFuture & ) = delete;
+	TaskFuture & operator=( const TaskFuture & ) = delete;
+
+	//!
+	//!	@brief	Checks if the future refers to a task
+	//!	@return	True/false
+	//!
+	inline bool Valid() const { return m_State != NULL; }
+
+	//!
+	//!	@brief	Checks if the task has completed without blocking
+	//!	@return	True/false
+	//!
+	inline bool TryWait() const { return 0 != TryWaitTaskGroup( m_State->GetGroup() ); }
+
+	//!
+	//!	@brief	Waits until the task has completed
+	//!
+	inline void Wait() const { WaitTaskGroup( m_State->GetGroup() ); }
+
+	//!
+	//!	@brief	Waits until the task has completed
+	//!	@param	Milliseconds Time out
+	//!	@return	False on time out
+	//!
+	inline bool WaitFor( unsigned long Milliseconds ) const { return 0 != WaitTaskGroupTimeout( m_State->GetGroup(), Milliseconds ); }
+
+	//!
+	//!	@brief	Waits for the task and takes its result
+	//!	@return	Result, moved out - call once
+	//!	@throw	Exception thrown by the task, std::runtime_error if the pool was stopping
+	//!
+	inline _Result Get()
+	{
+		Wait();
+		return m_State->Take();
+	}
+
+private:
+	TypedPoolDetail::TaskState<_Result> *				m_State;						//!< Shared state
+};
+
+//!
+//!	@brief	Thread pool taking any (move-only) C++ callable
+//!	@remark	A worker waiting for a future of the same pool holds that worker. Keep such nesting shallower than the pool
+//!
+class TypedThreadPool
+{
+public:
+	//!
+	//!	@brief	Constructor
+	//!	@param	ThreadCount Number of workers, 0 - one per available CPU
+	//!	@param	MaxQueueSize Queue bound, 0 - unbounded
+	//!
+	explicit TypedThreadPool( unsigned long ThreadCount = 0, unsigned long MaxQueueSize = 0 )
+	{
+		AllocThreadPool( &m_Pool, ThreadCount, MaxQueueSize );
+	}
+
+	//!
+	//!	@brief	Constructor
+	//!	@param	Params Full pool parameters
+	//!
+	explicit TypedThreadPool( const SThreadPoolParams & Params )
+	{
+		AllocThreadPoolEx( &m_Pool, &Params );
+	}
+
+	//!
+	//!	@brief	Waits for all tasks and stops workers
+	//!
+	~TypedThreadPool()
+	{
+		FreeThreadPool( &m_Pool );
+	}
+
+	TypedThreadPool( const TypedThreadPool & ) = delete;
+	TypedThreadPool & operator=( const TypedThreadPool & ) = delete;
+
+	//!
+	//!	@brief	Queues a callable
+	//!	@param	Function Callable without arguments, moved into the task
+	//!	@return	Future of the callable result
+	//!
+	template<typename _Func>
+	TaskFuture<decltype( std::declval<typename std::decay<_Func>::type &>()() )> Submit( _Func && Function )
+	{
+		typedef typename std::decay<_Func>::type Callable;
+		typedef decltype( std::declval<Callable &>()() ) Result;
+		typedef TypedPoolDetail::SubmitBox<Callable, Result> Box;
+
+		SThreadPoolTask task = SThreadPoolTask();
+		typename Box::State * const pState = Box::Create( std::forward<_Func>( Function ) );
+
+		task.m_pFunc = &Box::Run;
+		task.m_pPars = TP_OWNED_PARS( pState );
+		if( 0 == PutTasksInQueue( &m_Pool, &task, 1 ) )
+			Box::Reject( pState );
+		return TaskFuture<Result>( pState );
+	}
+
+	//!
+	//!	@brief	Queues a callable nobody waits for
+	//!	@param	Function Callable without arguments, moved into the task
+	//!	@return	False if the pool is stopping
+	//!	@remark	An exception leaving the callable terminates the process, use Submit to receive it
+	//!
+	template<typename _Func>
+	bool Post( _Func && Function )
+	{
+		typedef TypedPoolDetail::PostBox<typename std::decay<_Func>::type> Box;
+
+		SThreadPoolTask task;
+		void * pPars = AllocateBox<Box>( task );
+
+		try
+		{
+			new( pPars ) Box( std::forward<_Func>( Function ) );
+		}
+		catch( ... )
+		{
+			FreeBox( task );
+			throw;
+		}
+
+		task.m_pFunc = &Box::Run;
+		if( 0 != PutTasksInQueue( &m_Pool, &task, 1 ) )
+			return true;
+
+		Box::Reject( pPars );
+		FreeBox( task );
+		return false;
+	}
+
+	//!
+	//!	@brief	Waits until the queue is empty and all workers are idle
+	//!
+	inline void JoinAll() { ThreadPoolJoinAll( &m_Pool ); }
+
+	//!
+	//!	@brief	Access to the underlying C pool
+	//!	@return	Pool
+	//!
+	inline SThreadPool * GetPool() { return &m_Pool; }
+
+private:
+	//!
+	//!	@brief	Gets storage for a task argument
+	//!	@remark	Only trivially copyable boxes may be kept inline: the queue copies tasks byte by byte
+	//!
+	template<typename _Box>
+	void * AllocateBox( SThreadPoolTask & task )
+	{
+		static_assert( alignof(_Box) <= 2 * sizeof(void*), "Callable is over-aligned" );
+
+		if( std::is_trivially_copyable<_Box>::value && alignof(_Box) <= alignof(double) )
+			return AllocateTaskInline( &m_Pool, &task, sizeof(_Box) );
+
+		AllocateTaskEx( &m_Pool, &task, sizeof(_Box) );
+		return task.m_pPars;
+	}
+
+	inline void FreeBox( SThreadPoolTask & task )
+	{
+		if( task.m_pPars != TP_INLINE_PARS )
+			FreeTaskArg( task.m_pPars );
+	}
+
+private:
+	SThreadPool											m_Pool;							//!< C thread pool
+};
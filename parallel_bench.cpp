@@ -0,0 +1,254 @@
+//
+// Parallel algorithms benchmark: ParallelFor, ParallelReduce, ParallelScan and ParallelSort against the serial loops,
+// every parallel result is checked against the serial one.
+// A staged job with uneven stage tails: barriers between stages against a TaskGraph releasing each node on its own.
+// Small tasks with results: a hand-rolled C argument struct against TypedThreadPool::Submit and its futures
+//
+#include "ParallelAlgorithms.h"
+#include "TaskGraph.h"
+#include "TypedThreadPool.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <vector>
+
+#ifndef USE_PTHREAD_THREAD_FORCE
+static double GetSeconds()
+{
+	LARGE_INTEGER liFreq, liCounter;
+	QueryPerformanceFrequency( &liFreq );
+	QueryPerformanceCounter( &liCounter );
+	return (double) liCounter.QuadPart / (double) liFreq.QuadPart;
+}
+#else
+static double GetSeconds()
+{
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+#endif
+
+static void Report( const char * szName, double dSerial, double dParallel, bool bSame )
+{
+	printf( "%s: serial %.1f ms, parallel %.1f ms, speed-up %.2f%s\n", szName, dSerial * 1e3, dParallel * 1e3, dSerial / dParallel, bSame ? "" : ", RESULT MISMATCH" );
+}
+
+static void BenchFor( SThreadPool * Pool, const std::vector<double> & Input )
+{
+	std::vector<double> Serial( Input.size() ), Parallel( Input.size() );
+	double dStart, dSerial;
+
+	dStart = GetSeconds();
+	for( size_t i = 0; i < Input.size(); ++i )
+		Serial[ i ] = sqrt( Input[ i ] ) * log( 1.0 + Input[ i ] );
+	dSerial = GetSeconds() - dStart;
+
+	dStart = GetSeconds();
+	ParallelFor( Pool, (size_t) 0, Input.size(), [&]( size_t Begin, size_t End )
+	{
+		for( size_t i = Begin; i < End; ++i )
+			Parallel[ i ] = sqrt( Input[ i ] ) * log( 1.0 + Input[ i ] );
+	} );
+	Report( "for", dSerial, GetSeconds() - dStart, Serial == Parallel );
+}
+
+static void BenchReduce( SThreadPool * Pool, const std::vector<double> & Input )
+{
+	double dStart, dSerial, dSum = 0, dParallelSum;
+
+	dStart = GetSeconds();
+	for( size_t i = 0; i < Input.size(); ++i )
+		dSum += sqrt( Input[ i ] );
+	dSerial = GetSeconds() - dStart;
+
+	dStart = GetSeconds();
+	dParallelSum = ParallelReduce( Pool, (size_t) 0, Input.size(), 0.0, [&]( size_t Begin, size_t End, double dValue )
+	{
+		for( size_t i = Begin; i < End; ++i )
+			dValue += sqrt( Input[ i ] );
+		return dValue;
+	}, std::plus<double>() );
+
+	//
+	// Chunks add in a different order
+	//
+	Report( "reduce", dSerial, GetSeconds() - dStart, fabs( dSum - dParallelSum ) <= 1e-9 * fabs( dSum ) );
+}
+
+static void BenchScan( SThreadPool * Pool, const std::vector<unsigned int> & Input )
+{
+	std::vector<unsigned long long> Serial( Input.size() ), Parallel( Input.size() );
+	unsigned long long nSum = 0;
+	double dStart, dSerial;
+
+	dStart = GetSeconds();
+	for( size_t i = 0; i < Input.size(); ++i )
+		Serial[ i ] = nSum += Input[ i ];
+	dSerial = GetSeconds() - dStart;
+
+	dStart = GetSeconds();
+	ParallelScan( Pool, Input.begin(), Input.end(), Parallel.begin(), 0ULL, std::plus<unsigned long long>() );
+	Report( "scan", dSerial, GetSeconds() - dStart, Serial == Parallel );
+}
+
+static void BenchSort( SThreadPool * Pool, const std::vector<unsigned int> & Input )
+{
+	std::vector<unsigned int> Serial( Input ), Parallel( Input );
+	double dStart, dSerial;
+
+	dStart = GetSeconds();
+	std::stable_sort( Serial.begin(), Serial.end() );
+	dSerial = GetSeconds() - dStart;
+
+	dStart = GetSeconds();
+	ParallelSort( Pool, Parallel.begin(), Parallel.end() );
+	Report( "sort", dSerial, GetSeconds() - dStart, Serial == Parallel );
+}
+
+static void Spin( double dSeconds )
+{
+	const double dEnd = GetSeconds() + dSeconds;
+	while( GetSeconds() < dEnd )
+		;
+}
+
+static void SpinTask( void * pPars )
+{
+	Spin( *(double *) pPars );
+}
+
+//
+// nChains chains of nStages nodes, node s of a chain needs node s - 1 of the same chain. One node per stage is 8 times longer
+//
+static void BenchGraph( SThreadPool * Pool, size_t nChains, size_t nStages, size_t nRuns )
+{
+	std::vector<double> Durations( nChains * nStages );
+	std::vector<TaskGraph::NodeId> Path;
+	TaskGraph Graph( Pool );
+	double dStart, dBarrier, dGraph, dPath;
+	size_t i, k, nRun;
+
+	for( k = 0; k < nStages; ++k )
+	{
+		for( i = 0; i < nChains; ++i )
+			Durations[ k * nChains + i ] = ( i == k % nChains ? 8 : 1 ) * 100e-6;
+	}
+
+	dStart = GetSeconds();
+	for( nRun = 0; nRun < nRuns; ++nRun )
+	{
+		for( k = 0; k < nStages; ++k )
+		{
+			for( i = 0; i < nChains; ++i )
+			{
+				SThreadPoolTask task;
+				AllocateTask( Pool, &task );
+				task.m_pFunc = SpinTask;
+				*(double *) task.m_pPars = Durations[ k * nChains + i ];
+				PutTaskInQueue( Pool, &task );
+			}
+			ThreadPoolJoinAll( Pool );
+		}
+	}
+	dBarrier = GetSeconds() - dStart;
+
+	for( k = 0; k < nStages; ++k )
+	{
+		for( i = 0; i < nChains; ++i )
+		{
+			const double dDuration = Durations[ k * nChains + i ];
+			const TaskGraph::NodeId Id = Graph.AddNode( [dDuration]() { Spin( dDuration ); } );
+			if( k != 0 )
+				Graph.AddEdge( Id - nChains, Id );
+		}
+	}
+	if( !Graph.Build() )
+		printf( "graph has a cycle\n" );
+
+	dStart = GetSeconds();
+	for( nRun = 0; nRun < nRuns; ++nRun )
+		Graph.Run();
+	dGraph = GetSeconds() - dStart;
+	dPath = Graph.GetCriticalPath( Path ) * 1e-9;
+
+	printf( "%lu chains x %lu stages: barriers %.2f ms/run, graph %.2f ms/run, critical path of the last run %.2f ms over %lu nodes\n", (unsigned long) nChains, (unsigned long) nStages,
+		dBarrier * 1e3 / nRuns, dGraph * 1e3 / nRuns, dPath * 1e3, (unsigned long) Path.size() );
+}
+
+struct SSquareTask
+{
+	const unsigned int *		m_pInput;
+	unsigned long long *		m_pOutput;
+};
+
+static void SquareTask( void * pPars )
+{
+	const SSquareTask * const pTask = (const SSquareTask *) pPars;
+	*pTask->m_pOutput = (unsigned long long) *pTask->m_pInput * *pTask->m_pInput;
+}
+
+static void BenchSubmit( unsigned long nThreads, const std::vector<unsigned int> & Input, size_t nTasks )
+{
+	std::vector<unsigned long long> Serial( nTasks ), Parallel( nTasks );
+	std::vector< TaskFuture<unsigned long long> > Futures;
+	TypedThreadPool Typed( nThreads );
+	double dStart, dTasks;
+	size_t i;
+
+	dStart = GetSeconds();
+	for( i = 0; i < nTasks; ++i )
+	{
+		SThreadPoolTask task;
+		AllocateTaskEx( Typed.GetPool(), &task, sizeof( SSquareTask ) );
+		task.m_pFunc = SquareTask;
+		( (SSquareTask *) task.m_pPars )->m_pInput = &Input[ i ];
+		( (SSquareTask *) task.m_pPars )->m_pOutput = &Serial[ i ];
+		PutTaskInQueue( Typed.GetPool(), &task );
+	}
+	Typed.JoinAll();
+	dTasks = GetSeconds() - dStart;
+
+	dStart = GetSeconds();
+	Futures.reserve( nTasks );
+	for( i = 0; i < nTasks; ++i )
+	{
+		const unsigned int nValue = Input[ i ];
+		Futures.push_back( Typed.Submit( [nValue]() { return (unsigned long long) nValue * nValue; } ) );
+	}
+	for( i = 0; i < nTasks; ++i )
+		Parallel[ i ] = Futures[ i ].Get();
+
+	printf( "%lu small tasks: C tasks %.1f ms, Submit and Get %.1f ms%s\n", (unsigned long) nTasks, dTasks * 1e3, ( GetSeconds() - dStart ) * 1e3,
+		Serial == Parallel ? "" : ", RESULT MISMATCH" );
+}
+
+int main()
+{
+	const size_t nCount = 10000000;
+	std::vector<double> Doubles( nCount );
+	std::vector<unsigned int> Integers( nCount );
+	SThreadPool Pool;
+
+	srand( 1 );
+	for( size_t i = 0; i < nCount; ++i )
+	{
+		Integers[ i ] = ( (unsigned int) rand() << 16 ) ^ (unsigned int) rand();
+		Doubles[ i ] = Integers[ i ] * ( 1.0 / 4294967296.0 );
+	}
+
+	//
+	// The calling thread works too, so the pool gets one worker less than there are CPUs
+	//
+	AllocThreadPool( &Pool, GetAvailableCpuCount() > 1 ? GetAvailableCpuCount() - 1 : 1, 0 );
+	BenchFor( &Pool, Doubles );
+	BenchReduce( &Pool, Doubles );
+	BenchScan( &Pool, Integers );
+	BenchSort( &Pool, Integers );
+	BenchGraph( &Pool, 8, 8, 20 );
+	FreeThreadPool( &Pool );
+	BenchSubmit( GetAvailableCpuCount(), Integers, 1000000 );
+	return 0;
+}
@@ -0,0 +1,268 @@
+/*
+ * Thread pool throughput benchmark.
+ * Build it twice, with and without THREAD_POOL_LOCKFREE_QUEUE, to compare the locked SQueue with the lock-free ring
+ */
+#include "ThreadPool.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#ifndef USE_PTHREAD_THREAD_FORCE
+static double GetSeconds( void )
+{
+    LARGE_INTEGER liFreq, liCounter;
+    QueryPerformanceFrequency( &liFreq );
+    QueryPerformanceCounter( &liCounter );
+    return ( double )liCounter.QuadPart / ( double )liFreq.QuadPart;
+}
+#else
+#include <time.h>
+static double GetSeconds( void )
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ( double )ts.tv_sec + ( double )ts.tv_nsec * 1e-9;
+}
+#endif
+
+#ifdef THREAD_POOL_LOCKFREE_QUEUE
+#define BENCH_QUEUE_NAME "ring"
+#else
+#define BENCH_QUEUE_NAME "locked"
+#endif
+
+#define BENCH_MAX_BATCH 64
+
+typedef struct SBenchProducer
+{
+    SThreadPool* m_pTarget;
+    unsigned long m_ulTasks;
+    unsigned long m_ulBatch;
+} SBenchProducer;
+
+static void EmptyTask( void* pPars )
+{
+    ( void )pPars;
+}
+
+static void ProduceTasks( void* pPars )
+{
+    const SBenchProducer* pProducer = *( SBenchProducer** )pPars;
+    SThreadPoolTask tasks[ BENCH_MAX_BATCH ];
+    unsigned long i;
+
+    for( i = 0; i < BENCH_MAX_BATCH; ++i )
+    {
+        tasks[ i ].m_pFunc = EmptyTask;
+        tasks[ i ].m_pPars = NULL;
+    }
+
+    if( 1 == pProducer->m_ulBatch )
+    {
+        for( i = 0; i < pProducer->m_ulTasks; ++i )
+            PutTaskInQueue( pProducer->m_pTarget, tasks );
+    }
+    else
+    {
+        for( i = 0; i < pProducer->m_ulTasks; i += pProducer->m_ulBatch )
+            PutTasksInQueue( pProducer->m_pTarget, tasks, pProducer->m_ulBatch );
+    }
+}
+
+static void BenchQueueOps( unsigned long ulOps )
+{
+    SQueue queue;
+    SRingQueue ring;
+    SThreadPoolTask task;
+    unsigned long i;
+    double dStart, dQueue, dRing;
+
+    memset( &task, 0, sizeof( task ) );
+    task.m_pFunc = EmptyTask;
+    AllocQueue( &queue );
+    dStart = GetSeconds();
+    for( i = 0; i < ulOps; ++i )
+    {
+        PushQueue( &queue, &task );
+        PopQueue( &queue, &task );
+    }
+    dQueue = GetSeconds() - dStart;
+    FreeQueue( &queue );
+
+    AllocRingQueue( &ring, 1024 );
+    dStart = GetSeconds();
+    for( i = 0; i < ulOps; ++i )
+    {
+        PushRingQueue( &ring, &task );
+        PopRingQueue( &ring, &task );
+    }
+    dRing = GetSeconds() - dStart;
+    FreeRingQueue( &ring );
+
+    printf( "single thread push+pop: SQueue %.1f ns/op, SRingQueue %.1f ns/op\n", dQueue * 1e9 / ulOps, dRing * 1e9 / ulOps );
+}
+
+static void BenchPool( unsigned long ulProducers, unsigned long ulWorkers, unsigned long ulTasks, unsigned long ulBatch )
+{
+    SThreadPool target, producers;
+    SBenchProducer producer;
+    SThreadPoolTask task;
+    unsigned long i;
+    double dStart, dElapsed;
+
+    AllocThreadPool( &target, ulWorkers, 1024 );
+    AllocThreadPool( &producers, ulProducers, ulProducers );
+    producer.m_pTarget = &target;
+    producer.m_ulTasks = ulTasks / ulProducers / ulBatch * ulBatch;
+    producer.m_ulBatch = ulBatch;
+
+    dStart = GetSeconds();
+    for( i = 0; i < ulProducers; ++i )
+    {
+        AllocateTask( &producers, &task );
+        task.m_pFunc = ProduceTasks;
+        *( SBenchProducer** )task.m_pPars = &producer;
+        PutTaskInQueue( &producers, &task );
+    }
+    ThreadPoolJoinAll( &producers );
+    ThreadPoolJoinAll( &target );
+    dElapsed = GetSeconds() - dStart;
+
+    printf( "%s producers=%lu workers=%lu batch=%lu %.0f tasks/sec\n", BENCH_QUEUE_NAME, ulProducers, ulWorkers, ulBatch, ( double )( producer.m_ulTasks * ulProducers ) / dElapsed );
+
+    FreeThreadPool( &producers );
+    FreeThreadPool( &target );
+}
+
+static void BusyTask( void* pPars )
+{
+    const double dEnd = GetSeconds() + 20e-6;
+    ( void )pPars;
+    while( GetSeconds() < dEnd )
+        ;
+}
+
+/* Latency of a trickle of high priority tasks behind a flood of background ones, per lane wait percentiles */
+static void BenchLanes( unsigned long ulWorkers, unsigned long ulTasks )
+{
+    SThreadPool pool;
+    SThreadPoolParams params;
+    SThreadPoolLaneCounters counters;
+    SThreadPoolTask tasks[ BENCH_MAX_BATCH ];
+    unsigned long i;
+
+    InitThreadPoolParams( &params );
+    params.m_ulThreadPoolSize = ulWorkers;
+    params.m_ulMaxQueueSize = 0;
+    params.m_ulPriorityLanes = TP_PRIORITY_LANES;
+    params.m_ulStarvationLimit = 64;
+    AllocThreadPoolEx( &pool, &params );
+
+    for( i = 0; i < BENCH_MAX_BATCH; ++i )
+    {
+        tasks[ i ].m_pFunc = BusyTask;
+        tasks[ i ].m_pPars = NULL;
+    }
+
+    for( i = 0; i < ulTasks; i += BENCH_MAX_BATCH )
+    {
+        PutTasksInQueueEx( &pool, tasks, BENCH_MAX_BATCH, TP_PRIORITY_BACKGROUND );
+        PutTaskInQueueEx( &pool, tasks, TP_PRIORITY_HIGH );
+    }
+    ThreadPoolJoinAll( &pool );
+
+    for( i = 0; i < TP_PRIORITY_LANES; ++i )
+    {
+        GetThreadPoolLaneCounters( &pool, i, &counters );
+        if( 0 != counters.m_ulDequeued )
+            printf( "%s lane=%lu tasks=%lu wait p50<%luus p99<%luus\n", BENCH_QUEUE_NAME, i, counters.m_ulDequeued, counters.m_ulWaitP50Us, counters.m_ulWaitP99Us );
+    }
+    FreeThreadPool( &pool );
+}
+
+/* Bursts of single puts into an idle pool: wake-ups sent per burst and burst completion time */
+static void BenchBursts( unsigned long ulWorkers, unsigned long ulBursts )
+{
+    SThreadPool pool;
+    SThreadPoolCounters counters;
+    SThreadPoolTask task;
+    unsigned long i, j;
+    double dStart, dElapsed = 0;
+
+    memset( &task, 0, sizeof( task ) );
+    task.m_pFunc = BusyTask;
+    AllocThreadPool( &pool, ulWorkers, 0 );
+    for( i = 0; i < ulBursts; ++i )
+    {
+        dStart = GetSeconds();
+        for( j = 0; j < 4 * ulWorkers; ++j )
+            PutTaskInQueue( &pool, &task );
+        ThreadPoolJoinAll( &pool );
+        dElapsed += GetSeconds() - dStart;
+    }
+    GetThreadPoolCounters( &pool, &counters );
+
+    printf( "%s bursts of %lu tasks, workers=%lu: %.1f wake-ups/burst, %.0f us/burst\n", BENCH_QUEUE_NAME, 4 * ulWorkers, ulWorkers,
+        ( double )counters.m_ulWakeups / ulBursts, dElapsed * 1e6 / ulBursts );
+    FreeThreadPool( &pool );
+}
+
+/* Throughput with and without TPF_COLLECT_STATS, then the snapshot of the counting pool */
+static void BenchStats( unsigned long ulWorkers, unsigned long ulTasks )
+{
+    SThreadPool pool;
+    SThreadPoolParams params;
+    SThreadPoolStats stats;
+    SThreadPoolTask tasks[ BENCH_MAX_BATCH ];
+    unsigned long i, ulFlags;
+    double dStart;
+
+    for( i = 0; i < BENCH_MAX_BATCH; ++i )
+    {
+        tasks[ i ].m_pFunc = EmptyTask;
+        tasks[ i ].m_pPars = NULL;
+    }
+
+    for( ulFlags = 0; ulFlags <= TPF_COLLECT_STATS; ulFlags += TPF_COLLECT_STATS )
+    {
+        InitThreadPoolParams( &params );
+        params.m_ulThreadPoolSize = ulWorkers;
+        params.m_ulMaxQueueSize = 1024;
+        params.m_ulFlags = ulFlags;
+        AllocThreadPoolEx( &pool, &params );
+
+        dStart = GetSeconds();
+        for( i = 0; i < ulTasks; i += BENCH_MAX_BATCH )
+            PutTasksInQueue( &pool, tasks, BENCH_MAX_BATCH );
+        ThreadPoolJoinAll( &pool );
+        printf( "%s stats=%d %.0f tasks/sec\n", BENCH_QUEUE_NAME, 0 != ulFlags, ( double )ulTasks / ( GetSeconds() - dStart ) );
+
+        if( 0 != ulFlags )
+        {
+            GetThreadPoolStats( &pool, &stats );
+            printf( "%s executed=%lu stolen=%lu parks=%lu wakes=%lu idle=%luus put waits=%lu (%luus)\n", BENCH_QUEUE_NAME, stats.m_ulExecuted, stats.m_ulStolen,
+                stats.m_ulParks, stats.m_ulWakes, stats.m_ulIdleUs, stats.m_ulPutWaits, stats.m_ulPutWaitUs );
+            printf( "%s sojourn p50<%luus p99<%luus p99.9<%luus, run p50<%luns p99<%luns p99.9<%luns\n", BENCH_QUEUE_NAME, stats.m_ulSojournP50Us, stats.m_ulSojournP99Us,
+                stats.m_ulSojournP999Us, stats.m_ulRunP50Ns, stats.m_ulRunP99Ns, stats.m_ulRunP999Ns );
+        }
+        FreeThreadPool( &pool );
+    }
+}
+
+int main( void )
+{
+    const unsigned long ulTasks = 1000000;
+    const unsigned long ulWorkers = GetAvailableCpuCount();
+    unsigned long ulProducers;
+
+    BenchQueueOps( 10000000 );
+    for( ulProducers = 1; ulProducers <= 2 * ulWorkers; ulProducers *= 2 )
+    {
+        BenchPool( ulProducers, ulWorkers, ulTasks, 1 );
+        BenchPool( ulProducers, ulWorkers, ulTasks, BENCH_MAX_BATCH );
+    }
+    BenchLanes( ulWorkers, 20000 );
+    BenchBursts( ulWorkers, 1000 );
+    BenchStats( ulWorkers, ulTasks );
+    return 0;
+}
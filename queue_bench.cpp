@@ -0,0 +1,562 @@
+//
+// Queue benchmark: producers x consumers x queue type x payload size sweep without the service framework.
+// Every run reports throughput, enqueue to dequeue latency percentiles of every LATENCY_SAMPLE-th item
+// (log-linear histogram, 1/16 relative precision) and process CPU time per item.
+// queue_bench [-csv] [-items N] [-capacity N] [-threads 1,2,4]
+// -csv prints one comma separated row per run for regression tracking
+//
+#include "CrossThread.h"
+#include "ThreadPool.h"
+#include "cpl/CriticalSection.h"
+#include "cpl/Containers/SafeUnboundedQueue.h"
+#include "cpl/Containers/SafeBoundedQueue.h"
+#include "SpscQueue.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#ifdef USE_PTHREAD_THREAD_FORCE
+#include <sched.h>
+#include <sys/resource.h>
+#endif
+
+#define LATENCY_SAMPLE 64
+#define POISON_STAMP (~0ULL)
+
+#ifndef USE_PTHREAD_THREAD_FORCE
+static double GetSeconds()
+{
+	LARGE_INTEGER liFreq, liCounter;
+	QueryPerformanceFrequency( &liFreq );
+	QueryPerformanceCounter( &liCounter );
+	return (double) liCounter.QuadPart / (double) liFreq.QuadPart;
+}
+
+static double GetCpuSeconds()
+{
+	FILETIME ftCreate, ftExit, ftKernel, ftUser;
+	GetProcessTimes( GetCurrentProcess(), &ftCreate, &ftExit, &ftKernel, &ftUser );
+	return ( ( (unsigned long long) ftKernel.dwHighDateTime << 32 | ftKernel.dwLowDateTime ) +
+		( (unsigned long long) ftUser.dwHighDateTime << 32 | ftUser.dwLowDateTime ) ) * 1e-7;
+}
+
+static inline void BenchYield() { SwitchToThread(); }
+#else
+static double GetSeconds()
+{
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+static double GetCpuSeconds()
+{
+	struct rusage ru;
+	getrusage( RUSAGE_SELF, &ru );
+	return (double) ( ru.ru_utime.tv_sec + ru.ru_stime.tv_sec ) + (double) ( ru.ru_utime.tv_usec + ru.ru_stime.tv_usec ) * 1e-6;
+}
+
+static inline void BenchYield() { sched_yield(); }
+#endif
+
+static inline unsigned long long GetNanoseconds()
+{
+	return (unsigned long long) ( GetSeconds() * 1e9 );
+}
+
+//!
+//!	@brief	Log-linear latency histogram: 16 linear sub-buckets per power of two
+//!
+class LatencyHistogram
+{
+public:
+	enum
+	{
+		SubBits								= 4,
+		SubCount							= 1 << SubBits,
+		Buckets								= ( 64 - SubBits + 1 ) * SubCount
+	};
+
+public:
+	LatencyHistogram():m_nCount(0),m_nMax(0) { memset( m_Counts, 0, sizeof(m_Counts) ); }
+
+	inline void Record( unsigned long long nValue )
+	{
+		m_Counts[ Index( nValue ) ]++;
+		m_nCount++;
+		if( nValue > m_nMax )
+			m_nMax = nValue;
+	}
+
+	void Merge( const LatencyHistogram & Other )
+	{
+		for( unsigned int i = 0; i < Buckets; ++i )
+			m_Counts[ i ] += Other.m_Counts[ i ];
+		m_nCount += Other.m_nCount;
+		if( Other.m_nMax > m_nMax )
+			m_nMax = Other.m_nMax;
+	}
+
+	//!
+	//!	@brief	Gets percentile
+	//!	@param	dPercent Percent, 0..100
+	//!	@return	Highest value of the bucket the percentile falls in
+	//!
+	unsigned long long GetPercentile( double dPercent ) const
+	{
+		const unsigned long long nRank = (unsigned long long) ( m_nCount * dPercent / 100.0 );
+		unsigned long long nSeen = 0;
+
+		for( unsigned int i = 0; i < Buckets; ++i )
+		{
+			nSeen += m_Counts[ i ];
+			if( nSeen > nRank )
+				return LowerBound( i + 1 ) - 1 < m_nMax ? LowerBound( i + 1 ) - 1 : m_nMax;
+		}
+		return m_nMax;
+	}
+
+	inline unsigned long long GetCount() const { return m_nCount; }
+	inline unsigned long long GetMax() const { return m_nMax; }
+
+private:
+	static unsigned int Index( unsigned long long nValue )
+	{
+		if( nValue < 2 * SubCount )
+			return (unsigned int) nValue;
+
+		unsigned int nMsb = 0;
+		for( unsigned long long n = nValue; n > 1; n >>= 1 )
+			nMsb++;
+
+		const unsigned int nShift = nMsb - SubBits;
+		return ( nShift + 1 ) * SubCount + (unsigned int) ( ( nValue >> nShift ) - SubCount );
+	}
+
+	static unsigned long long LowerBound( unsigned int nIndex )
+	{
+		if( nIndex < 2 * SubCount )
+			return nIndex;
+
+		const unsigned int nShift = nIndex / SubCount - 1;
+		if( nShift + SubBits >= 64 )
+			return ~0ULL;
+		return (unsigned long long) ( nIndex % SubCount + SubCount ) << nShift;
+	}
+
+private:
+	unsigned long long						m_Counts[ Buckets ];			//!< Samples per bucket
+	unsigned long long						m_nCount;						//!< Samples
+	unsigned long long						m_nMax;							//!< Largest sample
+};
+
+//!
+//!	@brief	Queue item with payload of _Size bytes, first 8 bytes hold the enqueue time
+//!
+template<size_t _Size>
+struct BenchItem
+{
+	unsigned long long						m_nStamp;						//!< Enqueue time, ns; 0 - not sampled
+	char									m_Data[ _Size - sizeof(unsigned long long) ];	//!< Payload
+};
+
+template<size_t _Size>
+static inline void SetStamp( BenchItem<_Size> & Item, unsigned long long nStamp ) { Item.m_nStamp = nStamp; }
+
+template<size_t _Size>
+static inline unsigned long long GetStamp( const BenchItem<_Size> & Item ) { return Item.m_nStamp; }
+
+//
+// C queues carry thread pool tasks, the stamp travels in the argument pointer
+//
+static inline void SetStamp( SThreadPoolTask & Item, unsigned long long nStamp ) { Item.m_pPars = (void *) (size_t) nStamp; }
+static inline unsigned long long GetStamp( const SThreadPoolTask & Item ) { return (unsigned long long) (size_t) Item.m_pPars; }
+
+//
+// Queue adapters: Push/Pop return false on full/empty, Max* limit the thread sweep for single producer/consumer queues
+//
+
+template<typename _Item>
+class UnboundedQueueBench
+{
+public:
+	enum { MaxProducers = 0xFFFF, MaxConsumers = 0xFFFF };
+
+	explicit UnboundedQueueBench( unsigned long /* nCapacity */ ) {}
+	static const char * GetName() { return "SafeUnboundedQueue"; }
+
+	inline bool Push( const _Item & Item ) { return m_Queue.Push( Item ); }
+	inline bool Pop( _Item & Item ) { return m_Queue.Pop( Item ); }
+
+private:
+	SafeUnboundedQueue<_Item>				m_Queue;						//!< Queue under test
+};
+
+template<typename _Item>
+class BoundedQueueBench
+{
+public:
+	enum { MaxProducers = 0xFFFF, MaxConsumers = 0xFFFF };
+
+	explicit BoundedQueueBench( unsigned long nCapacity ) { m_Queue.SetMaxSize( nCapacity ); }
+	static const char * GetName() { return "SafeBoundedQueue"; }
+
+	inline bool Push( const _Item & Item ) { return m_Queue.Push( Item ); }
+	inline bool Pop( _Item & Item ) { return m_Queue.Pop( Item ); }
+
+private:
+	SafeBoundedQueue<_Item>					m_Queue;						//!< Queue under test
+};
+
+template<typename _Item>
+class SpscUnboundedQueueBench
+{
+public:
+	enum { MaxProducers = 1, MaxConsumers = 1 };
+
+	explicit SpscUnboundedQueueBench( unsigned long /* nCapacity */ ) {}
+	static const char * GetName() { return "SpscUnboundedQueue"; }
+
+	inline bool Push( const _Item & Item ) { return m_Queue.Push( Item ); }
+	inline bool Pop( _Item & Item ) { return m_Queue.Pop( Item ); }
+
+private:
+	SpscUnboundedQueue<_Item>				m_Queue;						//!< Queue under test
+};
+
+template<typename _Item>
+class SpscBoundedQueueBench
+{
+public:
+	enum { MaxProducers = 1, MaxConsumers = 1 };
+
+	explicit SpscBoundedQueueBench( unsigned long nCapacity ):m_Queue(nCapacity) {}
+	static const char * GetName() { return "SpscBoundedQueue"; }
+
+	inline bool Push( const _Item & Item ) { return m_Queue.Push( Item ); }
+	inline bool Pop( _Item & Item ) { return m_Queue.Pop( Item ); }
+
+private:
+	SpscBoundedQueue<_Item>					m_Queue;						//!< Queue under test
+};
+
+//!
+//!	@brief	C SQueue behind a lock, the way the thread pool uses it
+//!
+class LockedQueueBench
+{
+public:
+	enum { MaxProducers = 0xFFFF, MaxConsumers = 0xFFFF };
+
+	explicit LockedQueueBench( unsigned long /* nCapacity */ ) { AllocQueue( &m_Queue ); }
+	~LockedQueueBench() { FreeQueue( &m_Queue ); }
+	static const char * GetName() { return "SQueue+lock"; }
+
+	inline bool Push( const SThreadPoolTask & Item )
+	{
+		CSLocker alock( m_Lock );
+		PushQueue( &m_Queue, &Item );
+		return true;
+	}
+
+	inline bool Pop( SThreadPoolTask & Item )
+	{
+		CSLocker alock( m_Lock );
+		if( m_Queue.m_ulSize == 0 )
+			return false;
+		PopQueue( &m_Queue, &Item );
+		return true;
+	}
+
+private:
+	SQueue									m_Queue;						//!< Queue under test
+	CriticalSection							m_Lock;							//!< Queue lock
+};
+
+//!
+//!	@brief	Lock-free MPMC SRingQueue
+//!
+class RingQueueBench
+{
+public:
+	enum { MaxProducers = 0xFFFF, MaxConsumers = 0xFFFF };
+
+	explicit RingQueueBench( unsigned long nCapacity ) { AllocRingQueue( &m_Queue, nCapacity ); }
+	~RingQueueBench() { FreeRingQueue( &m_Queue ); }
+	static const char * GetName() { return "SRingQueue"; }
+
+	inline bool Push( const SThreadPoolTask & Item ) { return 0 != PushRingQueue( &m_Queue, &Item ); }
+	inline bool Pop( SThreadPoolTask & Item ) { return 0 != PopRingQueue( &m_Queue, &Item ); }
+
+private:
+	SRingQueue								m_Queue;						//!< Queue under test
+};
+
+//!
+//!	@brief	SRingQueue with sleeping consumers, pops wait up to 1 ms
+//!
+class BlockingRingQueueBench
+{
+public:
+	enum { MaxProducers = 0xFFFF, MaxConsumers = 0xFFFF };
+
+	explicit BlockingRingQueueBench( unsigned long nCapacity ) { AllocBlockingQueue( &m_Queue, nCapacity ); }
+	~BlockingRingQueueBench() { FreeBlockingQueue( &m_Queue ); }
+	static const char * GetName() { return "SBlockingQueue"; }
+
+	inline bool Push( const SThreadPoolTask & Item ) { return 0 != PushBlockingQueue( &m_Queue, &Item ); }
+	inline bool Pop( SThreadPoolTask & Item ) { return 0 != PopBlockingQueue( &m_Queue, &Item, 1 ); }
+
+private:
+	SBlockingQueue							m_Queue;						//!< Queue under test
+};
+
+//!
+//!	@brief	Pushes its share of items, spinning while the queue is full
+//!
+template<typename _Queue, typename _Item>
+class BenchProducer
+{
+public:
+	BenchProducer():m_pQueue(NULL),m_nItems(0),m_bDone(false) {}
+
+	int Produce()
+	{
+		_Item Item;
+		memset( &Item, 0, sizeof(Item) );
+
+		for( unsigned long i = 0; i < m_nItems; ++i )
+		{
+			SetStamp( Item, ( i % LATENCY_SAMPLE ) == 0 ? GetNanoseconds() : 0 );
+			while( !m_pQueue->Push( Item ) )
+				BenchYield();
+		}
+
+		m_bDone = true;
+		return 1;
+	}
+
+	_Queue *								m_pQueue;						//!< Queue under test
+	unsigned long							m_nItems;						//!< Items to push
+	volatile bool							m_bDone;						//!< All items pushed
+};
+
+//!
+//!	@brief	Pops until a poison item, records latency of sampled items
+//!
+template<typename _Queue, typename _Item>
+class BenchConsumer
+{
+public:
+	BenchConsumer():m_pQueue(NULL),m_nItems(0),m_dFinished(0),m_bDone(false) {}
+
+	int Consume()
+	{
+		_Item Item;
+
+		for( ;; )
+		{
+			if( !m_pQueue->Pop( Item ) )
+			{
+				BenchYield();
+				continue;
+			}
+
+			const unsigned long long nStamp = GetStamp( Item );
+			if( nStamp == POISON_STAMP )
+				break;
+
+			m_nItems++;
+			if( nStamp != 0 )
+				m_Histogram.Record( GetNanoseconds() - nStamp );
+		}
+
+		m_dFinished = GetSeconds();
+		m_bDone = true;
+		return 1;
+	}
+
+	_Queue *								m_pQueue;						//!< Queue under test
+	unsigned long							m_nItems;						//!< Items popped
+	double									m_dFinished;					//!< Time of the poison item
+	volatile bool							m_bDone;						//!< Poison item popped
+	LatencyHistogram						m_Histogram;					//!< Latency of sampled items
+};
+
+struct BenchOptions
+{
+	unsigned long							m_nItems;						//!< Items per run
+	unsigned long							m_nCapacity;					//!< Bounded queue capacity
+	std::vector<unsigned int>				m_Threads;						//!< Producer and consumer counts to sweep
+	bool									m_bCsv;							//!< Comma separated output
+};
+
+template<typename _Queue, typename _Item>
+static void RunBench( const BenchOptions & Options, unsigned int nProducers, unsigned int nConsumers )
+{
+	typedef BenchProducer<_Queue, _Item> Producer;
+	typedef BenchConsumer<_Queue, _Item> Consumer;
+
+	_Queue Queue( Options.m_nCapacity );
+	std::vector<Producer> Producers( nProducers );
+	std::vector<Consumer *> Consumers( nConsumers );
+	std::vector<CrossThreadNeighbor<Producer> *> ProducerThreads( nProducers );
+	std::vector<CrossThreadNeighbor<Consumer> *> ConsumerThreads( nConsumers );
+	unsigned int i;
+
+	for( i = 0; i < nProducers; ++i )
+	{
+		Producers[ i ].m_pQueue = &Queue;
+		Producers[ i ].m_nItems = Options.m_nItems / nProducers + ( i < Options.m_nItems % nProducers ? 1 : 0 );
+		ProducerThreads[ i ] = new CrossThreadNeighbor<Producer>();
+		ProducerThreads[ i ]->SetData( &Producers[ i ], &Producer::Produce );
+	}
+	for( i = 0; i < nConsumers; ++i )
+	{
+		Consumers[ i ] = new Consumer();
+		Consumers[ i ]->m_pQueue = &Queue;
+		ConsumerThreads[ i ] = new CrossThreadNeighbor<Consumer>();
+		ConsumerThreads[ i ]->SetData( Consumers[ i ], &Consumer::Consume );
+	}
+
+	const double dCpuStart = GetCpuSeconds();
+	const double dStart = GetSeconds();
+
+	for( i = 0; i < nConsumers; ++i )
+		ConsumerThreads[ i ]->Run();
+	for( i = 0; i < nProducers; ++i )
+		ProducerThreads[ i ]->Run();
+
+	//
+	// Terminating a thread before it entered its callback would skip it, wait for the work instead
+	//
+	for( i = 0; i < nProducers; ++i )
+	{
+		while( !Producers[ i ].m_bDone )
+			BenchYield();
+		delete ProducerThreads[ i ];
+	}
+
+	_Item Poison;
+	memset( &Poison, 0, sizeof(Poison) );
+	SetStamp( Poison, POISON_STAMP );
+	for( i = 0; i < nConsumers; ++i )
+	{
+		while( !Queue.Push( Poison ) )
+			BenchYield();
+	}
+
+	double dFinished = dStart;
+	unsigned long nItems = 0;
+	LatencyHistogram Latency;
+	for( i = 0; i < nConsumers; ++i )
+	{
+		while( !Consumers[ i ]->m_bDone )
+			BenchYield();
+		delete ConsumerThreads[ i ];
+
+		if( Consumers[ i ]->m_dFinished > dFinished )
+			dFinished = Consumers[ i ]->m_dFinished;
+		nItems += Consumers[ i ]->m_nItems;
+		Latency.Merge( Consumers[ i ]->m_Histogram );
+		delete Consumers[ i ];
+	}
+
+	const double dCpu = GetCpuSeconds() - dCpuStart;
+	const double dElapsed = dFinished - dStart;
+
+	if( Options.m_bCsv )
+	{
+		printf( "%s,%u,%u,%u,%lu,%.0f,%llu,%llu,%llu,%llu,%.1f\n", _Queue::GetName(), (unsigned int) sizeof(_Item), nProducers, nConsumers,
+			nItems, nItems / dElapsed, Latency.GetPercentile( 50 ), Latency.GetPercentile( 99 ), Latency.GetPercentile( 99.9 ), Latency.GetMax(),
+			dCpu * 1e9 / nItems );
+	}
+	else
+	{
+		printf( "%-20s %7u %4u %4u %10.2f %10llu %10llu %10llu %10llu %10.1f\n", _Queue::GetName(), (unsigned int) sizeof(_Item), nProducers, nConsumers,
+			nItems / dElapsed / 1e6, Latency.GetPercentile( 50 ), Latency.GetPercentile( 99 ), Latency.GetPercentile( 99.9 ), Latency.GetMax(),
+			dCpu * 1e9 / nItems );
+	}
+	fflush( stdout );
+}
+
+template<typename _Queue, typename _Item>
+static void SweepQueue( const BenchOptions & Options )
+{
+	for( size_t p = 0; p < Options.m_Threads.size(); ++p )
+	{
+		for( size_t c = 0; c < Options.m_Threads.size(); ++c )
+		{
+			if( Options.m_Threads[ p ] <= _Queue::MaxProducers && Options.m_Threads[ c ] <= _Queue::MaxConsumers )
+				RunBench<_Queue, _Item>( Options, Options.m_Threads[ p ], Options.m_Threads[ c ] );
+		}
+	}
+}
+
+template<size_t _Size>
+static void SweepPayload( const BenchOptions & Options )
+{
+	SweepQueue<UnboundedQueueBench< BenchItem<_Size> >, BenchItem<_Size> >( Options );
+	SweepQueue<BoundedQueueBench< BenchItem<_Size> >, BenchItem<_Size> >( Options );
+	SweepQueue<SpscUnboundedQueueBench< BenchItem<_Size> >, BenchItem<_Size> >( Options );
+	SweepQueue<SpscBoundedQueueBench< BenchItem<_Size> >, BenchItem<_Size> >( Options );
+}
+
+static void ParseThreads( const char * szList, std::vector<unsigned int> & Threads )
+{
+	Threads.clear();
+	while( *szList )
+	{
+		char * szEnd;
+		const unsigned long nThreads = strtoul( szList, &szEnd, 10 );
+		if( szEnd == szList )
+			break;
+		if( nThreads != 0 )
+			Threads.push_back( (unsigned int) nThreads );
+		szList = *szEnd == ',' ? szEnd + 1 : szEnd;
+	}
+}
+
+int main( int argc, char * argv[] )
+{
+	BenchOptions Options;
+	Options.m_nItems = 1000000;
+	Options.m_nCapacity = 1024;
+	Options.m_bCsv = false;
+	ParseThreads( "1,2,4", Options.m_Threads );
+
+	for( int i = 1; i < argc; ++i )
+	{
+		if( strcmp( argv[ i ], "-csv" ) == 0 )
+			Options.m_bCsv = true;
+		else if( strcmp( argv[ i ], "-items" ) == 0 && i + 1 < argc )
+			Options.m_nItems = strtoul( argv[ ++i ], NULL, 10 );
+		else if( strcmp( argv[ i ], "-capacity" ) == 0 && i + 1 < argc )
+			Options.m_nCapacity = strtoul( argv[ ++i ], NULL, 10 );
+		else if( strcmp( argv[ i ], "-threads" ) == 0 && i + 1 < argc )
+			ParseThreads( argv[ ++i ], Options.m_Threads );
+		else
+		{
+			printf( "Usage: %s [-csv] [-items N] [-capacity N] [-threads 1,2,4]\n", argv[ 0 ] );
+			return 1;
+		}
+	}
+
+	if( Options.m_nItems == 0 || Options.m_nCapacity == 0 || Options.m_Threads.empty() )
+		return 1;
+
+	if( Options.m_bCsv )
+		printf( "queue,payload,producers,consumers,items,items_per_sec,p50_ns,p99_ns,p999_ns,max_ns,cpu_ns_per_item\n" );
+	else
+		printf( "%-20s %7s %4s %4s %10s %10s %10s %10s %10s %10s\n", "queue", "payload", "prod", "cons", "Mitems/s", "p50 ns", "p99 ns", "p99.9 ns", "max ns", "cpu ns/item" );
+
+	SweepPayload<16>( Options );
+	SweepPayload<64>( Options );
+	SweepPayload<256>( Options );
+	SweepQueue<LockedQueueBench, SThreadPoolTask>( Options );
+	SweepQueue<RingQueueBench, SThreadPoolTask>( Options );
+	SweepQueue<BlockingRingQueueBench, SThreadPoolTask>( Options );
+	return 0;
+}
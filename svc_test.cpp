@@ -5,6 +5,7 @@
 
 #include "cpl/Containers/SafeUnboundedQueue.h"
 #include "cpl/Containers/SafeBoundedQueue.h"
+#include "cpl/BlockingQueue.h"
 #include "cpl/TimeTriggers.h"
 
 #include "cpl/CrossThread.h"
@@ -17,7 +18,7 @@ public:
 		nMax = 0;
 		m_nCount = 0;
 		tProducer.SetData( this, &MySvc::thrQueueProducer );
-		tConsumer.SetData( this, &MySvc::thrQueueConsumer );
+		tConsumer.SetCancelData( this, &MySvc::thrQueueConsumer );
 
 		Timer.SetInterval( 5 ); // sec
 	}
@@ -41,7 +42,7 @@ public:
 		return 0;
 	}
 
-	int32_t thrQueueConsumer()
+	int32_t thrQueueConsumer( const CancelToken & Token )
 	{
 		//
 		// Consume
@@ -51,7 +52,7 @@ public:
 		for( int i = 0 ; i < nCount + 1 ; i++ )
 		{
 			int nRes = 0;
-			if( !m_Queue.Pop( nRes ) )
+			if( !m_Queue.Pop( nRes, BLOCKING_QUEUE_INFINITE, Token ) )
 				break;
 
 			{
@@ -144,9 +145,9 @@ private:
 	TimeTrigger Timer;
 
 #if 1
-	SafeUnboundedQueue<int> m_Queue;
+	BlockingQueue< SafeUnboundedQueue<int> > m_Queue;
 #else
-	SafeBoundedQueue<int> m_Queue;
+	BlockingQueue< SafeBoundedQueue<int> > m_Queue;
 #endif
 };
 
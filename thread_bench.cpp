@@ -0,0 +1,308 @@
+//
+// CrossThread overhead benchmark: cost of one mainThread iteration around a trivial OnRun,
+// Run(true)/Stop(true) round trip latency, many neighbors on own threads vs on a shared pool
+// and timer wheel schedule/cancel cost with many idle timeouts, lateness of firing timers.
+// Built with THREAD_TRACE it also measures the cost of a trace event and exports the timeline of the run
+//
+#include "CrossThread.h"
+#include "PooledThread.h"
+#include "TimerWheel.h"
+
+#include <stdio.h>
+#include <time.h>
+
+#ifndef USE_PTHREAD_THREAD_FORCE
+static double GetSeconds()
+{
+	LARGE_INTEGER liFreq, liCounter;
+	QueryPerformanceFrequency( &liFreq );
+	QueryPerformanceCounter( &liCounter );
+	return (double) liCounter.QuadPart / (double) liFreq.QuadPart;
+}
+#else
+static double GetSeconds()
+{
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+#endif
+
+class BenchCounter
+{
+public:
+	BenchCounter():m_nCount(0) {}
+
+	int Tick()
+	{
+		m_nCount++;
+		return 0;
+	}
+
+	volatile unsigned long					m_nCount;						//!< Iterations done
+};
+
+static void BenchIteration( unsigned long nMilliseconds )
+{
+	BenchCounter Counter;
+	CrossThreadNeighbor<BenchCounter> Thread;
+	double dStart, dLoop, dDirect;
+	unsigned long i, nLoopCount;
+
+	Thread.SetData( &Counter, &BenchCounter::Tick );
+	dStart = GetSeconds();
+	Thread.Run( true );
+	sys::SleepMillisec( nMilliseconds );
+	Thread.Stop( true );
+	dLoop = GetSeconds() - dStart;
+	nLoopCount = Counter.m_nCount;
+
+	//
+	// Same callback without the thread loop around it
+	//
+	dStart = GetSeconds();
+	for( i = 0; i < nLoopCount; ++i )
+		Counter.Tick();
+	dDirect = GetSeconds() - dStart;
+
+	printf( "mainThread iteration %.1f ns, callback alone %.1f ns, overhead %.1f ns\n",
+		dLoop * 1e9 / nLoopCount, dDirect * 1e9 / nLoopCount, ( dLoop - dDirect ) * 1e9 / nLoopCount );
+}
+
+static void BenchRunStop( unsigned long nCycles )
+{
+	BenchCounter Counter;
+	CrossThreadNeighbor<BenchCounter> Thread;
+	double dStart;
+	unsigned long i;
+
+	Thread.SetData( &Counter, &BenchCounter::Tick );
+	dStart = GetSeconds();
+	for( i = 0; i < nCycles; ++i )
+	{
+		Thread.Run( true );
+		Thread.Stop( true );
+	}
+	printf( "Run(true)+Stop(true) %.1f us\n", ( GetSeconds() - dStart ) * 1e6 / nCycles );
+}
+
+//
+// Callback calls per second of nNeighbors neighbors, each on its own thread and then all on one pool
+//
+static void BenchNeighbors( unsigned long nNeighbors, unsigned long nMilliseconds )
+{
+	std::vector<BenchCounter> Counters( nNeighbors );
+	unsigned long long nCalls;
+	double dStart;
+	unsigned long i;
+
+	{
+		std::vector<CrossThreadNeighbor<BenchCounter> *> Threads;
+		for( i = 0; i < nNeighbors; ++i )
+		{
+			Threads.push_back( new CrossThreadNeighbor<BenchCounter>() );
+			Threads.back()->SetData( &Counters[ i ], &BenchCounter::Tick );
+		}
+
+		dStart = GetSeconds();
+		for( i = 0; i < nNeighbors; ++i )
+			Threads[ i ]->Run();
+		sys::SleepMillisec( nMilliseconds );
+		for( i = 0; i < nNeighbors; ++i )
+			Threads[ i ]->Stop( true );
+
+		for( nCalls = 0, i = 0; i < nNeighbors; ++i )
+		{
+			nCalls += Counters[ i ].m_nCount;
+			Counters[ i ].m_nCount = 0;
+			delete Threads[ i ];
+		}
+		printf( "%lu neighbors, own threads: %.0f calls/sec\n", nNeighbors, nCalls / ( GetSeconds() - dStart ) );
+	}
+
+	{
+		SThreadPool Pool;
+		AllocThreadPool( &Pool, 0, 0 );
+
+		std::vector<PooledThreadNeighbor<BenchCounter> *> Threads;
+		for( i = 0; i < nNeighbors; ++i )
+		{
+			Threads.push_back( new PooledThreadNeighbor<BenchCounter>( &Pool ) );
+			Threads.back()->SetData( &Counters[ i ], &BenchCounter::Tick );
+		}
+
+		dStart = GetSeconds();
+		for( i = 0; i < nNeighbors; ++i )
+			Threads[ i ]->Run();
+		sys::SleepMillisec( nMilliseconds );
+		for( i = 0; i < nNeighbors; ++i )
+			Threads[ i ]->Stop( true );
+
+		for( nCalls = 0, i = 0; i < nNeighbors; ++i )
+		{
+			nCalls += Counters[ i ].m_nCount;
+			delete Threads[ i ];
+		}
+		printf( "%lu neighbors, pool of %lu: %.0f calls/sec\n", nNeighbors, GetAvailableCpuCount(), nCalls / ( GetSeconds() - dStart ) );
+
+		FreeThreadPool( &Pool );
+	}
+}
+
+static void OnTimeout( void * pParam )
+{
+	( (BenchCounter *) pParam )->Tick();
+}
+
+static void OnFire( void * pParam )
+{
+	*(double *) pParam = GetSeconds();
+}
+
+//
+// One-shot timeout reset from its own callback while the callback still works, as a per-connection timeout is
+//
+struct BenchRearm
+{
+	TimerWheel *							m_pWheel;
+	TimerWheel::Timer						m_Timer;
+	volatile unsigned long					m_nCalls;						//!< Callback calls
+	unsigned long							m_nLimit;						//!< Calls to re-arm for
+};
+
+static void OnRearm( void * pParam )
+{
+	BenchRearm * const pRearm = (BenchRearm *) pParam;
+
+	if( ++pRearm->m_nCalls < pRearm->m_nLimit )
+		pRearm->m_pWheel->Schedule( pRearm->m_Timer, 1, &OnRearm, pRearm );
+	sys::SleepMillisec( 5 );
+}
+
+//
+// nTimers per-connection style timeouts: arm, stay idle, re-arm all, cancel all
+//
+static void BenchTimers( unsigned long nTimers, unsigned long nIdleMilliseconds )
+{
+	SThreadPool Pool;
+	BenchCounter Counter;
+	double dStart, dSchedule, dReschedule, dCancel;
+	clock_t nCpu;
+	unsigned long i;
+
+	AllocThreadPool( &Pool, 0, 0 );
+	{
+		TimerWheel Wheel( &Pool );
+		TimerWheel::Timer * Timers = new TimerWheel::Timer[ nTimers ];
+
+		dStart = GetSeconds();
+		for( i = 0; i < nTimers; ++i )
+			Wheel.Schedule( Timers[ i ], 30000 + i % 1000, &OnTimeout, &Counter );
+		dSchedule = GetSeconds() - dStart;
+
+		nCpu = clock();
+		sys::SleepMillisec( nIdleMilliseconds );
+		nCpu = clock() - nCpu;
+
+		dStart = GetSeconds();
+		for( i = 0; i < nTimers; ++i )
+			Wheel.Schedule( Timers[ i ], 30000 + i % 1000, &OnTimeout, &Counter );
+		dReschedule = GetSeconds() - dStart;
+
+		dStart = GetSeconds();
+		for( i = 0; i < nTimers; ++i )
+			Wheel.Cancel( Timers[ i ] );
+		dCancel = GetSeconds() - dStart;
+
+		delete[] Timers;
+	}
+	FreeThreadPool( &Pool );
+
+	printf( "%lu timers: schedule %.0f ns, re-schedule %.0f ns, cancel %.0f ns, idle CPU %.1f ms in %lu ms\n", nTimers,
+		dSchedule * 1e9 / nTimers, dReschedule * 1e9 / nTimers, dCancel * 1e9 / nTimers, nCpu * 1000.0 / CLOCKS_PER_SEC, nIdleMilliseconds );
+}
+
+//
+// nTimers one-shots due within 100 ms must all fire, then one re-arms itself nRearms times from its callback
+//
+static void BenchTimerFiring( unsigned long nTimers, unsigned long nRearms )
+{
+	SThreadPool Pool;
+	double dStart, dLate, dMaxLate = 0, dSumLate = 0;
+	unsigned long i, nFired = 0, nWaiting;
+
+	AllocThreadPool( &Pool, 0, 0 );
+	{
+		TimerWheel Wheel( &Pool );
+		TimerWheel::Timer * Timers = new TimerWheel::Timer[ nTimers ];
+		std::vector<double> Fired( nTimers, 0.0 );
+		BenchRearm Rearm;
+
+		dStart = GetSeconds();
+		for( i = 0; i < nTimers; ++i )
+			Wheel.Schedule( Timers[ i ], 1 + i % 100, &OnFire, &Fired[ i ] );
+		sys::SleepMillisec( 300 );
+
+		for( i = 0; i < nTimers; ++i )
+		{
+			if( Fired[ i ] == 0.0 )
+				continue;
+			nFired++;
+			dLate = Fired[ i ] - dStart - ( 1 + i % 100 ) * 1e-3;
+			dSumLate += dLate;
+			if( dLate > dMaxLate )
+				dMaxLate = dLate;
+		}
+		delete[] Timers;
+
+		Rearm.m_pWheel = &Wheel;
+		Rearm.m_nCalls = 0;
+		Rearm.m_nLimit = nRearms;
+		Wheel.Schedule( Rearm.m_Timer, 1, &OnRearm, &Rearm );
+		for( i = 0; i < 200 && ( Rearm.m_nCalls < nRearms || Rearm.m_Timer.IsScheduled() ); ++i )
+			sys::SleepMillisec( 10 );
+		nWaiting = (unsigned long) Wheel.GetTimerCount();
+
+		printf( "%lu of %lu one-shots fired, late %.2f ms on average, %.2f ms at most; re-armed one-shot called %lu of %lu times%s\n",
+			nFired, nTimers, nFired ? dSumLate * 1e3 / nFired : 0.0, dMaxLate * 1e3, (unsigned long) Rearm.m_nCalls, nRearms,
+			nFired == nTimers && Rearm.m_nCalls == nRearms && nWaiting == 0 ? "" : ", TIMERS LOST" );
+	}
+	FreeThreadPool( &Pool );
+}
+
+#ifdef THREAD_TRACE
+static void BenchTrace( unsigned long nEvents, const char * szFileName )
+{
+	double dStart;
+	unsigned long i;
+
+	THREAD_TRACE_NAME( "thread_bench" );
+	dStart = GetSeconds();
+	for( i = 0; i < nEvents; i += 2 )
+	{
+		THREAD_TRACE_BEGIN( "bench", i );
+		THREAD_TRACE_END( "bench" );
+	}
+	printf( "trace event %.1f ns\n", ( GetSeconds() - dStart ) * 1e9 / nEvents );
+
+	dStart = GetSeconds();
+	if( !ExportThreadTrace( szFileName ) )
+		printf( "trace export to %s failed\n", szFileName );
+	else
+		printf( "trace exported to %s in %.0f ms\n", szFileName, ( GetSeconds() - dStart ) * 1e3 );
+	FreeThreadTrace();
+}
+#endif
+
+int main()
+{
+	BenchIteration( 1000 );
+	BenchRunStop( 1000 );
+	BenchNeighbors( 32, 1000 );
+	BenchTimers( 50000, 1000 );
+	BenchTimerFiring( 10000, 5 );
+#ifdef THREAD_TRACE
+	BenchTrace( 10000000, "thread_bench.trace.json" );
+#endif
+	return 0;
+}